@@ -1,5 +1,6 @@
 const fs = require("fs");
 const path = require("path");
+const { execSync } = require("child_process");
 const yargs = require("yargs");
 const { hideBin } = require('yargs/helpers')
 const browserify = require("browserify");
@@ -20,6 +21,13 @@ const CONTROL_OUT = path.resolve(__dirname, "public", "js", "control.min.js");
 const SW_IN  = path.resolve(__dirname, "src", "worker.js");
 const SW_OUT = path.resolve(__dirname, "public", "js", "sw.min.js");
 
+// Emscripten scripts writing every variant into public/static/wasm, relative to their own directory
+const WASM_SCRIPTS = [
+    [path.resolve(__dirname, "src", "c"), "core.sh"],
+    [path.resolve(__dirname, "src", "c"), "ogarx.sh"],
+    [path.resolve(__dirname, "webgl", "wasm"), "compile.sh"]
+];
+
 /** @returns {Promise<string>} */
 const streamToString = stream => {
     const chunks = [];
@@ -61,6 +69,11 @@ const argv = yargs(hideBin(process.argv))
         type: 'boolean',
         description: 'Build all js files'
     })
+    .option('wasm', {
+        alias: 'w',
+        type: 'boolean',
+        description: 'Build all wasm modules (requires emcc)'
+    })
     .argv;
 
 (async () => {
@@ -100,5 +113,12 @@ const argv = yargs(hideBin(process.argv))
         }).code);
     }
 
+    if (argv.wasm) {
+        for (const [cwd, script] of WASM_SCRIPTS) {
+            console.log(`Building wasm (${script})`); bundled++;
+            execSync(`sh ${script}`, { cwd, stdio: "inherit" });
+        }
+    }
+
     if (!bundled) console.log("Nothing was bundled");
 })();
@@ -35,10 +35,28 @@ const procToStart = [];
 
 for (const proc of config) {
     proc.cwd = __dirname;
-    proc.script = "./src/index.js";
     proc.max_memory_restart = "300M";
     proc.kill_timeout = 3000;
 
+    // Several worlds in one process: { name, env, worlds: [{ mode, name, endpoint }] }
+    if (proc.worlds) {
+        const worlds = proc.worlds.filter(w => validateMode(w.mode) || 
+            console.warn(`Unable to find mode "${w.mode}", skipping world "${w.name}" in process "${proc.name}"`));
+        delete proc.worlds;
+        if (!worlds.length) continue;
+
+        proc.script = "./src/host.js";
+        proc.env.OGARX_WORLDS = JSON.stringify(worlds);
+        // One snapshot per world in this directory
+        proc.env.OGARX_SNAPSHOT = proc.env.OGARX_SNAPSHOT || path.resolve(__dirname, "snapshots", proc.name);
+        procToStart.push(proc);
+        continue;
+    }
+
+    proc.script = "./src/index.js";
+    // World survives restarts (memory limit included) through a snapshot taken on SIGINT
+    proc.env.OGARX_SNAPSHOT = proc.env.OGARX_SNAPSHOT || path.resolve(__dirname, "snapshots", `${proc.name}.bin`);
+
     if (validateMode(proc.env.OGARX_MODE)) {
         procToStart.push(proc);
     } else {
@@ -61,7 +79,10 @@ pm2.connect(err => {
         Promise.all(procToStart.map(proc => new Promise(res => {        
             pm2.start(proc, e => {
                 if (e) console.error(e);
-                else  console.log(`PM2 Process "${proc.name}" ` +
+                else if (proc.env.OGARX_WORLDS) console.log(`PM2 Process "${proc.name}" hosting ` +
+                    JSON.parse(proc.env.OGARX_WORLDS).map(w => `(${w.mode}-${w.name}) on ` +
+                    `:${proc.env.OGARX_PORT || 443}/${w.endpoint}`).join(", "));
+                else console.log(`PM2 Process "${proc.name}" ` +
                     `(${proc.env.OGARX_MODE}-${proc.env.OGARX_SERVER}) mounted on ` +
                     `:${proc.env.OGARX_PORT || 443}/${proc.env.OGARX_ENDPOINT}`);
                 res();
@@ -0,0 +1,267 @@
+const Reader = require("../network/reader");
+const Writer = require("../network/writer");
+
+// Subprotocol asking the server for no deflate, see ws-server.js
+const PACKED_PROTOCOL = "ogarx-packed";
+
+/** @template T @param {T[]} array */
+const pick = array => array[~~(Math.random() * array.length)];
+
+/**
+ * Scripted input, called every input tick before the mouse packet is sent
+ * @type {Object<string, (c: HeadlessClient, now: number) => void>}
+ */
+const Behaviours = {
+    // Sit on the spawn point
+    idle: c => (c.mouseX = c.x, c.mouseY = c.y),
+    // Head for a random point of the map, pick a new one every few seconds
+    wander: (c, now) => {
+        if (now < c.nextTarget) return;
+        c.mouseX = (Math.random() * 2 - 1) * c.hw;
+        c.mouseY = (Math.random() * 2 - 1) * c.hh;
+        c.nextTarget = now + 2000 + Math.random() * 3000;
+    },
+    // Wander with the eject macro held
+    macro: (c, now) => {
+        Behaviours.wander(c, now);
+        c.macro = 1;
+    },
+    // Wander and 64-split (6 splits at once) every 2 seconds
+    split: (c, now) => {
+        Behaviours.wander(c, now);
+        if (now < c.nextSplit) return;
+        c.splits = 6;
+        c.nextSplit = now + 2000;
+    }
+};
+
+Behaviours.mix = (c, now) => {
+    if (!c.mixed) c.mixed = pick([Behaviours.idle, Behaviours.wander, Behaviours.macro, Behaviours.split]);
+    c.mixed(c, now);
+};
+
+/**
+ * Client decoder, one client.wasm instance per client since cell state is per connection
+ */
+class ClientCore {
+
+    /**
+     * @param {WebAssembly.Module} module compiled client.wasm
+     * @param {boolean} wide 32 bit cell id build
+     */
+    static async init(module, wide = false) {
+        this.Module = module;
+        const names = WebAssembly.Module.exports(module).map(e => e.name);
+        if (!names.includes("unpack") || !names.includes("deserialize") || !names.includes("cell_data_bytes"))
+            throw new Error(`client.wasm is out of date, rebuild it with "npm run build:wasm"`);
+        // Constant exports only, a single page is enough to ask for the layout
+        const probe = await WebAssembly.instantiate(module,
+            { env: { memory: new WebAssembly.Memory({ initial: 1, maximum: 1 }), powf: Math.pow } });
+        const { cell_limit, cell_id_bytes, cell_data_bytes } = probe.exports;
+        this.ID_BYTES = cell_id_bytes();
+        if (this.ID_BYTES !== (wide ? 4 : 2)) throw new Error("client.wasm does not match the cell id width");
+        this.INDICES_OFFSET = cell_data_bytes();
+        // Largest update: every cell added (id + 8 bytes) plus 4 terminators
+        const end = this.INDICES_OFFSET + cell_limit() * (this.ID_BYTES + 8) + 4 * this.ID_BYTES;
+        // Packed packets (OP 13) after it, then the rANS tables and the column stream
+        this.PACKED_OFFSET = (end + 3) & ~3;
+        this.PAGES = Math.ceil((this.PACKED_OFFSET + 4 * (end - this.INDICES_OFFSET) + 8192) / 65536);
+    }
+
+    constructor() {
+        this.memory = new WebAssembly.Memory({ initial: ClientCore.PAGES, maximum: ClientCore.PAGES });
+        this.HEAPU8 = new Uint8Array(this.memory.buffer);
+        this.instance = new WebAssembly.Instance(ClientCore.Module, { env: { memory: this.memory, powf: Math.pow } });
+    }
+
+    /** 
+     * @param {ArrayBuffer} buffer cell data packet (OP 4, or OP 13 when packed)
+     * @param {boolean} packed
+     */
+    deserialize(buffer, packed = false) {
+        if (packed) {
+            this.HEAPU8.set(new Uint8Array(buffer), ClientCore.PACKED_OFFSET);
+            const work = (ClientCore.PACKED_OFFSET + buffer.byteLength + 3) & ~3;
+            this.instance.exports.unpack(ClientCore.PACKED_OFFSET, buffer.byteLength, work, ClientCore.INDICES_OFFSET);
+        } else this.HEAPU8.set(new Uint8Array(buffer, 25), ClientCore.INDICES_OFFSET);
+        this.instance.exports.deserialize(0, ClientCore.INDICES_OFFSET);
+    }
+}
+
+/**
+ * Headless OgarX client for load testing, speaks the same handshake and input packets as webgl/game/protocol.js
+ */
+class HeadlessClient {
+
+    /**
+     * @param {string} name
+     * @param {keyof Behaviours} behaviour
+     * @param {boolean} decode decode cell data with client.wasm
+     * @param {boolean} packed ask for packed cell data (OP 13) instead of deflate
+     */
+    constructor(name, behaviour = "wander", decode = true, packed = false) {
+        this.name = name;
+        this.packed = packed;
+        this.behaviour = Behaviours[behaviour];
+        if (!this.behaviour) throw new Error(`Unknown behaviour "${behaviour}"`);
+        this.core = decode ? new ClientCore() : null;
+
+        this.pid = 0;
+        this.hw = this.hh = 0;
+        this.x = this.y = 0;
+        this.mouseX = this.mouseY = 0;
+        this.nextTarget = this.nextSplit = 0;
+        this.splits = this.ejects = this.macro = 0;
+        this.spawned = false;
+        this.closed = false;
+
+        this.bytes = 0;
+        this.packets = 0;
+        /** @type {number[]} bytes of each cell data packet */
+        this.updateBytes = [];
+        /** @type {number[]} ms spent in client.wasm deserialize */
+        this.decodeTimes = [];
+        /** @type {number[]} ms between cell data packets */
+        this.intervals = [];
+        this.lastUpdate = 0;
+
+        this.onMessage = this.onMessage.bind(this);
+    }
+
+    /**
+     * In process, through a MessagePort handed to a server with FakeSocket
+     * @param {MessagePort} port
+     */
+    attach(port) {
+        this.port = port;
+        port.onmessage = e => {
+            const { data } = e;
+            if (data.event === "message") this.onMessage(data.message);
+            else if (data.event === "close") this.onClose(data.code, data.reason);
+        };
+        port.start();
+        this.handshake();
+    }
+
+    /** @param {string} url */
+    connect(url) {
+        if (typeof WebSocket == "undefined") throw new Error("WebSocket client requires Node 22 or later");
+        const ws = this.ws = new WebSocket(url, this.packed ? [PACKED_PROTOCOL] : []);
+        ws.binaryType = "arraybuffer";
+        ws.onopen = () => this.handshake();
+        ws.onmessage = e => this.onMessage(e.data);
+        ws.onclose = e => this.onClose(e.code, e.reason);
+        ws.onerror = () => {};
+    }
+
+    /** @param {ArrayBuffer} buffer */
+    send(buffer) {
+        if (this.closed) return;
+        if (this.port) this.port.postMessage({ event: "message", message: buffer }, [buffer]);
+        else if (this.ws && this.ws.readyState === 1) this.ws.send(buffer);
+    }
+
+    handshake() {
+        const writer = new Writer();
+        writer.writeUInt8(69);
+        writer.writeInt16(420);
+        writer.writeUTF16String(this.name);
+        writer.writeUTF16String("");
+        writer.writeUTF16String("");
+        writer.writeUInt8((ClientCore.ID_BYTES === 4 ? 1 : 0) | (this.packed ? 2 : 0));
+        this.send(writer.finalize());
+    }
+
+    spawn() {
+        const writer = new Writer();
+        writer.writeUInt8(1);
+        writer.writeUTF16String(this.name);
+        writer.writeUTF16String("");
+        writer.writeUTF16String("");
+        this.send(writer.finalize());
+        // Auto respawn from now on
+        const RESPAWN = new ArrayBuffer(1);
+        new Uint8Array(RESPAWN)[0] = 7;
+        this.send(RESPAWN);
+        this.spawned = true;
+    }
+
+    ping() {
+        const PING = new ArrayBuffer(1);
+        new Uint8Array(PING)[0] = 69;
+        this.send(PING);
+    }
+
+    /** @param {number} now */
+    input(now) {
+        if (!this.pid) return;
+        if (!this.spawned) this.spawn();
+
+        this.behaviour(this, now);
+
+        const writer = new Writer();
+        writer.writeUInt8(3);
+        writer.writeFloat32(this.mouseX);
+        writer.writeFloat32(this.mouseY);
+        writer.writeUInt8(0); // spectate
+        writer.writeUInt8(this.splits);
+        writer.writeUInt8(this.ejects);
+        writer.writeUInt8(this.macro);
+        writer.writeUInt8(0); // line lock
+        writer.writeUInt8(0); // switch tab
+        this.send(writer.finalize());
+
+        this.splits = this.ejects = this.macro = 0;
+    }
+
+    /** @param {ArrayBuffer} buffer */
+    onMessage(buffer) {
+        this.bytes += buffer.byteLength;
+        this.packets++;
+
+        const reader = new Reader(new DataView(buffer));
+        const OP = reader.readUInt8();
+        switch (OP) {
+            case 1:
+                this.pid = reader.readUInt8();
+                reader.skip(1); // dual pid
+                this.hw = reader.readUInt16();
+                this.hh = reader.readUInt16();
+                break;
+            case 4:
+            case 13: {
+                const now = performance.now();
+                if (this.lastUpdate) this.intervals.push(now - this.lastUpdate);
+                this.lastUpdate = now;
+                this.updateBytes.push(buffer.byteLength);
+
+                const header = new DataView(buffer, 1, 24);
+                this.x = header.getFloat32(16, true);
+                this.y = header.getFloat32(20, true);
+
+                if (this.core) {
+                    this.core.deserialize(buffer, OP === 13);
+                    this.decodeTimes.push(performance.now() - now);
+                }
+                break;
+            }
+        }
+    }
+
+    onClose(code, reason) {
+        if (this.closed) return;
+        this.closed = true;
+        this.closeCode = code;
+        this.closeReason = reason;
+    }
+
+    close() {
+        if (this.port) {
+            this.port.postMessage({ event: "close", code: 1000, message: "Load test over" });
+            this.port.close();
+        } else if (this.ws) this.ws.close(1000);
+        this.closed = true;
+    }
+}
+
+module.exports = { HeadlessClient, ClientCore, Behaviours };
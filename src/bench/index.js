@@ -0,0 +1,162 @@
+const fs = require("fs");
+const path = require("path");
+const yargs = require("yargs");
+const { hideBin } = require("yargs/helpers");
+const { MessageChannel } = require("worker_threads");
+
+const { HeadlessClient, ClientCore, Behaviours } = require("./client");
+
+const argv = yargs(hideBin(process.argv))
+    .usage("node src/bench [options]\n\nDrive a server with headless OgarX clients and report tick and decode times")
+    .option("clients", {
+        alias: "n",
+        type: "number",
+        default: 50,
+        description: "Number of clients"
+    })
+    .option("behaviour", {
+        alias: "b",
+        choices: Object.keys(Behaviours),
+        default: "mix",
+        description: "Scripted input of every client"
+    })
+    .option("mode", {
+        alias: "m",
+        type: "string",
+        default: "default/mega",
+        description: "Game mode of the in-process server"
+    })
+    .option("url", {
+        alias: "u",
+        type: "string",
+        description: "Connect to a running server over WebSocket instead (e.g. ws://localhost:3000/mega)"
+    })
+    .option("duration", {
+        alias: "d",
+        type: "number",
+        default: 60,
+        description: "Seconds to measure after every client connected"
+    })
+    .option("ramp", {
+        type: "number",
+        default: 20,
+        description: "Milliseconds between two connections"
+    })
+    .option("decode", {
+        type: "boolean",
+        default: true,
+        description: "Decode cell data with client.wasm"
+    })
+    .option("packed", {
+        type: "boolean",
+        default: false,
+        description: "Ask for packed cell data (OP 13) instead of deflate"
+    })
+    .option("wide", {
+        type: "boolean",
+        default: !!process.env.OGARX_WIDE_IDS,
+        description: "32 bit cell id builds"
+    })
+    .argv;
+
+const WASM_DIR = path.resolve(__dirname, "..", "..", "public", "static", "wasm");
+const CLIENT_PATH = path.resolve(WASM_DIR, argv.wide ? "client-wide.wasm" : "client.wasm");
+const CORE_PATH  = path.resolve(WASM_DIR, argv.wide ? "server-wide.wasm" : "server.wasm");
+const PROTOCOL_PATH = path.resolve(WASM_DIR, argv.wide ? "ogarx-wide.wasm" : "ogarx.wasm");
+
+if (argv.wide && ![CLIENT_PATH, CORE_PATH, PROTOCOL_PATH].every(p => fs.existsSync(p)))
+    throw new Error(`--wide needs the -wide builds of client, server and ogarx, build them with "npm run build:wasm"`);
+
+/** @param {number[]} samples */
+const percentiles = samples => {
+    if (!samples.length) return "n/a";
+    const sorted = Float64Array.from(samples).sort();
+    const at = p => sorted[Math.min(sorted.length - 1, ~~(sorted.length * p))];
+    return [0.5, 0.9, 0.99].map(p => `p${p * 100} ${at(p).toFixed(2)}`).join(", ") +
+        `, max ${sorted[sorted.length - 1].toFixed(2)}`;
+};
+
+/** @param {number[][]} arrays */
+const flat = arrays => arrays.reduce((prev, curr) => (prev.push(...curr), prev), []);
+
+/** @type {number[]} ms per engine tick, in process only */
+const tickTimes = [];
+
+/** @returns {Promise<(client: HeadlessClient) => void>} */
+const startServer = async () => {
+    if (argv.url) return client => client.connect(argv.url);
+
+    const ThreadServer = require("../network/thread-server");
+    const OgarXProtocol = require("../network/protocols/ogarx");
+
+    // Not opened, connections are accepted directly instead of from a host
+    const server = new ThreadServer("Load Test");
+    const engine = server.game.engine;
+    server.setGameMode(argv.mode);
+
+    await engine.init(fs.readFileSync(CORE_PATH));
+    await OgarXProtocol.init(fs.readFileSync(PROTOCOL_PATH), Math.max(10, argv.clients >> 1), argv.wide);
+
+    // Physics plus encoding and sending for every client
+    const tick = engine.tick.bind(engine);
+    engine.tick = dt => {
+        const start = performance.now();
+        tick(dt);
+        tickTimes.push(performance.now() - start);
+    };
+    engine.start();
+
+    return client => {
+        const { port1, port2 } = new MessageChannel();
+        server.accept(port1, "127.0.0.1", "");
+        client.attach(port2);
+    };
+};
+
+(async () => {
+    await ClientCore.init(new WebAssembly.Module(fs.readFileSync(CLIENT_PATH)), argv.wide);
+    const connect = await startServer();
+
+    /** @type {HeadlessClient[]} */
+    const clients = [];
+    const inputInterval = setInterval(() => {
+        const now = performance.now();
+        for (const c of clients) c.input(now);
+    }, 1000 / 33);
+    const pingInterval = setInterval(() => clients.forEach(c => c.ping()), 1000);
+
+    for (let i = 0; i < argv.clients; i++) {
+        const client = new HeadlessClient(`Load ${i}`, argv.behaviour, argv.decode, argv.packed);
+        connect(client);
+        clients.push(client);
+        await new Promise(resolve => setTimeout(resolve, argv.ramp));
+    }
+    console.log(`${clients.length} clients connected (${argv.behaviour}), measuring for ${argv.duration}s`);
+
+    // Drop the ramp up from the samples
+    tickTimes.length = 0;
+    for (const c of clients) c.updateBytes.length = c.decodeTimes.length = c.intervals.length = 0;
+
+    await new Promise(resolve => setTimeout(resolve, argv.duration * 1000));
+
+    clearInterval(inputInterval);
+    clearInterval(pingInterval);
+
+    const open = clients.filter(c => !c.closed);
+    const closed = clients.filter(c => c.closed);
+    const updates = flat(clients.map(c => c.updateBytes));
+    const kb = updates.reduce((a, b) => a + b, 0) / 1024;
+
+    console.log(`Clients:           ${open.length} open, ${closed.length} closed` +
+        (closed.length ? ` (first: ${closed[0].closeCode} ${closed[0].closeReason})` : ""));
+    if (!argv.url)
+        console.log(`Server tick (ms):  ${percentiles(tickTimes)}`);
+    console.log(`Update gap (ms):   ${percentiles(flat(clients.map(c => c.intervals)))}`);
+    console.log(`Bytes per tick:    ${percentiles(updates)}`);
+    console.log(`Decode (ms):       ${argv.decode ? percentiles(flat(clients.map(c => c.decodeTimes))) : "off"}`);
+    console.log(`Bandwidth:         ${(kb / argv.duration).toFixed(1)} kb/s total, ` +
+        `${(kb / argv.duration / Math.max(1, clients.length)).toFixed(1)} kb/s per client`);
+
+    clients.forEach(c => c.close());
+    process.exit(0);
+})();
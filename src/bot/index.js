@@ -14,75 +14,60 @@ module.exports = class Bot extends Handle {
         this.controller.skin = BOTS.skins.length ? pick(BOTS.skins) : "";
 
         this.__nextActionTick = 0;
+        this.__nextSplitTick = 0;
+        this.action = 0;
 
         this.game.emit("join", this.controller);
     };
 
-    get myCellIDs() { return this.game.engine.counters[this.controller.id]; }
+    get myCellIDs() { return this.game.engine.cellsOf(this.controller.id); }
     
     set nextAction(v) { this.__nextActionTick = this.game.engine.__now + 1000 * v; }
 
     onTick() {
 
         const c = this.controller;
-        const g = this.game;
-        const e = g.engine;
-        const cells = e.cells;
-        const s = e.options.PLAYER_SPAWN_SIZE;
+        const e = this.game.engine;
         
         if (e.__now < this.__nextActionTick) return;
-        
-        // if (!this.controller.alive || this.controller.score < s * s / 500) 
-        //     this.controller.spawn = true;
-        
-        // this.controller.ejectMarco = true;
-        // this.controller.splitAttempts = 7;
-        // this.controller.mouseX = this.controller.viewportX;
-        // this.controller.mouseY = this.controller.viewportY;
 
         // Less than 20% of or spawn mass and 3 second spawn cooldown
         if (!c.alive || c.score < e.options.BOT_SPAWN_SIZE * e.options.BOT_SPAWN_SIZE * 0.002) {
             c.requestSpawn();
             this.nextAction = 3;
-            // console.log("BOT SPAWN");
-        } else {
-            let canEjectCount = 0;
-            for (const cell_id of this.myCellIDs)
-                if (cells[cell_id].r > e.options.PLAYER_MIN_EJECT_SIZE) canEjectCount++;
+        }
+    };
 
-            if (canEjectCount > 3) {
-                c.ejectMarco = true;
-                c.mouseX = c.viewportX;
-                c.mouseY = c.viewportY;
+    /**
+     * Output of the wasm bot brain (Engine.thinkBots)
+     * @param {number} x mouse x
+     * @param {number} y mouse y
+     * @param {number} split 
+     * @param {number} action 0 idle, 1 feed, 2 chase, 3 flee, 4 split kill
+     */
+    command(x, y, split, action) {
+        const c = this.controller;
+        const e = this.game.engine;
 
-                this.nextAction = 1; // 1 sec
-            } else {
-                
-                if (Math.random() < 0.1) {
-                    if (e.options.PLAYER_MAX_CELLS > 16 && this.myCellIDs.size < 20 && this.controller.score < 40000) {
-                        // Solotrick to random direction
-                        c.ejectMarco = true;
-                        c.splitAttempts = 7;
-                        this.nextAction = 5;
-                    } else {
-                        c.splitAttempts = ~~(1 + Math.random() * 3);
-                        this.nextAction = 3;
-                    }
-                    
-                    const a = Math.random() * Math.PI * 2;
-                    c.mouseX = c.viewportX + 5000 * Math.sin(a);
-                    c.mouseY = c.viewportY + 5000 * Math.cos(a);
-                } else {
-                    // Idle
-                    c.ejectMarco = false;
-                    c.mouseX = c.viewportX;
-                    c.mouseY = c.viewportY;
-                    this.nextAction = 1;
-                    // console.log("BOT IDEL");
-                }
+        this.action = action;
+        c.ejectMarco = false;
+        if (!action) {
+            // Nothing in sight, wander to a random point of the map
+            const o = e.options;
+            if (Math.abs(c.mouseX - c.viewportX) < 500 && Math.abs(c.mouseY - c.viewportY) < 500) {
+                c.mouseX = (Math.random() * 2 - 1) * o.MAP_HW;
+                c.mouseY = (Math.random() * 2 - 1) * o.MAP_HH;
             }
+            return;
         }
-    };
+
+        c.mouseX = x;
+        c.mouseY = y;
+        if (split && e.__now > this.__nextSplitTick) {
+            c.splitAttempts = 1;
+            this.__nextSplitTick = e.__now + e.options.BOT_SPLIT_COOLDOWN;
+        }
+    }
 
     /** @param {string} err */
     onError(err) {};
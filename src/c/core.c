@@ -1,17 +1,33 @@
 #include "memory.h"
 #include <math.h>
 
+// Build with -DWIDE_IDS for 32 bit cell ids, the protocol and client must be built the same way
+#ifdef WIDE_IDS
+typedef unsigned int cell_id;
+#define CELL_LIMIT 262144
+#else
+typedef unsigned short cell_id;
+#define CELL_LIMIT 65536
+#endif
+
 typedef struct {
     float x;
     float y;
     float r;
     unsigned char type;
     unsigned char flags;
-    unsigned short eatenBy;
+#ifdef WIDE_IDS
+    unsigned short pad;
+#else
+    cell_id eatenBy;
+#endif
     float age;
     float boostX;
     float boostY;
     float boost;
+#ifdef WIDE_IDS
+    cell_id eatenBy;
+#endif
 } Cell;
 
 typedef struct {
@@ -24,9 +40,98 @@ typedef struct {
     void* bl;
     void* br;
     unsigned short count;
-    unsigned short indices; // placeholder
+    cell_id indices; // placeholder
 } QuadNode;
 
+// Same player contact cache (verlet list with a skin)
+#define CONTACT_POOL 131072
+
+typedef struct {
+    float x;
+    float y;
+    float r;
+} ContactRef;
+
+typedef struct {
+    unsigned int offset;
+    unsigned int count;
+    unsigned short cells;
+    unsigned char active;
+    unsigned char pad;
+} ContactList;
+
+typedef struct {
+    cell_id a;
+    cell_id b;
+} Contact;
+
+typedef struct {
+    unsigned char dirty[256]; // written by js when a player gains or loses a cell
+    unsigned char seen[256]; // players resolved this tick, kept here since side modules get no stack
+    ContactList lists[256];
+    unsigned int flip;
+    ContactRef refs[CELL_LIMIT];
+    Contact pairs[2][CONTACT_POOL];
+} ContactCache;
+
+// Coarse occupancy bitmap for spawning, a tile is set if any cell's box touches it
+#define SPAWN_GRID_MAX 256
+
+typedef struct {
+    float out_x;
+    float out_y;
+    unsigned int seed;
+    unsigned int n;
+    float l;
+    float b;
+    float tile_w;
+    float tile_h;
+    unsigned char tiles[SPAWN_GRID_MAX * SPAWN_GRID_MAX];
+} SpawnGrid;
+
+// New ids are picked by position: the spawn bounds are split into a Morton ordered grid of buckets,
+// each owning an equal range of ids with its own round robin cursor. Cells close on the map get Cell
+// structs close in memory, so a quadtree leaf touches a few cache lines instead of the whole array.
+// A full bucket spills into the following ranges, the next buckets in Morton order
+#ifdef WIDE_IDS
+#define ID_GRID_BITS 5
+#else
+#define ID_GRID_BITS 4
+#endif
+#define ID_GRID (1 << ID_GRID_BITS)
+#define ID_BUCKETS (ID_GRID * ID_GRID)
+#define ID_BUCKET_SIZE (CELL_LIMIT / ID_BUCKETS)
+
+// Freed ids are held in a FIFO for the next ID_HOLD frees before alloc_id hands them out again. A client
+// that skipped frames still has the old cell under the id, the new one would reach it as an update
+// (no type) instead of an add. The round robin cursors alone reuse an id within ticks in a crowded bucket
+#ifdef WIDE_IDS
+#define ID_HOLD 16384
+#else
+#define ID_HOLD 4096
+#endif
+
+// Per type membership as intrusive doubly linked lists (0 terminates, id 0 is never a cell).
+// flatten_indices writes the removed cells and then every type in order into the indices buffer
+typedef struct {
+    unsigned int count[256];
+    unsigned int offset[256]; // start of each type in the last flattened indices
+    unsigned int removed_count;
+    cell_id head[256];
+    cell_id tail[256];
+    cell_id next[CELL_LIMIT];
+    cell_id prev[CELL_LIMIT];
+    cell_id removed[CELL_LIMIT]; // removed during the last resolve, cleared by the next update
+    float id_l;
+    float id_b;
+    float id_scale_x;
+    float id_scale_y;
+    cell_id cursor[ID_BUCKETS]; // next id to try in each bucket, relative to its range
+    cell_id held[ID_HOLD]; // last freed ids, the one at held_next goes out first
+    unsigned int held_next;
+    unsigned char holding[CELL_LIMIT]; // set while an id is in held
+} CellLists;
+
 #define IS_PLAYER(type) type <= 250
 #define NOT_PLAYER(type) type > 250
 #define IS_DEAD(type) type == 251
@@ -51,29 +156,126 @@ typedef struct {
 extern float get_score(unsigned char id);
 extern void unlock_line(unsigned char id);
 
-extern void remove_cell(unsigned short id, unsigned char type, 
-    unsigned short eatenBy, unsigned char eatenByType);
+extern void remove_cell(cell_id id, unsigned char type, 
+    cell_id eatenBy, unsigned char eatenByType);
 extern void split_virus(float x, float y, float boostX, float boostY);
-extern void pop_player(unsigned short id, unsigned char type, float mass);
-extern void tree_update(unsigned short id);
+extern void pop_player(cell_id id, unsigned char type, float mass);
+extern void tree_update(cell_id id);
 
 size_t bytes_per_cell() { return sizeof(Cell); }
+size_t cell_id_bytes() { return sizeof(cell_id); }
+size_t cell_limit() { return CELL_LIMIT; }
+size_t eaten_by_offset() { return __builtin_offsetof(Cell, eatenBy); }
+size_t contact_cache_size() { return sizeof(ContactCache); }
+size_t spawn_grid_size() { return sizeof(SpawnGrid); }
+size_t cell_lists_size() { return sizeof(CellLists); }
+
+static inline void link_cell(CellLists* lists, cell_id id, unsigned char type) {
+    cell_id tail = lists->tail[type];
+    lists->prev[id] = tail;
+    lists->next[id] = 0;
+    if (tail) lists->next[tail] = id;
+    else lists->head[type] = id;
+    lists->tail[type] = id;
+    lists->count[type]++;
+}
+
+static inline void unlink_cell(CellLists* lists, cell_id id, unsigned char type) {
+    cell_id prev = lists->prev[id];
+    cell_id next = lists->next[id];
+    if (prev) lists->next[prev] = next;
+    else lists->head[type] = next;
+    if (next) lists->prev[next] = prev;
+    else lists->tail[type] = prev;
+    lists->next[id] = lists->prev[id] = 0;
+    lists->count[type]--;
+}
+
+// Drop every cell of a type from its list (the cells themselves are left alone)
+void hold_id(CellLists* lists, cell_id id) {
+    if (lists->holding[id]) return;
+    cell_id out = lists->held[lists->held_next];
+    if (out) lists->holding[out] = 0;
+    lists->held[lists->held_next] = id;
+    lists->holding[id] = 1;
+    lists->held_next = (lists->held_next + 1) & (ID_HOLD - 1);
+}
+
+void clear_type(CellLists* lists, unsigned char type) {
+    cell_id id = lists->head[type];
+    while (id) {
+        cell_id next = lists->next[id];
+        lists->next[id] = lists->prev[id] = 0;
+        hold_id(lists, id);
+        id = next;
+    }
+    lists->head[type] = lists->tail[type] = 0;
+    lists->count[type] = 0;
+}
 
 #define UPDATE_BITS 0x12
-unsigned char get_cell_updated(Cell ptr[], unsigned short id) { 
+unsigned char get_cell_updated(Cell ptr[], cell_id id) { 
     return IS_PLAYER(ptr[id].type) || (ptr[id].flags & UPDATE_BITS); 
 };
 
-float get_cell_x(Cell ptr[], unsigned short id) { return ptr[id].x; };
-float get_cell_y(Cell ptr[], unsigned short id) { return ptr[id].y; };
-unsigned short get_cell_r(Cell ptr[], unsigned short id) { return ptr[id].r; };
-unsigned char  get_cell_type(Cell ptr[], unsigned short id) { return ptr[id].type; };
-unsigned short get_cell_eatenby(Cell ptr[], unsigned short id) { return ptr[id].eatenBy; };
+float get_cell_x(Cell ptr[], cell_id id) { return ptr[id].x; };
+float get_cell_y(Cell ptr[], cell_id id) { return ptr[id].y; };
+unsigned short get_cell_r(Cell ptr[], cell_id id) { return ptr[id].r; };
+unsigned char  get_cell_type(Cell ptr[], cell_id id) { return ptr[id].type; };
+cell_id get_cell_eatenby(Cell ptr[], cell_id id) { return ptr[id].eatenBy; };
+
+// Bounds the id grid covers, positions outside go to the edge buckets
+void set_id_grid(CellLists* lists, float l, float r, float b, float t) {
+    lists->id_l = l;
+    lists->id_b = b;
+    lists->id_scale_x = r > l ? ID_GRID / (r - l) : 0.f;
+    lists->id_scale_y = t > b ? ID_GRID / (t - b) : 0.f;
+}
+
+static inline unsigned int id_tile(float v, float min, float scale) {
+    int i = (v - min) * scale;
+    return i < 0 ? 0 : i >= ID_GRID ? ID_GRID - 1 : i;
+}
+
+// Interleave the low 16 bits with zeros
+static inline unsigned int spread_bits(unsigned int v) {
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Free id for a cell at x, y (the world can't be full, callers check the cell count)
+cell_id alloc_id(Cell cells[], CellLists* lists, float x, float y) {
+    unsigned int bucket = spread_bits(id_tile(x, lists->id_l, lists->id_scale_x)) |
+        (spread_bits(id_tile(y, lists->id_b, lists->id_scale_y)) << 1);
+    unsigned int base = bucket * ID_BUCKET_SIZE;
+    unsigned int cursor = lists->cursor[bucket];
+
+    for (unsigned int i = 0; i < ID_BUCKET_SIZE; i++) {
+        unsigned int offset = (cursor + i) & (ID_BUCKET_SIZE - 1);
+        cell_id id = base + offset;
+        if (!id || (cells[id].flags & EXIST_BIT) || lists->holding[id]) continue;
+        lists->cursor[bucket] = (offset + 1) & (ID_BUCKET_SIZE - 1);
+        return id;
+    }
+
+    // Next free id that isn't held, a held one when every free id is (a nearly full world)
+    cell_id id = (base + ID_BUCKET_SIZE) & (CELL_LIMIT - 1);
+    cell_id held = 0;
+    for (unsigned int i = 0; i < CELL_LIMIT; i++, id = (id + 1) & (CELL_LIMIT - 1)) {
+        if (!id || (cells[id].flags & EXIST_BIT)) continue;
+        if (!lists->holding[id]) return id;
+        if (!held) held = id;
+    }
+    return held;
+}
 
-unsigned short new_cell(Cell cells[], unsigned short next_id, float x, float y, float size, unsigned char type, 
+cell_id new_cell(Cell cells[], CellLists* lists, float x, float y, float size, unsigned char type, 
     float boost_x, float boost_y, float boost) {
     
-    while (!next_id || (cells[next_id].flags & EXIST_BIT)) next_id++;
+    cell_id next_id = alloc_id(cells, lists, x, y);
 
     Cell* cell = &cells[next_id];
 
@@ -86,18 +288,24 @@ unsigned short new_cell(Cell cells[], unsigned short next_id, float x, float y,
     cell->boost = boost;
     cell->flags = EXIST_BIT;
 
+    link_cell(lists, next_id, type);
+
     return next_id;
 }
 
-unsigned short kill_cell(Cell cells[], unsigned short id, unsigned short next_id) {
+cell_id kill_cell(Cell cells[], CellLists* lists, cell_id id) {
     
-    while (!next_id || (cells[next_id].flags & EXIST_BIT)) next_id++;
-
     Cell* old_cell = &cells[id];
+    cell_id next_id = alloc_id(cells, lists, old_cell->x, old_cell->y);
+
     Cell* new_cell = &cells[next_id];
 
+    unlink_cell(lists, id, old_cell->type);
+    link_cell(lists, next_id, 251);
+
     memcpy(new_cell, old_cell, sizeof(Cell));
     memset(old_cell, 0, sizeof(Cell));
+    hold_id(lists, id);
 
     new_cell->type = 251;
     new_cell->flags = EXIST_BIT;
@@ -106,7 +314,17 @@ unsigned short kill_cell(Cell cells[], unsigned short id, unsigned short next_id
     return next_id;
 }
 
-void update(Cell cells[], unsigned short* ptr, float dt,
+// Remove a cell without leaving a dead cell (handed over to another region),
+// it is cleared by the next update like the cells removed in resolve
+void drop_cell(Cell cells[], CellLists* lists, cell_id id) {
+    unlink_cell(lists, id, cells[id].type);
+    lists->removed[lists->removed_count++] = id;
+    hold_id(lists, id);
+    cells[id].flags |= REMOVE_BIT;
+    cells[id].eatenBy = 0;
+}
+
+void update(Cell cells[], cell_id* ptr, float dt,
     unsigned int eject_max_age,
     float auto_size, float decay_min, float static_decay, float dynamic_decay,
     float l, float r, float b, float t) {
@@ -192,7 +410,7 @@ void update(Cell cells[], unsigned short* ptr, float dt,
     }
 }
 
-void update_player_cells(Cell cells[], unsigned short* indices, unsigned int n,
+void update_player_cells(Cell cells[], cell_id* indices, unsigned int n,
     float mouse_x, float mouse_y, 
     unsigned char lock_dir, float a, float b, float c, 
     float dt,
@@ -312,7 +530,147 @@ int is_safe(Cell* cells, float x, float y, float r, QuadNode* root, QuadNode** s
     return counter;
 }
 
-void sort_indices(Cell cells[], unsigned short indices[], int n) {
+// xorshift32
+static inline float grid_random(SpawnGrid* grid, float min, float max) {
+    unsigned int x = grid->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    grid->seed = x;
+    return min + (x >> 8) * (1.f / 16777216.f) * (max - min);
+}
+
+static inline int grid_tile(float v, float min, float size, int n) {
+    int i = (v - min) / size;
+    return i < 0 ? 0 : i >= n ? n - 1 : i;
+}
+
+static inline void grid_mark(SpawnGrid* grid, float x, float y, float r) {
+    int n = grid->n;
+    int x0 = grid_tile(x - r, grid->l, grid->tile_w, n);
+    int x1 = grid_tile(x + r, grid->l, grid->tile_w, n);
+    int y0 = grid_tile(y - r, grid->b, grid->tile_h, n);
+    int y1 = grid_tile(y + r, grid->b, grid->tile_h, n);
+    for (int ty = y0; ty <= y1; ty++)
+        memset(&grid->tiles[ty * n + x0], 1, x1 - x0 + 1);
+}
+
+static inline unsigned char grid_free(SpawnGrid* grid, float x, float y, float r) {
+    int n = grid->n;
+    int x0 = grid_tile(x - r, grid->l, grid->tile_w, n);
+    int x1 = grid_tile(x + r, grid->l, grid->tile_w, n);
+    int y0 = grid_tile(y - r, grid->b, grid->tile_h, n);
+    int y1 = grid_tile(y + r, grid->b, grid->tile_h, n);
+    for (int ty = y0; ty <= y1; ty++) {
+        unsigned char* row = &grid->tiles[ty * n];
+        for (int tx = x0; tx <= x1; tx++) if (row[tx]) return 0;
+    }
+    return 1;
+}
+
+// Rasterize every cell that blocks spawning from the serialized quadtree
+void build_spawn_grid(Cell cells[], QuadNode* root, QuadNode** sp, SpawnGrid* grid,
+    unsigned int n, float l, float r, float b, float t, unsigned char ignoreType) {
+
+    if (n > SPAWN_GRID_MAX) n = SPAWN_GRID_MAX;
+    if (!n) n = 1;
+
+    grid->n = n;
+    grid->l = l;
+    grid->b = b;
+    grid->tile_w = (r - l) / n;
+    grid->tile_h = (t - b) / n;
+    memset(grid->tiles, 0, n * n);
+
+    QuadNode** node_stack_pointer = sp;
+    *node_stack_pointer++ = root;
+
+    QuadNode* curr;
+
+    while (node_stack_pointer > sp) {
+        curr = *--node_stack_pointer;
+
+        if (curr->tl) {
+            *node_stack_pointer++ = curr->br;
+            *node_stack_pointer++ = curr->bl;
+            *node_stack_pointer++ = curr->tr;
+            *node_stack_pointer++ = curr->tl;
+        }
+
+        for (unsigned int i = 0; i < curr->count; i++) {
+            Cell* cell = &cells[*(&curr->indices + i)];
+            if (cell->type > ignoreType || (cell->flags & REMOVE_BIT)) continue;
+            grid_mark(grid, cell->x, cell->y, cell->r);
+        }
+    }
+}
+
+// Sample a point in [l, r] x [b, t] whose surrounding tiles are all free, confirmed
+// with one exact check. The spot is reserved in the grid so spawns in the same tick
+// don't stack. Returns attempts on success (point in out_x, out_y), 0 on failure.
+int sample_safe_point(Cell* cells, QuadNode* root, QuadNode** sp, SpawnGrid* grid,
+    float l, float r, float b, float t, float radius, unsigned char ignoreType, unsigned int tries) {
+
+    if (r < l) r = l;
+    if (t < b) t = b;
+
+    unsigned int lookups = tries << 2;
+    int attempts = 0;
+
+    while (lookups-- && tries) {
+        attempts++;
+        float x = grid_random(grid, l, r);
+        float y = grid_random(grid, b, t);
+        if (!grid_free(grid, x, y, radius)) continue;
+
+        tries--;
+        if (is_safe(cells, x, y, radius, root, sp, ignoreType) < 0) continue;
+
+        grid_mark(grid, x, y, radius);
+        grid->out_x = x;
+        grid->out_y = y;
+        return attempts;
+    }
+
+    return 0;
+}
+
+// Spawn up to n cells of one type at random points in one pass and write their ids to out.
+// With a safe radius the points come from the spawn grid (like sample_safe_point),
+// otherwise they're uniform in the box. Returns how many cells were spawned.
+unsigned int spawn_batch(Cell cells[], CellLists* lists, QuadNode* root, QuadNode** sp, SpawnGrid* grid,
+    cell_id* out, unsigned int n,
+    unsigned char type, float size, float safe_radius, unsigned char ignoreType, unsigned int tries,
+    float l, float r, float b, float t) {
+
+    unsigned int spawned = 0;
+
+    l += size;
+    r -= size;
+    b += size;
+    t -= size;
+
+    while (spawned < n) {
+        float x;
+        float y;
+
+        if (safe_radius > 0.f) {
+            if (!sample_safe_point(cells, root, sp, grid,
+                l, r, b, t, safe_radius, ignoreType, tries)) break;
+            x = grid->out_x;
+            y = grid->out_y;
+        } else {
+            x = grid_random(grid, l, r);
+            y = grid_random(grid, b, t);
+        }
+
+        out[spawned++] = new_cell(cells, lists, x, y, size, type, 0.f, 0.f, 0.f);
+    }
+
+    return spawned;
+}
+
+void sort_indices(Cell cells[], cell_id indices[], int n) {
     if (!n) return;
     
     int t = 0;
@@ -368,6 +726,30 @@ void sort_indices(Cell cells[], unsigned short indices[], int n) {
     }
 }
 
+// Write the removed cells (optional) and then every type in order to out, 0 terminated.
+// Player ranges are sorted when sort is set. Returns the number of ids written including the 0
+unsigned int flatten_indices(Cell cells[], CellLists* lists, cell_id* out,
+    unsigned char with_removed, unsigned char sort) {
+
+    cell_id* write = out;
+
+    if (with_removed) {
+        memcpy(write, lists->removed, lists->removed_count * sizeof(cell_id));
+        write += lists->removed_count;
+    }
+
+    for (unsigned int type = 0; type < 256; type++) {
+        lists->offset[type] = write - out;
+        cell_id* start = write;
+        for (cell_id id = lists->head[type]; id; id = lists->next[id]) *write++ = id;
+        if (sort && IS_PLAYER(type)) sort_indices(cells, start, write - start);
+    }
+
+    *write++ = 0;
+
+    return write - out;
+}
+
 #define PHYSICS_NON 0
 #define PHYSICS_EAT 1
 #define PHYSICS_COL 2
@@ -378,18 +760,210 @@ extern float get_line_a(unsigned char id);
 extern float get_line_b(unsigned char id);
 extern float get_line_c(unsigned char id);
 
-extern void console_log(unsigned short id);
+extern void console_log(cell_id id);
+
+// Resolve same player collisions from the contact cache instead of the quadtree.
+// Each player's list holds every pair closer than r1 + r2 + skin when it was built,
+// and it's only rebuilt when the player gained/lost a cell (dirty) or when any cell
+// drifted more than half the skin relative to the cluster, since a pair outside the
+// list can't touch before that happens.
+unsigned int resolve_contacts(Cell cells[], cell_id* ptr,
+    ContactCache* cache, unsigned int no_colli_delay, float skin) {
+
+    unsigned char* seen = cache->seen;
+    memset(seen, 0, 256);
+
+    Contact* prev = cache->pairs[cache->flip];
+    Contact* next = cache->pairs[cache->flip ^ 1];
+    unsigned int written = 0;
+    unsigned int collisions = 0;
+    float half_skin = skin * 0.5f;
+
+    // Player cells are at the front of the indices, grouped by type
+    while (*ptr && IS_PLAYER(cells[*ptr].type)) {
+        unsigned char type = cells[*ptr].type;
+        cell_id* run = ptr;
+        while (*ptr && cells[*ptr].type == type) ptr++;
+        unsigned int n = ptr - run;
+
+        ContactList* list = &cache->lists[type];
+        seen[type] = 1;
+
+        unsigned char valid = list->active && !cache->dirty[type] && list->cells == n;
+
+        if (valid) {
+            // Translating the whole cluster doesn't create new contacts
+            float vx = 0.f;
+            float vy = 0.f;
+            for (unsigned int i = 0; i < n; i++) {
+                ContactRef* ref = &cache->refs[run[i]];
+                vx += cells[run[i]].x - ref->x;
+                vy += cells[run[i]].y - ref->y;
+            }
+            vx /= n;
+            vy /= n;
+
+            for (unsigned int i = 0; i < n; i++) {
+                Cell* cell = &cells[run[i]];
+                ContactRef* ref = &cache->refs[run[i]];
+                float dx = cell->x - ref->x - vx;
+                float dy = cell->y - ref->y - vy;
+                float budget = half_skin - (cell->r > ref->r ? cell->r - ref->r : 0.f);
+                if (budget < 0.f || dx * dx + dy * dy > budget * budget) {
+                    valid = 0;
+                    break;
+                }
+            }
+        }
+
+        if (valid) {
+            if (written + list->count > CONTACT_POOL) {
+                valid = 0;
+            } else {
+                memcpy(next + written, prev + list->offset, list->count * sizeof(Contact));
+                list->offset = written;
+                written += list->count;
+            }
+        }
+
+        if (!valid) {
+            cache->dirty[type] = 0;
+            list->offset = written;
+            list->count = 0;
+            list->cells = n;
+            list->active = 1;
+
+            for (unsigned int i = 0; i < n; i++) {
+                ContactRef* ref = &cache->refs[run[i]];
+                ref->x = cells[run[i]].x;
+                ref->y = cells[run[i]].y;
+                ref->r = cells[run[i]].r;
+            }
+
+            for (unsigned int i = 0; i < n && list->active; i++) {
+                Cell* cell = &cells[run[i]];
+                for (unsigned int j = i + 1; j < n; j++) {
+                    Cell* other = &cells[run[j]];
+                    float dx = other->x - cell->x;
+                    float dy = other->y - cell->y;
+                    float r_sum = cell->r + other->r + skin;
+                    if (dx * dx + dy * dy >= r_sum * r_sum) continue;
+                    // Pool is full, fall back to the quadtree for this player
+                    if (written >= CONTACT_POOL) {
+                        list->active = 0;
+                        break;
+                    }
+                    next[written].a = run[i];
+                    next[written].b = run[j];
+                    written++;
+                    list->count++;
+                }
+            }
+
+            if (!list->active) {
+                written = list->offset;
+                list->count = 0;
+                continue;
+            }
+        }
+
+        Contact* iter = next + list->offset;
+        Contact* end = iter + list->count;
+
+        while (iter < end) {
+            Cell* cell = &cells[iter->a];
+            Cell* other = &cells[iter->b];
+            iter++;
+
+            // Bigger cell pushes, same as resolve
+            if (cell->r < other->r) {
+                Cell* t = cell;
+                cell = other;
+                other = t;
+            }
+
+            unsigned char flags = cell->flags;
+            unsigned char other_flags = other->flags;
+
+            if ((flags | other_flags) & SKIP_RESOLVE_BITS) continue;
+            // Pairs are from an older tick, either cell may have been eaten or freed since
+            if (!(flags & other_flags & EXIST_BIT)) continue;
+            if (cell->eatenBy || other->eatenBy) continue;
+            if (cell->type != type || other->type != type) continue;
+            // Merging pairs are left to the PHYSICS_EAT path
+            if (flags & other_flags & MERGE_BIT) continue;
+            if (cell->age <= no_colli_delay || other->age <= no_colli_delay) continue;
+
+            float r1 = cell->r;
+            float r2 = other->r;
+            float dx = other->x - cell->x;
+            float dy = other->y - cell->y;
+
+            float r_sum = r1 + r2;
+            float d_sqr = dx * dx + dy * dy;
+
+            if (d_sqr >= r_sum * r_sum) continue;
+
+            float d = sqrtf(d_sqr);
+
+            collisions++;
+
+            if (d <= 0.f) continue;
+
+            dx /= d;
+            dy /= d;
+
+            float m = r_sum - d;
+
+            other->flags |= (d + r2 < r1) << 2; // INSIDE_BIT
+
+            float a = r1 * r1;
+            float b = r2 * r2;
+            float sum = a + b;
+
+            float m1 = (m < r1 ? m : r1) * b / sum;
+            cell->x -= dx * m1;
+            cell->y -= dy * m1;
+
+            float m2 = (m < r2 ? m : r2) * a / sum;
+            other->x += dx * m2;
+            other->y += dy * m2;
+
+            cell->flags |= UPDATE_BIT;
+            other->flags |= UPDATE_BIT;
+        }
+    }
+
+    // Players without cells this tick have nothing left in the pool
+    for (unsigned int i = 0; i < 256; i++) {
+        if (seen[i]) continue;
+        cache->lists[i].active = 0;
+        cache->lists[i].count = 0;
+        cache->lists[i].cells = 0;
+    }
+
+    cache->flip ^= 1;
+
+    return collisions;
+}
 
 unsigned int resolve(Cell cells[],
-    unsigned short* ptr, unsigned short pellet_count,
+    cell_id* ptr, CellLists* lists,
     QuadNode* root, QuadNode** sp,
-    unsigned int no_merge_delay, unsigned int no_colli_delay, 
+    ContactCache* contacts, float contact_skin,
+    unsigned int no_merge_delay, unsigned int no_colli_delay,
     float eat_overlap, float eat_multi, 
     float virus_boost, float virus_max_boost,
     float virus_size, float virus_max_size, unsigned int remove_tick) {
 
     unsigned int collisions = 0;
-    unsigned short* ptr_copy = ptr;
+    unsigned int pellet_count = lists->count[254];
+    cell_id* ptr_copy = ptr;
+
+    lists->removed_count = 0;
+
+    if (contact_skin > 0.f)
+        collisions += resolve_contacts(cells, ptr, contacts, no_colli_delay, contact_skin);
 
     while (*ptr) {
 
@@ -422,6 +996,8 @@ unsigned int resolve(Cell cells[],
         QuadNode* curr;
 
         unsigned char colli = cell->age > no_colli_delay;
+        // Same player collisions were already resolved from the contact cache
+        unsigned char cached = contact_skin > 0.f && IS_PLAYER(type) && contacts->lists[type].active;
         float x = cell->x;
         float y = cell->y;
         float r1 = cell->r;
@@ -452,11 +1028,11 @@ unsigned int resolve(Cell cells[],
                 }
             }
 
-            unsigned short* iter = &curr->indices;
-            unsigned short* end = iter + curr->count;
+            cell_id* iter = &curr->indices;
+            cell_id* end = iter + curr->count;
 
             while(iter < end) {
-                unsigned short other_index = *iter++;
+                cell_id other_index = *iter++;
                 Cell* other = &cells[other_index];
                 
                 if (cell == other) continue; // Same cell
@@ -474,6 +1050,7 @@ unsigned int resolve(Cell cells[],
                     if (type == other->type) { // same player
                         if (flags & other_flags & MERGE_BIT) // Both merge bits are set
                             action = PHYSICS_EAT; // player merge
+                        else if (cached) continue;
                         else if (colli && other->age > no_colli_delay) action = PHYSICS_COL; // player collide
                     } else action = PHYSICS_EAT; // player eats everything else
                 } else if (IS_VIRUS(type) && IS_EJECTED(other->type)) {
@@ -604,7 +1181,7 @@ unsigned int resolve(Cell cells[],
     
     // Post resolve
     while (1) {
-        unsigned short id = *ptr_copy++;
+        cell_id id = *ptr_copy++;
         if (!id) break;
 
         Cell* cell = &cells[id];
@@ -612,6 +1189,9 @@ unsigned int resolve(Cell cells[],
         unsigned char flags = cell->flags;
 
         if (flags & REMOVE_BIT) {
+            unlink_cell(lists, id, type);
+            lists->removed[lists->removed_count++] = id;
+            hold_id(lists, id);
             remove_cell(id, type, cell->eatenBy, cells[cell->eatenBy].type);
             continue;
         } else if (flags & POP_BIT) {
@@ -643,10 +1223,10 @@ unsigned int resolve(Cell cells[],
 }
 
 unsigned int select(Cell cells[], QuadNode* root, 
-    QuadNode** sp, unsigned short* list_pointer, 
+    QuadNode** sp, cell_id* list_pointer, 
     float l, float r, float b, float t) {
     
-    unsigned short* write_pointer = list_pointer;
+    cell_id* write_pointer = list_pointer;
 
     QuadNode** node_stack_pointer = sp;
     // Push root to stack
@@ -680,8 +1260,8 @@ unsigned int select(Cell cells[], QuadNode* root,
                     *node_stack_pointer++ = curr_inclusive->tl;
                 }
 
-                // Copy count * 2 bytes of indices data directly to write pointer
-                memcpy(write_pointer, &curr_inclusive->indices, curr_inclusive->count << 1);
+                // Copy the indices data directly to write pointer
+                memcpy(write_pointer, &curr_inclusive->indices, curr_inclusive->count * sizeof(cell_id));
                 write_pointer += curr_inclusive->count;
             }
         } else {
@@ -702,7 +1282,7 @@ unsigned int select(Cell cells[], QuadNode* root,
             }
 
             for (unsigned int i = 0; i < curr->count; i++) {
-                unsigned short id = *(&curr->indices + i);
+                cell_id id = *(&curr->indices + i);
                 Cell* cell = &cells[id];
                 if (cell->x - cell->r <= r &&
                     cell->x + cell->r >= l &&
@@ -716,4 +1296,204 @@ unsigned int select(Cell cells[], QuadNode* root,
     }
 
     return write_pointer - list_pointer;
-}
\ No newline at end of file
+}
+
+// Frozen copy of the cells and of the serialized tree, encode workers read it while the next tick runs.
+// Nodes are laid out one after another, the copied child pointers are moved by the distance between the copies
+void freeze(Cell cells[], QuadNode* root, void* end, Cell out[], QuadNode* out_root) {
+    memcpy(out, cells, sizeof(Cell) * CELL_LIMIT);
+
+    size_t bytes = (char*) end - (char*) root;
+    memcpy(out_root, root, bytes);
+
+    int delta = (char*) out_root - (char*) root;
+    char* last = (char*) out_root + bytes;
+    QuadNode* node = out_root;
+
+    while ((char*) node < last) {
+        if (node->tl) {
+            node->tl = (char*) node->tl + delta;
+            node->tr = (char*) node->tr + delta;
+            node->bl = (char*) node->bl + delta;
+            node->br = (char*) node->br + delta;
+        }
+        node = (QuadNode*) (&node->indices + node->count);
+    }
+}
+
+// Bot brains, one entry per thinking bot. JS fills in the id and the sight box,
+// bot_think writes back the mouse target and the commands
+typedef struct {
+    float x; // sight centre in, mouse x out
+    float y; // sight centre in, mouse y out
+    float hw;
+    float hh;
+    unsigned char id;
+    unsigned char split; // out
+    unsigned char action; // out, BOT_IDLE and so on
+    unsigned char pad;
+} BotBrain;
+
+#define BOT_IDLE 0
+#define BOT_FEED 1
+#define BOT_CHASE 2
+#define BOT_FLEE 3
+#define BOT_SPLIT 4
+
+// Threats outweigh prey which outweighs pellets
+#define BOT_FEED_WEIGHT 1.f
+#define BOT_CHASE_WEIGHT 4.f
+#define BOT_FLEE_WEIGHT 12.f
+// No split kills while a threat weighs more than this
+#define BOT_SPLIT_DANGER 1.f
+
+void bot_think(Cell cells[], CellLists* lists, QuadNode* root, QuadNode** sp,
+    BotBrain bots[], unsigned int n,
+    float eat_mult, float split_reach, float virus_size, unsigned int max_cells,
+    float map_hw, float map_hh) {
+
+    for (unsigned int i = 0; i < n; i++) {
+        BotBrain* bot = &bots[i];
+        unsigned char id = bot->id;
+
+        bot->split = 0;
+        bot->action = BOT_IDLE;
+
+        // Biggest own cell is what the bot steers, walked through the type list instead of the tree
+        Cell* self = 0;
+        unsigned int count = 0;
+        for (cell_id c = lists->head[id]; c; c = lists->next[c]) {
+            if (!self || cells[c].r > self->r) self = &cells[c];
+            count++;
+        }
+        if (!self) continue;
+
+        float sx = self->x;
+        float sy = self->y;
+        float sr = self->r;
+        // Radius of the halves after splitting the biggest cell
+        float hr = sr * 0.70710678f;
+        unsigned char can_split = count * 2 <= max_cells && hr > virus_size;
+
+        float feed_x = 0.f, feed_y = 0.f;
+        float chase_x = 0.f, chase_y = 0.f;
+        float flee_x = 0.f, flee_y = 0.f;
+        float danger = 0.f;
+
+        Cell* split_target = 0;
+        float split_score = 0.f;
+
+        float l = bot->x - bot->hw;
+        float r = bot->x + bot->hw;
+        float b = bot->y - bot->hh;
+        float t = bot->y + bot->hh;
+
+        QuadNode** node_stack_pointer = sp;
+        *node_stack_pointer++ = root;
+        QuadNode* curr;
+
+        while (node_stack_pointer > sp) {
+            curr = *--node_stack_pointer;
+
+            if (curr->tl) {
+                if (b < curr->y) {
+                    if (r > curr->x)
+                        *node_stack_pointer++ = curr->br;
+                    if (l < curr->x)
+                        *node_stack_pointer++ = curr->bl;
+                }
+                if (t > curr->y) {
+                    if (r > curr->x)
+                        *node_stack_pointer++ = curr->tr;
+                    if (l < curr->x)
+                        *node_stack_pointer++ = curr->tl;
+                }
+            }
+
+            for (unsigned int j = 0; j < curr->count; j++) {
+                Cell* cell = &cells[*(&curr->indices + j)];
+                unsigned char type = cell->type;
+                if (type == id || cell->x < l || cell->x > r || cell->y < b || cell->y > t) continue;
+
+                float dx = cell->x - sx;
+                float dy = cell->y - sy;
+                float d = sqrtf(dx * dx + dy * dy);
+                if (d < 1.f) continue;
+                dx /= d;
+                dy /= d;
+                // Distance between the edges
+                float gap = d - sr - cell->r;
+                if (gap < 1.f) gap = 1.f;
+                float mass = cell->r * cell->r;
+
+                if (IS_VIRUS(type)) {
+                    // Only a threat when it would pop us
+                    if (sr > cell->r * eat_mult && count < max_cells) {
+                        float w = BOT_FLEE_WEIGHT * mass / (gap * gap);
+                        flee_x -= dx * w;
+                        flee_y -= dy * w;
+                    }
+                } else if (IS_PELLET(type) || IS_EJECTED(type)) {
+                    // Pellets and ejected mass
+                    if (sr > cell->r * eat_mult) {
+                        float w = BOT_FEED_WEIGHT * mass / gap;
+                        feed_x += dx * w;
+                        feed_y += dy * w;
+                    }
+                } else if (cell->r > sr * eat_mult) {
+                    // Anything that can split on us is closer than it looks
+                    float reach = gap - (cell->r * 0.70710678f > sr * eat_mult ? split_reach : 0.f);
+                    if (reach < 1.f) reach = 1.f;
+                    float w = BOT_FLEE_WEIGHT * mass / (reach * reach);
+                    flee_x -= dx * w;
+                    flee_y -= dy * w;
+                    if (w > danger) danger = w;
+                } else if (sr > cell->r * eat_mult) {
+                    float w = BOT_CHASE_WEIGHT * mass / gap;
+                    chase_x += dx * w;
+                    chase_y += dy * w;
+                    // Split kill, the half has to eat it and land within reach
+                    if (can_split && hr > cell->r * eat_mult && d - sr < split_reach && mass > split_score) {
+                        split_target = cell;
+                        split_score = mass;
+                    }
+                }
+            }
+        }
+
+        // Walls push back so fleeing doesn't end in a corner
+        float wall = sr * 4.f;
+        if (sx - sr < -map_hw + wall) flee_x += BOT_FLEE_WEIGHT;
+        if (sx + sr > map_hw - wall)  flee_x -= BOT_FLEE_WEIGHT;
+        if (sy - sr < -map_hh + wall) flee_y += BOT_FLEE_WEIGHT;
+        if (sy + sr > map_hh - wall)  flee_y -= BOT_FLEE_WEIGHT;
+
+        // Splitting next to a threat feeds it
+        if (split_target && danger < BOT_SPLIT_DANGER) {
+            bot->x = split_target->x;
+            bot->y = split_target->y;
+            bot->split = 1;
+            bot->action = BOT_SPLIT;
+            continue;
+        }
+
+        float flee = sqrtf(flee_x * flee_x + flee_y * flee_y);
+        float chase = sqrtf(chase_x * chase_x + chase_y * chase_y);
+        float feed = sqrtf(feed_x * feed_x + feed_y * feed_y);
+
+        float mx = flee_x + chase_x + feed_x;
+        float my = flee_y + chase_y + feed_y;
+        float m = sqrtf(mx * mx + my * my);
+
+        if (m < 0.0001f) continue;
+
+        if (flee >= chase && flee >= feed) bot->action = BOT_FLEE;
+        else if (chase >= feed) bot->action = BOT_CHASE;
+        else bot->action = BOT_FEED;
+
+        // Far enough that the speed isn't capped by the mouse distance
+        float dist = bot->hw > sr * 4.f ? bot->hw : sr * 4.f;
+        bot->x = sx + mx / m * dist;
+        bot->y = sy + my / m * dist;
+    }
+}
@@ -1 +1,5 @@
-emcc -O3 --llvm-opts "['-O3']" -s SIDE_MODULE=1 -mbulk-memory ./core.c -o ../../public/static/wasm/server.wasm
\ No newline at end of file
+emcc -O3 --llvm-opts "['-O3']" -s SIDE_MODULE=1 -mbulk-memory ./core.c -o ../../public/static/wasm/server.wasm
+emcc -O3 --llvm-opts "['-O3']" -s SIDE_MODULE=1 -mbulk-memory -DWIDE_IDS ./core.c -o ../../public/static/wasm/server-wide.wasm
+# Shared memory builds for OGARX_ENCODE_THREADS
+emcc -O3 --llvm-opts "['-O3']" -s SIDE_MODULE=1 -mbulk-memory -pthread -s MAXIMUM_MEMORY=1gb ./core.c -o ../../public/static/wasm/server-shared.wasm
+emcc -O3 --llvm-opts "['-O3']" -s SIDE_MODULE=1 -mbulk-memory -pthread -s MAXIMUM_MEMORY=1gb -DWIDE_IDS ./core.c -o ../../public/static/wasm/server-wide-shared.wasm
@@ -2,8 +2,8 @@
 #include "memory.h"
 
 // Memory layout
-// |64kb last visible hash table|64kb visible hash table
-// |list of last visible cell indices (unsigned short)|list of visible cell indices (unsigned short)
+// |TABLE_SIZE last visible hash table|TABLE_SIZE visible hash table
+// |list of last visible cell indices (cell_id)|list of visible cell indices (cell_id)
 // | dynamic buffer (A/U/E/D buffer + serialized buffer)
 
 // Protocol onUpdate:
@@ -13,14 +13,25 @@
 // 4. Build final buffer (serialize)
 
 #define PELLET_TYPE 254
+
+// Build with -DWIDE_IDS to pair with a core built the same way
+#ifdef WIDE_IDS
+typedef unsigned int cell_id;
+#define TABLE_SIZE 262144
+#define writeCellId(v) *((unsigned int*) dist) = v; dist += 4
+#else
+typedef unsigned short cell_id;
 #define TABLE_SIZE 65536
+#define writeCellId(v) *((unsigned short*) dist) = v; dist += 2
+#endif
 
-extern unsigned char get_cell_updated(void* ptr, unsigned short id);
-extern float get_cell_x(void* ptr, unsigned short id);
-extern float get_cell_y(void* ptr, unsigned short id);
-extern unsigned short get_cell_r(void* ptr, unsigned short id);
-extern unsigned short get_cell_eatenby(void* ptr, unsigned short id);
-extern unsigned char  get_cell_type(void* ptr, unsigned short id);
+// Getters take the cells of the engine (0) or its frozen copy when encoding is pipelined
+extern unsigned char get_cell_updated(void* ptr, cell_id id);
+extern float get_cell_x(void* ptr, cell_id id);
+extern float get_cell_y(void* ptr, cell_id id);
+extern unsigned short get_cell_r(void* ptr, cell_id id);
+extern cell_id get_cell_eatenby(void* ptr, cell_id id);
+extern unsigned char  get_cell_type(void* ptr, cell_id id);
 
 // Step 1
 void move_hashtable() {
@@ -35,43 +46,44 @@ void copy(void* dist, void* src, size_t bytes) {
 
 // Step 3 write AUED indices
 void* write_AUED(
+    void* cells,
     unsigned char last_visible_table[], unsigned char curr_visible_table[],
-    unsigned short last_visible_list[], unsigned int last_visible_list_length,
-    unsigned short curr_visible_list[], unsigned int curr_visible_list_length,
-    unsigned int count_table[], unsigned short dist[]) {
+    cell_id last_visible_list[], unsigned int last_visible_list_length,
+    cell_id curr_visible_list[], unsigned int curr_visible_list_length,
+    unsigned int count_table[], cell_id dist[]) {
 
     // Write current visible cells to the hash table
     for (unsigned int i = 0; i < curr_visible_list_length; i++)
         curr_visible_table[curr_visible_list[i]] = 1;
 
-    unsigned short* A_ptr = dist + 0;
-    unsigned short* U_ptr = dist + 1;
-    unsigned short* E_ptr = dist + 2;
-    unsigned short* D_ptr = dist + 3;
+    cell_id* A_ptr = dist + 0;
+    cell_id* U_ptr = dist + 1;
+    cell_id* E_ptr = dist + 2;
+    cell_id* D_ptr = dist + 3;
 
     // The algorithm is the same as original ogar protocol
     for (unsigned int i = 0; i < curr_visible_list_length; i++) {
-        unsigned short cell_id = curr_visible_list[i];
-        if (last_visible_table[cell_id]) {
-            if (get_cell_updated(0, cell_id)) {
-                *U_ptr = cell_id;
+        cell_id id = curr_visible_list[i];
+        if (last_visible_table[id]) {
+            if (get_cell_updated(cells, id)) {
+                *U_ptr = id;
                 U_ptr += 4;
             }
         } else {
-            *A_ptr = cell_id;
+            *A_ptr = id;
             A_ptr += 4;
         }
     }
 
     for (unsigned int i = 0; i < last_visible_list_length; i++) {
-        unsigned short cell_id = last_visible_list[i];
-        if (curr_visible_table[cell_id]) continue;
-        unsigned short eatenby = get_cell_eatenby(0, cell_id);
+        cell_id id = last_visible_list[i];
+        if (curr_visible_table[id]) continue;
+        cell_id eatenby = get_cell_eatenby(cells, id);
         if (eatenby) {
-            *E_ptr = cell_id;
+            *E_ptr = id;
             E_ptr += 4;
         } else {
-            *D_ptr = cell_id;
+            *D_ptr = id;
             D_ptr += 4;
         }
     }
@@ -82,7 +94,7 @@ void* write_AUED(
     count_table[2] = (E_ptr - (dist + 2)) >> 2;
     count_table[3] = (D_ptr - (dist + 3)) >> 2;
 
-    unsigned short* end = A_ptr;
+    cell_id* end = A_ptr;
     end = U_ptr > end ? U_ptr : end;
     end = E_ptr > end ? E_ptr : end;
     end = D_ptr > end ? D_ptr : end;
@@ -100,6 +112,7 @@ void* write_AUED(
 
 // Step 4
 unsigned char* serialize(
+    void* cells,
     unsigned char pid,
     unsigned short cell_count,
     unsigned char line_lock,
@@ -107,7 +120,7 @@ unsigned char* serialize(
     float mx, float my,
     float vx, float vy,
     unsigned int table[],
-    unsigned short* lists, unsigned char* dist,
+    cell_id* lists, unsigned char* dist,
     float l, float r, float t, float b) {
 
     // Write OP code
@@ -131,81 +144,325 @@ unsigned char* serialize(
     unsigned int E_count = table[2];
     unsigned int D_count = table[3];
 
-    unsigned short* A_ptr = lists + 0;
-    unsigned short* U_ptr = lists + 1;
-    unsigned short* E_ptr = lists + 2;
-    unsigned short* D_ptr = lists + 3;
+    cell_id* A_ptr = lists + 0;
+    cell_id* U_ptr = lists + 1;
+    cell_id* E_ptr = lists + 2;
+    cell_id* D_ptr = lists + 3;
     
     // Exact same serialization
     while (A_count--) {
-        unsigned short cell_id = *A_ptr;
+        cell_id id = *A_ptr;
 
-        writeUint16(cell_id);
-        writeUint16(get_cell_type(0, cell_id));
-        float radius = get_cell_r(0, cell_id);
+        writeCellId(id);
+        writeUint16(get_cell_type(cells, id));
+        float radius = get_cell_r(cells, id);
 
         float x_min = l + radius;
         float x_max = r - radius;
         float y_min = b + radius;
         float y_max = t - radius;
 
-        float x = get_cell_x(0, cell_id);
+        float x = get_cell_x(cells, id);
         writeInt16(CLAMP(x, x_min, x_max));
-        float y = get_cell_y(0, cell_id);
+        float y = get_cell_y(cells, id);
         writeInt16(CLAMP(y, y_min, y_max));
         writeUint16(radius);
 
         A_ptr += 4;
     }
 
-    writeUint16(0);
+    writeCellId(0);
 
     while (U_count--) {
-        unsigned short cell_id = *U_ptr;
+        cell_id id = *U_ptr;
 
-        writeUint16(cell_id);
-        float radius = get_cell_r(0, cell_id);
+        writeCellId(id);
+        float radius = get_cell_r(cells, id);
 
         float x_min = l + radius;
         float x_max = r - radius;
         float y_min = b + radius;
         float y_max = t - radius;
 
-        float x = get_cell_x(0, cell_id);
+        float x = get_cell_x(cells, id);
         writeInt16(CLAMP(x, x_min, x_max));
-        float y = get_cell_y(0, cell_id);
+        float y = get_cell_y(cells, id);
         writeInt16(CLAMP(y, y_min, y_max));
         writeUint16(radius);
 
         U_ptr += 4;
     }
 
-    writeUint16(0);
+    writeCellId(0);
     
     while (E_count--) {
-        unsigned short cell_id = *E_ptr;
+        cell_id id = *E_ptr;
 
-        writeUint16(cell_id);
-        writeUint16(get_cell_eatenby(0, cell_id));
+        writeCellId(id);
+        writeCellId(get_cell_eatenby(cells, id));
 
         E_ptr += 4;
     }
 
-    writeUint16(0);
+    writeCellId(0);
 
     while (D_count--) {
-        unsigned short cell_id = *D_ptr;
+        cell_id id = *D_ptr;
 
-        writeUint16(cell_id);
+        writeCellId(id);
 
         D_ptr += 4;
     }
 
-    writeUint16(0);
+    writeCellId(0);
 
     return dist; // Return final pointer so js knows how to slice the buffer
 }
 
+// Packed cells packet (OP 13), asked for at handshake instead of deflate and unpacked by webgl/wasm/client.c.
+// Every section is sorted by id and written column by column as varints: id deltas, run length coded types
+// and radii, coordinates zigzag coded against the viewport. The column stream is then rANS coded (order 0,
+// 12 bit frequencies sent along) when that comes out smaller. Tables live in memory handed in by js
+
+#define PACKED_OP 13
+#define RANS_BITS 12
+#define RANS_SCALE (1 << RANS_BITS)
+#define RANS_L (1u << 23)
+// Shorter streams are sent as they are, the frequency table would eat the gain
+#define RANS_MIN 128
+
+#ifdef WIDE_IDS
+#define ID_PASSES 3
+#else
+#define ID_PASSES 2
+#endif
+
+typedef struct {
+    unsigned int id;
+    unsigned char* at;
+} Record;
+
+typedef struct {
+    unsigned int count[256]; // radix buckets, then byte frequencies
+    unsigned int start[256];
+} PackTables;
+
+#define ZIGZAG(v) (((unsigned int) (v) << 1) ^ (unsigned int) ((v) >> 31))
+
+static inline unsigned char* put_varint(unsigned char* q, unsigned int v) {
+    while (v >= 0x80) {
+        *q++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *q++ = v;
+    return q;
+}
+
+// Records of one section into list, returns the byte after its 0 id terminator
+static unsigned char* gather(unsigned char* p, unsigned int bytes, Record* list, unsigned int* n) {
+    unsigned int i = 0;
+    while (*((cell_id*) p)) {
+        list[i].id = *((cell_id*) p);
+        list[i].at = p;
+        p += bytes;
+        i++;
+    }
+    *n = i;
+    return p + sizeof(cell_id);
+}
+
+// LSD radix sort by id, a byte per pass
+static void sort_records(Record* list, Record* tmp, unsigned int n, unsigned int* count) {
+    Record* from = list;
+    Record* to = tmp;
+    for (unsigned int shift = 0; shift < 8 * ID_PASSES; shift += 8) {
+        memset(count, 0, 256 * sizeof(unsigned int));
+        for (unsigned int i = 0; i < n; i++) count[(from[i].id >> shift) & 255]++;
+        unsigned int sum = 0;
+        for (unsigned int b = 0; b < 256; b++) {
+            unsigned int c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (unsigned int i = 0; i < n; i++) to[count[(from[i].id >> shift) & 255]++] = from[i];
+        Record* t = from;
+        from = to;
+        to = t;
+    }
+    if (from != list) memcpy(list, from, n * sizeof(Record));
+}
+
+static unsigned char* put_ids(unsigned char* q, Record* list, unsigned int n) {
+    unsigned int last = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        q = put_varint(q, list[i].id - last);
+        last = list[i].id;
+    }
+    return q;
+}
+
+// Runs of the same 16 bit field, pellets share their type and radius
+static unsigned char* put_runs(unsigned char* q, Record* list, unsigned int n, unsigned int offset) {
+    for (unsigned int i = 0; i < n;) {
+        unsigned short v = *((unsigned short*) (list[i].at + offset));
+        unsigned int run = 1;
+        while (i + run < n && *((unsigned short*) (list[i + run].at + offset)) == v) run++;
+        q = put_varint(q, v);
+        q = put_varint(q, run);
+        i += run;
+    }
+    return q;
+}
+
+static unsigned char* put_coords(unsigned char* q, Record* list, unsigned int n, unsigned int offset, int center) {
+    for (unsigned int i = 0; i < n; i++)
+        q = put_varint(q, ZIGZAG(*((short*) (list[i].at + offset)) - center));
+    return q;
+}
+
+static unsigned char* put_shorts(unsigned char* q, Record* list, unsigned int n, unsigned int offset) {
+    for (unsigned int i = 0; i < n; i++) q = put_varint(q, *((unsigned short*) (list[i].at + offset)));
+    return q;
+}
+
+static unsigned char* put_eaters(unsigned char* q, Record* list, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) q = put_varint(q, *((cell_id*) (list[i].at + sizeof(cell_id))));
+    return q;
+}
+
+// Byte counts to frequencies summing up to RANS_SCALE, every byte seen keeps at least 1
+static void normalize(unsigned int* freq, unsigned int total) {
+    unsigned int sum = 0;
+    for (unsigned int s = 0; s < 256; s++) {
+        if (!freq[s]) continue;
+        unsigned int f = (unsigned long long) freq[s] * RANS_SCALE / total;
+        freq[s] = f ? f : 1;
+        sum += freq[s];
+    }
+    // Rounding error goes to the most frequent bytes
+    while (sum != RANS_SCALE) {
+        unsigned int m = 0;
+        for (unsigned int s = 1; s < 256; s++) if (freq[s] > freq[m]) m = s;
+        if (sum < RANS_SCALE) {
+            freq[m] += RANS_SCALE - sum;
+            sum = RANS_SCALE;
+        } else {
+            unsigned int take = sum - RANS_SCALE;
+            if (take > freq[m] - 1) take = freq[m] - 1;
+            freq[m] -= take;
+            sum -= take;
+        }
+    }
+}
+
+// Codes the stream backwards so it decodes forwards, returns the first byte (the final state, 4 bytes)
+static unsigned char* rans_encode(unsigned char* stream, unsigned int n, PackTables* tables, unsigned char* end) {
+    unsigned int x = RANS_L;
+    unsigned char* p = end;
+    for (unsigned int i = n; i-- > 0;) {
+        unsigned char s = stream[i];
+        unsigned int f = tables->count[s];
+        unsigned int x_max = ((RANS_L >> RANS_BITS) << 8) * f;
+        while (x >= x_max) {
+            *--p = x & 0xff;
+            x >>= 8;
+        }
+        x = ((x / f) << RANS_BITS) + (x % f) + tables->start[s];
+    }
+    p -= 4;
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+    return p;
+}
+
+// Pack a serialized cells packet (src) into dist, returns the write end.
+// tables and work are scratch, work takes up to 16 times the size of src
+unsigned char* pack(unsigned char* src, PackTables* tables, Record* work, unsigned char* dist) {
+    memcpy(dist, src, 25);
+    dist[0] = PACKED_OP;
+    int cx = (int) *((float*) (src + 17));
+    int cy = (int) *((float*) (src + 21));
+
+    unsigned int a_n, u_n, e_n, d_n;
+    Record* a = work;
+    unsigned char* p = gather(src + 25, sizeof(cell_id) + 8, a, &a_n);
+    Record* u = a + a_n;
+    p = gather(p, sizeof(cell_id) + 6, u, &u_n);
+    Record* e = u + u_n;
+    p = gather(p, 2 * sizeof(cell_id), e, &e_n);
+    Record* d = e + e_n;
+    p = gather(p, sizeof(cell_id), d, &d_n);
+    Record* tmp = d + d_n;
+
+    sort_records(a, tmp, a_n, tables->count);
+    sort_records(u, tmp, u_n, tables->count);
+    sort_records(e, tmp, e_n, tables->count);
+    sort_records(d, tmp, d_n, tables->count);
+
+    unsigned char* stream = (unsigned char*) (tmp + (a_n + u_n + e_n + d_n));
+    unsigned char* q = stream;
+    q = put_varint(q, a_n);
+    q = put_varint(q, u_n);
+    q = put_varint(q, e_n);
+    q = put_varint(q, d_n);
+
+    q = put_ids(q, a, a_n);
+    q = put_runs(q, a, a_n, sizeof(cell_id));
+    q = put_runs(q, a, a_n, sizeof(cell_id) + 6);
+    q = put_coords(q, a, a_n, sizeof(cell_id) + 2, cx);
+    q = put_coords(q, a, a_n, sizeof(cell_id) + 4, cy);
+
+    q = put_ids(q, u, u_n);
+    q = put_coords(q, u, u_n, sizeof(cell_id), cx);
+    q = put_coords(q, u, u_n, sizeof(cell_id) + 2, cy);
+    q = put_shorts(q, u, u_n, sizeof(cell_id) + 4);
+
+    q = put_ids(q, e, e_n);
+    q = put_eaters(q, e, e_n);
+
+    q = put_ids(q, d, d_n);
+
+    unsigned int n = q - stream;
+    unsigned char* out = dist + 25;
+
+    if (n >= RANS_MIN) {
+        unsigned int* freq = tables->count;
+        memset(freq, 0, 256 * sizeof(unsigned int));
+        for (unsigned int i = 0; i < n; i++) freq[stream[i]]++;
+        normalize(freq, n);
+        unsigned int cum = 0;
+        for (unsigned int s = 0; s < 256; s++) {
+            tables->start[s] = cum;
+            cum += freq[s];
+        }
+
+        // At most 12 bits per byte plus the state
+        unsigned char* end = q + 2 * n + 16;
+        unsigned char* coded = rans_encode(stream, n, tables, end);
+        unsigned int size = end - coded;
+
+        // Mode, stream length, bitmap of the bytes present and their frequencies
+        unsigned char* h = out;
+        *h++ = 1;
+        h = put_varint(h, n);
+        memset(h, 0, 32);
+        for (unsigned int s = 0; s < 256; s++) if (freq[s]) h[s >> 3] |= 1 << (s & 7);
+        h += 32;
+        for (unsigned int s = 0; s < 256; s++) if (freq[s]) h = put_varint(h, freq[s]);
+
+        if (h + size < out + 1 + n) {
+            memcpy(h, coded, size);
+            return h + size;
+        }
+    }
+
+    *out++ = 0;
+    memcpy(out, stream, n);
+    return out + n;
+}
+
 void clean(void* ptr, size_t bytes) {
     memset(ptr, 0, bytes);
 }
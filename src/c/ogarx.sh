@@ -1 +1,5 @@
-emcc -O2 -s SIDE_MODULE=1 -mbulk-memory ./ogarx.c -o ../../public/static/wasm/ogarx.wasm
\ No newline at end of file
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory ./ogarx.c -o ../../public/static/wasm/ogarx.wasm
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -DWIDE_IDS ./ogarx.c -o ../../public/static/wasm/ogarx-wide.wasm
+# Shared memory builds for OGARX_ENCODE_THREADS
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -pthread -s MAXIMUM_MEMORY=1gb ./ogarx.c -o ../../public/static/wasm/ogarx-shared.wasm
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -pthread -s MAXIMUM_MEMORY=1gb -DWIDE_IDS ./ogarx.c -o ../../public/static/wasm/ogarx-wide-shared.wasm
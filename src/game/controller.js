@@ -33,7 +33,7 @@ module.exports = class Controller {
         this.handle = null;
     }
 
-    get alive() { return !!this.engine.counters[this.id].size; }
+    get alive() { return !!this.engine.counts[this.id]; }
     get name() { return this.__name || "Unnamed"; }
     get skin() { return this.__skin; }
 
@@ -61,9 +61,10 @@ module.exports = class Controller {
     }
 
     lock() {
-        if (this.engine.counters[this.id].size != 1) return false;
-        const cell = this.engine.cells[[...this.engine.counters[this.id]][0]];
-        const x1 = this.mouseX, y1 = this.mouseY, x2 = cell.x, y2 = cell.y;
+        if (this.engine.counts[this.id] != 1) return false;
+        const cells = this.engine.cells;
+        const id = this.engine.listHead[this.id];
+        const x1 = this.mouseX, y1 = this.mouseY, x2 = cells.x(id), y2 = cells.y(id);
         this.linearEquation[0] = y1 - y2;
         this.linearEquation[1] = x2 - x1;
         this.linearEquation[2] = x1 * y2 - x2 * y1;
@@ -100,6 +101,55 @@ module.exports = class Controller {
         this.box.fill(0);
     }
 
+    /**
+     * Snapshot record, ticks are stored relative to now since performance.now() restarts with the process
+     * @param {import("../network/writer")} writer
+     * @param {number} now
+     */
+    serialize(writer, now) {
+        writer.writeUInt8((this.lockDir ? 1 : 0) | (this.autoRespawn ? 2 : 0));
+        writer.writeUTF16String(this.__name);
+        writer.writeUTF16String(this.__skin);
+        writer.writeFloat32(this.__mouseX);
+        writer.writeFloat32(this.__mouseY);
+        for (const v of this.linearEquation) writer.writeFloat32(v);
+        writer.writeFloat32(this.viewportX);
+        writer.writeFloat32(this.viewportY);
+        writer.writeFloat32(this.viewportHW);
+        writer.writeFloat32(this.viewportHH);
+        writer.writeFloat32(this.score);
+        writer.writeFloat32(this.maxScore);
+        writer.writeUInt32(this.kills);
+        writer.writeFloat64(now - this.lastSpawnTick);
+        writer.writeFloat64(now - this.lastEjectTick);
+        writer.writeFloat64(now - this.lastPoppedTick);
+    }
+
+    /**
+     * @param {import("../network/reader")} reader
+     * @param {number} now
+     */
+    deserialize(reader, now) {
+        const flags = reader.readUInt8();
+        this.lockDir = !!(flags & 1);
+        this.autoRespawn = !!(flags & 2);
+        this.__name = reader.readUTF16String();
+        this.__skin = reader.readUTF16String();
+        this.__mouseX = reader.readFloat32();
+        this.__mouseY = reader.readFloat32();
+        for (let i = 0; i < 3; i++) this.linearEquation[i] = reader.readFloat32();
+        this.viewportX = reader.readFloat32();
+        this.viewportY = reader.readFloat32();
+        this.viewportHW = reader.readFloat32();
+        this.viewportHH = reader.readFloat32();
+        this.score = reader.readFloat32();
+        this.maxScore = reader.readFloat32();
+        this.kills = reader.readUInt32();
+        this.lastSpawnTick = now - reader.readFloat64();
+        this.lastEjectTick = now - reader.readFloat64();
+        this.lastPoppedTick = now - reader.readFloat64();
+    }
+
     afterSpawn() {
         this.ejectAttempts = 0;
         this.ejectMarco = false;
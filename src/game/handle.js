@@ -1,3 +1,5 @@
+const { Fields: { X, Y, R } } = require("../physics/cell");
+
 module.exports = class Handle {
     /** @param {import(".")} game */
     constructor(game) {
@@ -57,7 +59,7 @@ module.exports = class Handle {
         const g = this.game;
         const e = g.engine;
         const o = g.options;
-        const cells = g.engine.cells;
+        const { f32, F } = g.engine.cells;
 
         let size = 0, size_x = 0, size_y = 0;
         let x = 0, y = 0, factor = 0;
@@ -70,12 +72,12 @@ module.exports = class Handle {
         for (const id of this.pids) {
             let score = 0;
 
-            cell_count += g.engine.counters[id].size;
-            for (const cell_id of e.counters[id]) {
-                const cell = cells[cell_id];
-                const r = cell.r;
+            cell_count += e.counts[id];
+            for (const cell_id of e.cellsOf(id)) {
+                const i = cell_id * F;
+                const r = f32[i + R];
                 const sqr = r * r;
-                const cell_x = cell.x, cell_y = cell.y;
+                const cell_x = f32[i + X], cell_y = f32[i + Y];
                 x += cell_x * sqr;
                 y += cell_y * sqr;
                 min_x = Math.min(min_x, cell_x - r);
@@ -15,6 +15,8 @@ module.exports = class Game extends EventEmitter {
         this.engine = new Engine(this);
         this.controls = Array.from({ length: MAX_PLAYER }, (_, i) => new Controller(this.engine, i));
         this.handles = 0;
+        /** Bytes handed to client sockets (before deflate) */
+        this.bytesSent = 0;
 
         this.on("oversize", /** @param {import("./controller")} c */ c => {
             try {
@@ -26,6 +28,12 @@ module.exports = class Game extends EventEmitter {
 
         this.on("restart", () => this.emit("log", "Restarting Server..."));
 
+        /** 
+         * Controllers restored from a snapshot, reserved for their client until SOCKET_RECONNECT runs out
+         * @type {Map<string, { main: number, dual: number, time: number }>} 
+         */
+        this.resumes = new Map();
+
         /** @type {{ message: string, isServer: boolean }[]} */
         this.history = [];
         this.on("chat", message => this.addChatHistory(message));
@@ -37,20 +45,49 @@ module.exports = class Game extends EventEmitter {
         while (this.history.length > this.engine.options.CHAT_HISTORY) this.history.shift();
     }
 
+    /** @param {ArrayBuffer} buffer */
+    restore(buffer) {
+        const resumes = this.engine.restore(buffer);
+        if (!resumes) return false;
+        const time = performance.now();
+        this.resumes.clear();
+        for (const [uid, resume] of resumes) this.resumes.set(uid, Object.assign(resume, { time }));
+        return true;
+    }
+
+    /** @param {number} id */
+    isReserved(id) {
+        for (const r of this.resumes.values()) if (r.main == id || r.dual == id) return true;
+        return false;
+    }
+
+    expireResumes(now = performance.now()) {
+        for (const [uid, r] of this.resumes) {
+            if (now < r.time + this.engine.options.SOCKET_RECONNECT) continue;
+            for (const id of [r.main, r.dual]) {
+                if (!id || this.controls[id].handle) continue;
+                this.engine.delayKill(id, true);
+                this.controls[id].reset();
+            }
+            this.resumes.delete(uid);
+        }
+    }
+
     get playerCount() {
         return this.controls.reduce((prev, c) => (c.handle instanceof OgarXProtocol ? 1 : 0) + prev, 0);
     }
 
     get options() { return this.engine.options; }
-    get isFull() { return this.handles >= MAX_PLAYER; }
+
+    /** Room for one more client (and its dual), the check addHandler refuses on */
+    canAccept() { return this.handles + (this.engine.options.DUAL_ENABLED ? 2 : 1) < MAX_PLAYER; }
 
     /** @param {import("./handle")} handle */
     addHandler(handle) {
-        if (this.handles + (this.engine.options.DUAL_ENABLED ? 2 : 1) >= MAX_PLAYER) 
-            return handle.onError("Server full");
+        if (!this.canAccept()) return handle.onError("Server full");
         if (handle.controller) return;
-        let id = 1; // 0 is occupied ig
-        while (this.controls[id].handle) id++;
+        const id = this.claimResume(handle) || this.freeId();
+        if (!id) return handle.onError("Server full");
         this.controls[id].handle = handle;
         handle.controller = this.controls[id];
         // Prevent connection spam (can be done in client AND with kernel)?
@@ -58,6 +95,27 @@ module.exports = class Game extends EventEmitter {
         this.handles++;
     }
 
+    /** First controller with no handle and no reservation, 0 if there is none (0 is occupied ig) */
+    freeId() {
+        for (let id = 1; id < MAX_PLAYER; id++)
+            if (!this.controls[id].handle && !this.isReserved(id)) return id;
+        return 0;
+    }
+
+    /**
+     * Restored controller id for a resuming client (or its dual), 0 if none
+     * @param {import("./handle")} handle
+     */
+    claimResume(handle) {
+        const uid = handle.owner ? handle.owner.uid : handle.uid;
+        const r = uid && this.resumes.get(uid);
+        if (!r) return 0;
+        const id = handle.owner ? r.dual : r.main;
+        handle.owner ? r.dual = 0 : r.main = 0;
+        if (!r.main && !r.dual) this.resumes.delete(uid);
+        return id;
+    }
+
     /** @param {import("./handle")} handle */
     removeHandler(handle) {
         if (!handle.controller) return;
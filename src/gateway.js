@@ -42,15 +42,30 @@ let timeout = null;
 /** @type {Set<uWS.HttpResponse>} */
 const connections = new Set();
 
-const broadcast = async () => {
-    /** @type {pm2.ProcessDescription[]} */
-    const procList = await new Promise(resolve => pm2.list((err, list) => resolve(err ? [] : list)));
-    const data = "event: servers\ndata: " + JSON.stringify([...sockets].map(s => {
-        const data = Object.assign({}, s.data);
-        const proc = procList.find(p => p.pid == s.pid);
-        data.load = proc ? proc.monit.cpu * 0.01 : 1 / sockets.size;
-        return data;
-    })) + "\n\n";
+// Share of the tick budget over which a server only gets new players when every other one is busy too
+const BUSY_LOAD = 0.8;
+
+/**
+ * Share of its tick budget a server uses, the worse of the smoothed usage and the p99 tick time
+ * (a server can average well under budget and still miss deadlines), servers that don't report tick metrics
+ * get an even share
+ * @param {Object<string, any>} data
+ */
+const loadOf = data => typeof data.usage == "number" ?
+    Math.min(Math.max(data.usage, data.tick ? data.p99 / data.tick : 0), 1) : 1 / sockets.size;
+
+const broadcast = () => {
+    const servers = [...sockets].filter(s => s.data).map(s => Object.assign({}, s.data, { load: loadOf(s.data) }));
+    // Rank 0 is recommended: servers with headroom first, fullest first so players meet each other,
+    // then the busy ones by load
+    const ranked = servers.slice().sort((a, b) => {
+        const busyA = a.load >= BUSY_LOAD, busyB = b.load >= BUSY_LOAD;
+        if (busyA != busyB) return busyA - busyB;
+        return busyA ? a.load - b.load : b.players - a.players || a.load - b.load;
+    });
+    ranked.forEach((s, i) => s.rank = i);
+
+    const data = "event: servers\ndata: " + JSON.stringify(servers) + "\n\n";
     for (const res of connections) res.write(data);
     timeout = setTimeout(broadcast, 500);
 }
@@ -0,0 +1,236 @@
+const fs = require("fs");
+const path = require("path");
+const uWS = require("uWebSockets.js");
+const { Worker, MessageChannel } = require("worker_threads");
+
+const WorldIO = require("./network/world-io");
+
+// 32 bit cell id builds (compiled with -DWIDE_IDS) lift the 65536 cell limit
+const WIDE_IDS = !!process.env.OGARX_WIDE_IDS;
+const CORE_PATH  = path.resolve(__dirname, "..", "public", "static", "wasm", WIDE_IDS ? "server-wide.wasm" : "server.wasm");
+const PROTOCOL_PATH = path.resolve(__dirname, "..", "public", "static", "wasm", WIDE_IDS ? "ogarx-wide.wasm" : "ogarx.wasm");
+const SSL_FOLDER_PATH = path.resolve(__dirname, "..", "ssl");
+const SSL_PATH = path.resolve(SSL_FOLDER_PATH, "options.json");
+// Directory for the world snapshots (<endpoint>.bin), saved on shutdown and restored on startup
+const SNAPSHOT_DIR = process.env.OGARX_SNAPSHOT;
+
+// Output ring of every world in mb (rounded up to a power of 2), packets are dropped when it's full
+const IO_RING = 1 << Math.ceil(Math.log2(~~process.env.OGARX_IO_RING || 16)) << 20;
+// Connections per world with an input slot, more than a world has players
+const IO_SLOTS = 256;
+// Upgrades per world every 250ms, the rest wait in a queue (same as network/ws-server.js)
+const CONN_THROTTLE = 5;
+// Subprotocol of clients taking packed cells, see ws-server.js
+const PACKED_PROTOCOL = "ogarx-packed";
+
+const PORT = process.env.OGARX_PORT || 443;
+const TOKEN = process.env.OGARX_TOKEN;
+
+/** 
+ * Worlds hosted by this process, one worker thread each
+ * @type {{ mode: string, name: string, endpoint: string, pool?: number }[]} 
+ */
+const WORLDS = JSON.parse(process.env.OGARX_WORLDS || "[]");
+
+let sslOptions = null;
+if (!fs.existsSync(SSL_FOLDER_PATH)) fs.mkdirSync(SSL_FOLDER_PATH);
+if (fs.existsSync(SSL_PATH)) sslOptions = require(SSL_PATH);
+
+if (WIDE_IDS && !(fs.existsSync(CORE_PATH) && fs.existsSync(PROTOCOL_PATH)))
+    throw new Error(`OGARX_WIDE_IDS needs server-wide.wasm and ogarx-wide.wasm, build them with "npm run build:wasm"`);
+
+// Compiled once, every world instantiates the same modules
+const core = new WebAssembly.Module(fs.readFileSync(CORE_PATH));
+const protocol = new WebAssembly.Module(fs.readFileSync(PROTOCOL_PATH));
+
+/** World accepts connections once its wasm is loaded */
+const ready = WORLDS.map(() => false);
+/** Reported by the world when its player count crosses the limit */
+const full = WORLDS.map(() => false);
+/** Mouse input and outgoing packets of every world skip the ports, see network/world-io.js */
+const io = WORLDS.map(() => WorldIO.create(IO_SLOTS, IO_RING));
+const ios = io.map(buffers => new WorldIO(buffers));
+/** Input slots not taken, a world gives a slot back once its connection is closed */
+const slots = WORLDS.map(() => Array.from({ length: IO_SLOTS }, (_, i) => IO_SLOTS - 1 - i));
+/** @type {Map<number, uWS.WebSocket>[]} connections by their tag in the output ring */
+const sockets = WORLDS.map(() => new Map());
+let nextSocketId = 1;
+
+const workers = WORLDS.map((w, index) => new Worker(path.resolve(__dirname, "world.js"), {
+    workerData: {
+        core, protocol,
+        wide: WIDE_IDS,
+        name: w.name,
+        mode: w.mode,
+        endpoint: `${PORT}/${w.endpoint}`,
+        pool: w.pool || 10, // 10mb
+        snapshot: SNAPSHOT_DIR ? path.resolve(SNAPSHOT_DIR, `${w.endpoint}.bin`) : "",
+        io: io[index]
+    }
+})
+    .on("message", data => {
+        if (data.event === "ready") ready[index] = true;
+        else if (data.event === "full") full[index] = data.full;
+    })
+    .on("error", e => console.error(`World "${w.name}" crashed`, e)));
+
+/** Send one packet a world wrote to its ring */
+const senders = ios.map((w, index) => (id, data) => {
+    const ws = sockets[index].get(id);
+    if (!ws) return; // closed since
+    ws.send(data, true, ws.compress);
+    Atomics.store(w.buffered, ws.slot, ws.getBufferedAmount());
+});
+// Sent as soon as a world writes them, the ring is also drained before a world closes a connection
+const pumps = ios.map((w, index) => w.output.pump(senders[index]));
+
+let listenSocket = null;
+
+process.on("SIGINT", async () => {
+    listenSocket && uWS.us_listen_socket_close(listenSocket);
+    clearInterval(upgradeInterval);
+    pumps.forEach(stop => stop());
+    // Worlds save their snapshot before exiting
+    await Promise.all(workers.map(worker => new Promise(resolve => {
+        worker.once("exit", resolve);
+        worker.postMessage({ event: "shutdown" });
+    })));
+    process.exit(0);
+});
+
+/** Upgrades done in the current 250ms window per world */
+const conns = WORLDS.map(() => 0);
+/** @type {[uWS.HttpResponse, Object, string, string, string, uWS.us_socket_context_t][][]} */
+const upgradeQueues = WORLDS.map(() => []);
+
+const upgradeInterval = setInterval(() => upgradeQueues.forEach((queue, index) => {
+    conns[index] = 0;
+    for (let i = Math.min(CONN_THROTTLE || 1, queue.length); i > 0; i--) {
+        const [res, data, key, protocol, ext, context] = queue.shift();
+        res.upgrade(data, key, protocol, ext, context);
+    }
+}), 250);
+
+/**
+ * Connections without an input slot have no shared backpressure word, their world is told over the port
+ * @param {uWS.WebSocket} ws
+ */
+const reportBuffered = ws => {
+    if (ws.slot >= 0 || ws.closed) return;
+    const amount = ws.getBufferedAmount();
+    if (amount === ws.reported) return;
+    ws.reported = amount;
+    ws.port.postMessage({ event: "buffered", amount });
+};
+
+const app = sslOptions ? uWS.SSLApp(sslOptions) : uWS.App();
+
+WORLDS.forEach((w, index) => app.ws(`/${w.endpoint}`, {
+    idleTimeout: 10,
+    maxBackpressure: 1024,
+    maxPayloadLength: 512,
+    compression: uWS.DEDICATED_COMPRESSOR_4KB,
+    upgrade: (res, req, context) => {
+        if (!ready[index] || full[index]) return res.writeStatus("503").end();
+
+        const key = req.getHeader("sec-websocket-key");
+        const pro = req.getHeader("sec-websocket-protocol");
+        // Clients taking packed cells (OP 13) ask for it in the subprotocol, they get no deflate and so
+        // no per socket compressor
+        const ext = pro === PACKED_PROTOCOL ? "" : req.getHeader("sec-websocket-extensions");
+        const userData = { uid: req.getQuery(), ip: new Uint8Array(res.getRemoteAddress()).join(".") };
+
+        if (conns[index] < CONN_THROTTLE) {
+            res.upgrade(userData, key, pro, ext, context);
+            conns[index]++;
+        } else {
+            const queue = upgradeQueues[index];
+            queue.push([res, userData, key, pro, ext, context]);
+            res.onAborted(() => {
+                const i = queue.findIndex(item => item[0] === res);
+                i >= 0 && queue.splice(i, 1);
+            });
+        }
+    },
+    open: ws => {
+        // The world owns the other end of the channel as a FakeSocket
+        const { port1, port2 } = new MessageChannel();
+        ws.port = port1;
+        ws.id = nextSocketId++ | 0;
+        ws.slot = slots[index].length ? slots[index].pop() : -1;
+        ws.shook = false;
+        ws.compress = true;
+        ws.reported = 0;
+        if (ws.slot >= 0) ios[index].reset(ws.slot);
+        sockets[index].set(ws.id, ws);
+
+        port1.onmessage = e => {
+            const { data } = e;
+            // World stopped reading the slot, it closes the port right after
+            if (data.event === "free") return void slots[index].push(data.slot);
+            if (ws.closed) return;
+            if (data.event === "message") {
+                ws.send(data.message, true, ws.compress);
+                reportBuffered(ws);
+            } else if (data.event === "close") {
+                // What the world wrote before closing goes out first
+                ios[index].output.read(senders[index]);
+                ws.end(data.code, data.reason);
+            }
+        };
+        workers[index].postMessage({ event: "connect", port: port2, ip: ws.ip, uid: ws.uid, 
+            slot: ws.slot, id: ws.id }, [port2]);
+    },
+    message: (ws, message, isBinary) => {
+        if (!isBinary) return ws.end(1003);
+        // Mouse packets are parsed here and picked up by the world when it ticks
+        if (ws.shook && ws.slot >= 0 && message.byteLength >= 15) {
+            const view = new DataView(message);
+            if (view.getUint8(0) === 3) return ios[index].put(ws.slot, view);
+        }
+        if (!ws.shook) {
+            // OgarX handshake ends with its flags, bit 1 = packed cells instead of deflate
+            const bytes = new Uint8Array(message);
+            if (bytes.length >= 7 && bytes[0] === 69 && bytes[bytes.length - 1] & 2) ws.compress = false;
+        }
+        ws.shook = true;
+        // uWS reuses the message buffer after this callback
+        const copy = message.slice(0);
+        ws.port.postMessage({ event: "message", message: copy }, [copy]);
+    },
+    drain: ws => ws.slot >= 0 ? Atomics.store(ios[index].buffered, ws.slot, ws.getBufferedAmount()) : reportBuffered(ws),
+    close: (ws, code, message) => {
+        ws.closed = true;
+        sockets[index].delete(ws.id);
+        // The world closes the port once it gave the slot back
+        ws.port.postMessage({ event: "close", code, message: Buffer.from(message).toString() });
+    }
+}));
+
+app.get("/restart/:token", (res, req) => {
+        const authorization = req.getParameter(0);
+        if (TOKEN) {
+            if (TOKEN == authorization) {
+                res.end("Restarting");
+                // Through the SIGINT handler so the worlds are snapshotted
+                setTimeout(() => process.kill(process.pid, "SIGINT"), 1000);
+            } else {
+                res.writeStatus("401 Unauthorized");
+                res.end();
+            }
+        } else {
+            res.writeStatus("302");
+            res.writeHeader("location", "/");
+            res.end();
+        }
+    })
+    .get("/*", (res, _) => res.end(`Hello OGARX ${WORLDS.map(w => w.name).join(", ")}`))
+    .listen("0.0.0.0", ~~PORT, sock => {
+        if (!sock) {
+            console.error(`Host failed to open on :${PORT}`);
+            process.exit(1);
+        }
+        listenSocket = sock;
+        console.log(`Host opened on :${PORT} with ${WORLDS.length} worlds ` +
+            `(${WORLDS.map(w => `/${w.endpoint}`).join(", ")}) ${TOKEN ? "WITH" : "WITHOUT"} token`);
+    });
@@ -1,11 +1,36 @@
 const fs = require("fs");
 const path = require("path");
-const CORE_PATH  = path.resolve(__dirname, "..", "public", "static", "wasm", "server.wasm");
-const PROTOCOL_PATH = path.resolve(__dirname, "..", "public", "static", "wasm", "ogarx.wasm");
+// 32 bit cell id builds (compiled with -DWIDE_IDS) lift the 65536 cell limit
+const WIDE_IDS = !!process.env.OGARX_WIDE_IDS;
+// Clients are encoded on this many worker threads besides the main one (needs the shared memory builds)
+let ENCODE_THREADS = ~~process.env.OGARX_ENCODE_THREADS;
+// Encode tick N on the workers while tick N + 1 is simulated, frames go out one tick later
+const ENCODE_PIPELINE = !!process.env.OGARX_ENCODE_PIPELINE;
+const WASM_DIR = path.resolve(__dirname, "..", "public", "static", "wasm");
+/** @param {string} name */
+const built = name => fs.existsSync(path.resolve(WASM_DIR, `server${name}.wasm`)) && fs.existsSync(path.resolve(WASM_DIR, `ogarx${name}.wasm`));
+
+if (WIDE_IDS && !built("-wide"))
+    throw new Error(`OGARX_WIDE_IDS needs server-wide.wasm and ogarx-wide.wasm, build them with "npm run build:wasm"`);
+// Encoding on the main thread works with any build, the shared one only speeds it up
+if (ENCODE_THREADS && !built(`${WIDE_IDS ? "-wide" : ""}-shared`)) {
+    console.warn(`OGARX_ENCODE_THREADS needs the shared memory builds (npm run build:wasm), encoding on the main thread`);
+    ENCODE_THREADS = 0;
+}
+
+const BUILD = `${WIDE_IDS ? "-wide" : ""}${ENCODE_THREADS ? "-shared" : ""}`;
+const CORE_PATH  = path.resolve(WASM_DIR, `server${BUILD}.wasm`);
+const PROTOCOL_PATH = path.resolve(WASM_DIR, `ogarx${BUILD}.wasm`);
 const SSL_FOLDER_PATH = path.resolve(__dirname, "..", "ssl");
 const SSL_PATH = path.resolve(SSL_FOLDER_PATH, "options.json");
+// World is saved here on shutdown and restored on startup
+const SNAPSHOT_PATH = process.env.OGARX_SNAPSHOT;
+// One region of a partitioned map, JSON { index, cols, rows, endpoints, key?, margin?, handoff?, dir? } (see physics/region.js)
+const REGION = process.env.OGARX_REGION && JSON.parse(process.env.OGARX_REGION);
 
 const Server = require("./network/ws-server");
+const Region = require("./physics/region");
+const EncodePool = require("./network/encode-pool");
 const OgarXProtocol = require("./network/protocols/ogarx");
 
 const server = new Server(process.env.OGARX_SERVER);
@@ -15,6 +40,9 @@ server.setGameMode(process.env.OGARX_MODE || "default");
 
 process.on("SIGINT", async () => {
     engine.stop();
+    engine.region && engine.region.close();
+    engine.encoder && await engine.encoder.close();
+    server.saveSnapshot(SNAPSHOT_PATH);
     await server.close();
     process.exit(0);
 });
@@ -24,8 +52,12 @@ if (!fs.existsSync(SSL_FOLDER_PATH)) fs.mkdirSync(SSL_FOLDER_PATH);
 if (fs.existsSync(SSL_PATH)) sslOptions = require(SSL_PATH);
 
 (async () => {
-    await engine.init(fs.readFileSync(CORE_PATH));
-    await OgarXProtocol.init(fs.readFileSync(PROTOCOL_PATH), 100); // 100mb
+    await engine.init(fs.readFileSync(CORE_PATH), ENCODE_THREADS > 0);
+    await OgarXProtocol.init(fs.readFileSync(PROTOCOL_PATH), 100, engine.ID_BYTES === 4, ENCODE_THREADS > 0); // 100mb
+    if (ENCODE_THREADS) await new EncodePool(engine, ENCODE_THREADS, ENCODE_PIPELINE).open();
+
+    server.loadSnapshot(SNAPSHOT_PATH);
+    if (REGION) new Region(server.game, REGION).open();
 
     const opened = await server.open({ 
         sslOptions, 
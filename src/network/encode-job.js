@@ -0,0 +1,103 @@
+const encodeFrame = require("./protocols/ogarx-frame");
+
+// Control words (Int32Array over a SharedArrayBuffer)
+const GEN = 0;   // bumped once per tick to wake the workers
+const COUNT = 1; // jobs this tick
+const NEXT = 2;  // next job to take, tagged with the low 16 bits of GEN
+const DONE = 3;  // jobs finished this tick
+const STOP = 4;
+const FAILED = 5; // a worker threw, its job has no frame
+
+/** Most jobs per tick, the rest is encoded on the main thread */
+const MAX_JOBS = 1024;
+// Job table (Float64Array): tree pointer, map half width and height, cells pointer, then one record per client
+const HEADER = 4;
+const STRIDE = 18;
+/**
+ * Record fields: slot, id, cells, lockDir, score, mouseX, mouseY, viewportX, viewportY,
+ * viewportHW, viewportHH, then the visible list state (last ptr/len, curr ptr/len) in and out,
+ * then the encoded frame (ptr, len) out and whether the client takes packed frames
+ */
+const J_SLOT = 0, J_ID = 1, J_CELLS = 2, J_LOCK = 3, J_SCORE = 4,
+    J_MOUSE_X = 5, J_MOUSE_Y = 6, J_VIEW_X = 7, J_VIEW_Y = 8, J_VIEW_HW = 9, J_VIEW_HH = 10,
+    J_LAST_PTR = 11, J_LAST_LEN = 12, J_CURR_PTR = 13, J_CURR_LEN = 14, J_OUT_PTR = 15, J_OUT_LEN = 16,
+    J_PACKED = 17;
+
+/**
+ * Take the next job of the tick a thread woke up for, -1 once they are all taken. A thread that
+ * wakes up late sees the tag of a newer tick and takes nothing, so only the jobs are waited on
+ * @param {Int32Array} ctrl
+ * @param {number} gen
+ * @param {number} n jobs of that tick
+ */
+const claim = (ctrl, gen, n) => {
+    const tag = (gen & 0xffff) << 16;
+    for (;;) {
+        const next = Atomics.load(ctrl, NEXT);
+        const j = next & 0xffff;
+        if ((next & ~0xffff) !== tag || j >= n) return -1;
+        if (Atomics.compareExchange(ctrl, NEXT, next, next + 1) === next) return j;
+    }
+};
+
+/**
+ * Query and encode one job, on the main thread or a worker
+ * @param {Float64Array} jobs
+ * @param {number} index
+ * @param {import("./protocols/ogarx-frame").FrameState} s
+ * @param {(l: number, r: number, b: number, t: number) => Uint16Array|Uint32Array} query
+ * @param {number} I cell id bytes
+ * @param {number} TABLE_SIZE
+ */
+const runJob = (jobs, index, s, query, I, TABLE_SIZE) => {
+    const o = HEADER + index * STRIDE;
+    const x = jobs[o + J_VIEW_X], y = jobs[o + J_VIEW_Y];
+    const hw = jobs[o + J_VIEW_HW], hh = jobs[o + J_VIEW_HH];
+    const vlist = query(x - hw, x + hw, y - hh, y + hh);
+
+    // Nothing visible, nothing sent and the visible lists stay as they are
+    jobs[o + J_OUT_LEN] = 0;
+    if (!vlist.length) return;
+
+    s.last_vlist_ptr = jobs[o + J_LAST_PTR];
+    s.last_vlist_len = jobs[o + J_LAST_LEN];
+    s.curr_vlist_ptr = jobs[o + J_CURR_PTR];
+    s.curr_vlist_len = jobs[o + J_CURR_LEN];
+
+    const frame = encodeFrame(s, vlist, {
+        id: jobs[o + J_ID],
+        cells: jobs[o + J_CELLS],
+        lockDir: jobs[o + J_LOCK],
+        score: jobs[o + J_SCORE],
+        mouseX: jobs[o + J_MOUSE_X], mouseY: jobs[o + J_MOUSE_Y],
+        viewportX: x, viewportY: y,
+        packed: jobs[o + J_PACKED]
+    }, I, TABLE_SIZE, jobs[1], jobs[2], jobs[3]);
+
+    jobs[o + J_LAST_PTR] = s.last_vlist_ptr;
+    jobs[o + J_LAST_LEN] = s.last_vlist_len;
+    jobs[o + J_CURR_PTR] = s.curr_vlist_ptr;
+    jobs[o + J_CURR_LEN] = s.curr_vlist_len;
+    jobs[o + J_OUT_PTR] = frame.byteOffset;
+    jobs[o + J_OUT_LEN] = frame.byteLength;
+}
+
+/**
+ * Count a finished job, the last one wakes the thread collecting the tick
+ * @param {Int32Array} ctrl
+ * @param {number} n
+ */
+const finish = (ctrl, n) => {
+    if (Atomics.add(ctrl, DONE, 1) + 1 >= n) Atomics.notify(ctrl, DONE);
+};
+
+/**
+ * Job table and control words shared by the encode pool (network/encode-pool.js) and its workers,
+ * kept apart so the workers load nothing but the frame encoder
+ */
+module.exports = {
+    GEN, COUNT, NEXT, DONE, STOP, FAILED, MAX_JOBS, HEADER, STRIDE,
+    J_SLOT, J_ID, J_CELLS, J_LOCK, J_SCORE, J_MOUSE_X, J_MOUSE_Y, J_VIEW_X, J_VIEW_Y, J_VIEW_HW, J_VIEW_HH,
+    J_LAST_PTR, J_LAST_LEN, J_CURR_PTR, J_CURR_LEN, J_OUT_PTR, J_OUT_LEN, J_PACKED,
+    claim, runJob, finish
+};
@@ -0,0 +1,238 @@
+const path = require("path");
+const { Worker, MessageChannel } = require("worker_threads");
+
+const {
+    GEN, COUNT, NEXT, DONE, STOP, FAILED, MAX_JOBS, HEADER, STRIDE,
+    J_SLOT, J_ID, J_CELLS, J_LOCK, J_SCORE, J_MOUSE_X, J_MOUSE_Y, J_VIEW_X, J_VIEW_Y, J_VIEW_HW, J_VIEW_HH,
+    J_LAST_PTR, J_LAST_LEN, J_CURR_PTR, J_CURR_LEN, J_OUT_PTR, J_OUT_LEN, J_PACKED,
+    claim, runJob, finish
+} = require("./encode-job");
+
+/**
+ * Encodes the clients' own streams of a tick in parallel. Workers instantiate the shared memory builds
+ * of server.wasm and ogarx.wasm on the engine's and the protocols' memories, so cells and visibility state
+ * are read and written in place. Jobs go through a shared table, the main thread takes jobs too and sends
+ * every frame once all of them are done (before physics touches the cells again). Only the jobs are waited on,
+ * a worker that didn't wake up in time takes nothing from the tick (see claim in network/encode-job.js).
+ *
+ * Pipelined, the cells and the tree are frozen into a copy after the tick's serialize instead and only the
+ * workers encode, against the copy, while the main thread simulates the next tick. The frames are collected
+ * and sent when that tick starts, one tick later than in place
+ */
+class EncodePool {
+
+    /**
+     * @param {import("../physics/engine")} engine
+     * @param {number} threads
+     * @param {boolean} pipeline encode tick N while tick N + 1 is simulated
+     */
+    constructor(engine, threads, pipeline = false) {
+        this.engine = engine;
+        this.threads = threads;
+        this.pipeline = pipeline;
+
+        this.control = new Int32Array(new SharedArrayBuffer(8 * 4));
+        /** Generation of the jobs in the table */
+        this.gen = 0;
+        this.jobs = new Float64Array(new SharedArrayBuffer((HEADER + MAX_JOBS * STRIDE) * 8));
+
+        /** @type {[import("./protocols/ogarx"), import("../game/controller")][]} */
+        this.queue = [];
+        /** @type {[import("./protocols/ogarx"), import("../game/controller")][]} jobs handed to the workers */
+        this.inflight = [];
+        /** @type {Set<number>} memory slots the workers have an instance for */
+        this.slots = new Set();
+        /** @type {Worker[]} */
+        this.workers = [];
+        /** @type {MessagePort[]} */
+        this.ports = [];
+
+        const e = engine;
+        const jobs = this.jobs;
+        this.query = (l, r, b, t) => {
+            const listPtr = e.scratchPtr;
+            return new e.IDArray(e.memory.buffer, listPtr, e.wasm.select(jobs[3], jobs[0], e.stackPtr, listPtr, l, r, b, t));
+        };
+    }
+
+    open() {
+        const OgarXProtocol = require("./protocols/ogarx");
+        const e = this.engine;
+
+        if (!(e.memory.buffer instanceof SharedArrayBuffer))
+            throw new Error("Encode workers need the shared memory builds (see src/c/*.sh)");
+
+        // Every worker queries into its own traversal stack and select list, reserved in the engine memory
+        const stack = 4 * 4 * e.options.QUADTREE_MAX_LEVEL;
+        const size = Math.ceil((stack + e.CELL_LIMIT * e.ID_BYTES) / 8) * 8;
+        const base = e.arena.reserve(size * this.threads);
+        // Then the frozen cells and tree
+        this.frozenTreeSize = this.pipeline ? 8 * e.ID_BYTES * e.CELL_LIMIT : 0;
+        if (this.pipeline) {
+            this.frozenCells = e.arena.reserve(e.BYTES_PER_CELL * e.CELL_LIMIT);
+            this.frozenTree = e.arena.reserve(this.frozenTreeSize);
+        }
+
+        const online = [];
+        for (let i = 0; i < this.threads; i++) {
+            const { port1, port2 } = new MessageChannel();
+            const worker = new Worker(path.resolve(__dirname, "encode-worker.js"), {
+                workerData: {
+                    core: e.module,
+                    protocol: OgarXProtocol.Module,
+                    memory: e.memory,
+                    control: this.control.buffer,
+                    jobs: this.jobs.buffer,
+                    port: port2,
+                    stackPtr: base + i * size,
+                    listPtr: base + i * size + stack,
+                    ID_BYTES: OgarXProtocol.ID_BYTES,
+                    TABLE_SIZE: OgarXProtocol.TABLE_SIZE
+                },
+                transferList: [port2]
+            }).on("error", err => console.error(`Encode worker#${i} crashed`, err));
+
+            online.push(new Promise((resolve, reject) => {
+                worker.once("message", resolve);
+                worker.once("error", reject);
+            }));
+            this.workers.push(worker);
+            this.ports.push(port1);
+        }
+
+        e.encoder = this;
+        return Promise.all(online).then(() => console.log(`Encoding on ${this.threads} worker threads` +
+            (this.pipeline ? ", pipelined" : "")));
+    }
+
+    /**
+     * @param {import("./protocols/ogarx")} p
+     * @param {import("../game/controller")} controller
+     */
+    push(p, controller) {
+        if (this.queue.length < MAX_JOBS) this.queue.push([p, controller]);
+        else p.processVisibleList(this.engine.query(controller), controller);
+    }
+
+    flush() {
+        const n = this.queue.length;
+        if (!n) return;
+
+        const OgarXProtocol = require("./protocols/ogarx");
+        const e = this.engine;
+        const ctrl = this.control;
+        const jobs = this.jobs;
+
+        // A tree that outgrew its frozen copy is encoded in place for this tick
+        const pipelined = this.pipeline && e.treeEnd - e.treePtr <= this.frozenTreeSize;
+        if (pipelined) e.wasm.freeze(0, e.treePtr, e.treeEnd, this.frozenCells, this.frozenTree);
+        this.kick(pipelined ? this.frozenTree : e.treePtr, pipelined ? this.frozenCells : 0);
+        if (pipelined) return;
+
+        // Main thread works through the table as well, with the protocols' own instances
+        for (let j = claim(ctrl, this.gen, n); j >= 0; j = claim(ctrl, this.gen, n)) {
+            runJob(jobs, j, this.inflight[j][0], this.query, OgarXProtocol.ID_BYTES, OgarXProtocol.TABLE_SIZE);
+            finish(ctrl, n);
+        }
+        this.collect();
+    }
+
+    /**
+     * Hand the queued jobs to the workers
+     * @param {number} tree
+     * @param {number} cells
+     */
+    kick(tree, cells) {
+        this.collect();
+
+        const n = this.queue.length;
+        const o = this.engine.options;
+        const ctrl = this.control;
+        const jobs = this.jobs;
+
+        // Jobs of the last tick are all done, a worker still looping on it sees the new tag and stops
+        const gen = this.gen = (this.gen + 1) | 0;
+        Atomics.store(ctrl, NEXT, (gen & 0xffff) << 16);
+        Atomics.store(ctrl, DONE, 0);
+
+        jobs[0] = tree;
+        jobs[1] = o.MAP_HW;
+        jobs[2] = o.MAP_HH;
+        jobs[3] = cells;
+
+        for (let i = 0; i < n; i++) {
+            const [p, c] = this.queue[i];
+            const slot = p.memory.slot;
+            if (!this.slots.has(slot)) {
+                for (const port of this.ports) port.postMessage({ slot, memory: p.memory });
+                this.slots.add(slot);
+            }
+            // Not handed out again before it's collected, even if the protocol closes
+            p.memory.busy = true;
+
+            const r = HEADER + i * STRIDE;
+            jobs[r + J_SLOT] = slot;
+            jobs[r + J_ID] = c.id;
+            jobs[r + J_CELLS] = this.engine.counts[c.id];
+            jobs[r + J_LOCK] = c.lockDir ? 1 : 0;
+            jobs[r + J_SCORE] = c.handle.score;
+            jobs[r + J_MOUSE_X] = c.mouseX;
+            jobs[r + J_MOUSE_Y] = c.mouseY;
+            jobs[r + J_VIEW_X] = c.viewportX;
+            jobs[r + J_VIEW_Y] = c.viewportY;
+            jobs[r + J_VIEW_HW] = c.viewportHW;
+            jobs[r + J_VIEW_HH] = c.viewportHH;
+            jobs[r + J_LAST_PTR] = p.last_vlist_ptr;
+            jobs[r + J_LAST_LEN] = p.last_vlist_len;
+            jobs[r + J_CURR_PTR] = p.curr_vlist_ptr;
+            jobs[r + J_CURR_LEN] = p.curr_vlist_len;
+            jobs[r + J_PACKED] = p.packed ? 1 : 0;
+        }
+
+        [this.queue, this.inflight] = [this.inflight, this.queue];
+
+        Atomics.store(ctrl, COUNT, n);
+        Atomics.store(ctrl, GEN, gen);
+        Atomics.notify(ctrl, GEN);
+    }
+
+    /** 
+     * Wait for the jobs handed out and send their frames. Called when a tick starts and before
+     * the main thread touches a protocol memory that might still be encoded (nothing to do in place)
+     */
+    collect() {
+        const n = this.inflight.length;
+        if (!n) return;
+
+        const ctrl = this.control;
+        const jobs = this.jobs;
+
+        for (let done = Atomics.load(ctrl, DONE); done < n; done = Atomics.load(ctrl, DONE))
+            Atomics.wait(ctrl, DONE, done);
+        if (Atomics.load(ctrl, FAILED)) throw new Error("Encode worker failed, see its error above");
+
+        for (let i = 0; i < n; i++) {
+            const p = this.inflight[i][0];
+            const r = HEADER + i * STRIDE;
+            p.memory.busy = false;
+            p.last_vlist_ptr = jobs[r + J_LAST_PTR];
+            p.last_vlist_len = jobs[r + J_LAST_LEN];
+            p.curr_vlist_ptr = jobs[r + J_CURR_PTR];
+            p.curr_vlist_len = jobs[r + J_CURR_LEN];
+            const len = jobs[r + J_OUT_LEN];
+            if (len) p.send(new Uint8Array(p.memory.buffer, jobs[r + J_OUT_PTR], len));
+        }
+        this.inflight.length = 0;
+    }
+
+    close() {
+        this.collect();
+        Atomics.store(this.control, STOP, 1);
+        Atomics.store(this.control, GEN, this.gen = (this.gen + 1) | 0);
+        Atomics.notify(this.control, GEN);
+        if (this.engine.encoder === this) this.engine.encoder = null;
+        return Promise.all(this.workers.map(w => new Promise(resolve => w.once("exit", resolve))));
+    }
+}
+
+module.exports = EncodePool;
@@ -0,0 +1,71 @@
+const { workerData, parentPort, receiveMessageOnPort } = require("worker_threads");
+const { GEN, COUNT, STOP, FAILED, HEADER, STRIDE, claim, runJob, finish } = require("./encode-job");
+
+const { core, protocol, memory, control, jobs, port, stackPtr, listPtr, ID_BYTES, TABLE_SIZE } = workerData;
+
+// Only the cell getters and select are called here, an engine callback means the module changed under us
+const stubs = {};
+for (const i of WebAssembly.Module.imports(core))
+    if (i.kind === "function") stubs[i.name] = () => { throw new Error(`Encode worker called engine import ${i.name}`); };
+
+const engine = new WebAssembly.Instance(core, { env: Object.assign(stubs, { memory, powf: Math.pow }) }).exports;
+const { get_cell_updated, get_cell_x, get_cell_y, get_cell_r, get_cell_type, get_cell_eatenby } = engine;
+
+const IDArray = ID_BYTES === 4 ? Uint32Array : Uint16Array;
+const ctrl = new Int32Array(control);
+const table = new Float64Array(jobs);
+
+/** @type {Map<number, import("./protocols/ogarx-frame").FrameState>} */
+const slots = new Map();
+
+// Protocol memories are announced before the tick that first uses them
+const register = () => {
+    for (let msg = receiveMessageOnPort(port); msg; msg = receiveMessageOnPort(port)) {
+        const { slot, memory } = msg.message;
+        const wasm = new WebAssembly.Instance(protocol, {
+            env: {
+                memory,
+                get_cell_updated, get_cell_x, get_cell_y, get_cell_r,
+                get_cell_type, get_cell_eatenby
+            }
+        });
+        slots.set(slot, {
+            wasm, memory,
+            view: new DataView(memory.buffer),
+            last_vlist_ptr: 0, last_vlist_len: 0,
+            curr_vlist_ptr: 0, curr_vlist_len: 0
+        });
+    }
+};
+
+/** @param {number} l @param {number} r @param {number} b @param {number} t */
+const query = (l, r, b, t) =>
+    new IDArray(memory.buffer, listPtr, engine.select(table[3], table[0], stackPtr, listPtr, l, r, b, t));
+
+// Read before going online, the first tick can't be missed
+let gen = Atomics.load(ctrl, GEN);
+parentPort.postMessage("online");
+
+for (;;) {
+    Atomics.wait(ctrl, GEN, gen);
+    gen = Atomics.load(ctrl, GEN);
+    if (Atomics.load(ctrl, STOP)) break;
+
+    const n = Atomics.load(ctrl, COUNT);
+    for (let j = claim(ctrl, gen, n); j >= 0; j = claim(ctrl, gen, n)) {
+        const slot = table[HEADER + j * STRIDE];
+        if (!slots.has(slot)) register();
+        try {
+            if (!slots.has(slot)) throw new Error(`Memory slot ${slot} was never announced`);
+            runJob(table, j, slots.get(slot), query, ID_BYTES, TABLE_SIZE);
+        } catch (e) {
+            // Counted anyway so the main thread doesn't wait forever, it throws once it collects
+            Atomics.store(ctrl, FAILED, 1);
+            finish(ctrl, n);
+            throw e;
+        }
+        finish(ctrl, n);
+    }
+}
+
+process.exit(0);
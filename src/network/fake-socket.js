@@ -1,16 +1,37 @@
 module.exports = class FakeSocket {
-    /** @param {MessagePort} port */
-    constructor(port) {
+    /** 
+     * @param {MessagePort} port
+     * @param {string} ip address of the client behind the port, when known
+     * @param {import("./world-io")} io shared with the host, packets go out through its ring
+     * @param {number} slot input slot in io, -1 without one
+     * @param {number} id tag of this connection's records in the output ring
+     */
+    constructor(port, ip = "127.0.0.1", io = null, slot = -1, id = 0) {
         port.ws = this;
         this.port = port;
-        this.readyState = WebSocket.OPEN;
+        this.readyState = 1; // WebSocket.OPEN, not a global in worker_threads
+        this.__ip = ip;
+        this.io = slot >= 0 ? io : null;
+        this.slot = slot;
+        this.id = id;
+        /** Last input sequence taken from the slot */
+        this.seq = 0;
+        /** uWS backpressure reported by the host over the port, for connections without a slot */
+        this.buffered = 0;
+        /** A packet didn't fit in the output ring, the protocol resyncs the client before the next diff */
+        this.desync = false;
 
         port.onmessage = e => {
             const { data } = e;
             if (data.event === "message") {
                 this.onmessage(data.message);
+            } else if (data.event === "buffered") {
+                const drained = this.buffered && !data.amount;
+                this.buffered = data.amount;
+                drained && this.p && this.p.onDrain();
             } else if (data.event === "close") {
                 this.onclose({ code: data.code, reason: data.message });
+                this.port.close();
             }
         }
 
@@ -21,18 +42,38 @@ module.exports = class FakeSocket {
         this.p = null;
     }
 
-    get ip() { return "127.0.0.1"; }
+    get ip() { return this.__ip; }
 
-    getBufferedAmount() { return 0; }
+    getBufferedAmount() {
+        if (!this.io) return this.buffered;
+        // Host falling behind on the ring is backpressure for every connection
+        const ring = this.io.output;
+        const used = ring.used;
+        return Atomics.load(this.io.buffered, this.slot) + (used > ring.size >> 1 ? used : 0);
+    }
 
     /** @param {BufferSource} buffer */
     send(buffer) {
+        // Copied straight into the ring, views into wasm memory included
+        if (this.io) {
+            if (!this.io.output.write(this.id, ArrayBuffer.isView(buffer) ?
+                new Uint8Array(buffer.buffer, buffer.byteOffset, buffer.byteLength) : new Uint8Array(buffer)))
+                this.desync = true;
+            return;
+        }
+        // Views point into wasm memory or a broadcast shared between clients, copy out what they cover.
+        // Plain buffers belong to this send and are transferred
+        if (ArrayBuffer.isView(buffer))
+            buffer = new Uint8Array(buffer.buffer, buffer.byteOffset, buffer.byteLength).slice().buffer;
         this.port.postMessage({ event: "message", message: buffer }, [buffer]);
     }
 
+    cork(cb) { cb(); }
+
     end(code = 1006, reason = "") {
         this.port.postMessage({ event: "close", code, reason });
-        this.port.close();
+        // Anything the close handler posts (the slot going back to the host) still goes through the port
         this.onclose(code, reason);
+        this.port.close();
     }
 }
\ No newline at end of file
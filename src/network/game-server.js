@@ -0,0 +1,150 @@
+const fs = require("fs");
+const net = require("net");
+const path = require("path");
+const crypto = require("crypto");
+
+const pipename = str => process.platform == "win32" ? `\\\\.\\pipe\\${str.replace(/^\//, "").replace(/\//g, "-")}` : str;
+const SOCKET_FILE = path.resolve(__dirname, "..", "unix.sock");
+
+const Protocols = require("./protocols");
+const Game = require("../game");
+
+/**
+ * One world and its clients, independent of the transport (uWS listener or ports handed over by a host)
+ */
+module.exports = class GameServer {
+
+    constructor(name) {
+        this.uid = crypto.randomBytes(12).toString("hex");
+        this.modes = require("../modes");
+        this.game = new Game(name);
+        /** @type {import("./protocol")[]} */
+        this.disconnected = [];
+        this.lastReport = { time: performance.now(), bytes: 0 };
+    }
+
+    setGameMode(mode = "") {
+        if (this.modes.has(mode)) {
+            this.game.engine.setOptions(this.modes.get(mode));
+            console.log(`Gamemode is set to "${mode}"`);
+        } else {
+            console.error(`Gamemode "${mode}" doesn't exist`);
+        }
+    }
+
+    ipcConnect() {
+        if (this.ipcClient) return;
+        this.ipcClient = net.connect(pipename(SOCKET_FILE))
+            .on("error", this.ipcReconnect.bind(this))
+            .on("close", this.ipcReconnect.bind(this));
+    }
+
+    ipcReconnect() {
+        delete this.ipcClient;
+        console.log("Reconnecting to Gateway");
+        setTimeout(() => this.ipcConnect(), 5000);
+    }
+
+    /**
+     * Report to the gateway and drop disconnected players past their reconnect time.
+     * The gateway ranks servers by the tick metrics (usage, p99 over the tick budget)
+     */
+    report(endpoint = "") {
+        const g = this.game;
+        const e = g.engine;
+        const now = performance.now();
+        const last = this.lastReport;
+        const bytes = (g.bytesSent - last.bytes) * 1000 / Math.max(now - last.time, 1);
+        this.lastReport = { time: now, bytes: g.bytesSent };
+        try {
+            this.ipcClient.write(JSON.stringify({
+                pid: process.pid,
+                uid: this.uid,
+                name: g.name,
+                endpoint,
+                bot: g.engine.bots.length,
+                real: g.playerCount,
+                players: g.handles,
+                total: 250, // Number in theory
+                usage: e.usage,
+                p99: e.tickPercentile(0.99),
+                tick: e.tickDelay || 1000 / e.options.PHYSICS_TPS,
+                bytes: Math.round(bytes)
+            }));
+
+            this.disconnected = this.disconnected.filter(p => {
+                if (g.engine.__now > p.disconnectTime + g.options.SOCKET_RECONNECT) {
+                    p.off();
+                    return false;
+                } else return true;
+            });
+            g.expireResumes();
+        } catch (_) {}
+    }
+
+    /**
+     * Protocol of a client reconnecting with its uid, null if there is none
+     * @param {string} uid
+     */
+    reconnect(uid) {
+        const index = uid ? this.disconnected.findIndex(p => p.uid == uid) : -1;
+        return index >= 0 ? this.disconnected.splice(index, 1)[0] : null;
+    }
+
+    /**
+     * @param {{ p: import("./protocol"), end: (code?: number, reason?: string) => void }} ws
+     * @param {ArrayBuffer} message
+     */
+    onSocketMessage(ws, message) {
+        if (!ws.p) {
+            const Protocol = Protocols.find(p => p.handshake(new DataView(message)));
+            if (!Protocol) ws.end(1003, "Ambiguous protocol");
+            else ws.p = new Protocol(this.game, ws, message);
+        } else {
+            try {
+                if (!ws.p.ws) {
+                    ws.p.ws = ws;
+                    ws.p.init && ws.p.init(message, true);
+                } else {
+                    ws.p.onMessage(new DataView(message));
+                }
+            } catch (e) {}
+        }
+    }
+
+    /** @param {{ p: import("./protocol") }} ws */
+    onSocketClose(ws) {
+        if (!ws.p) return;
+        ws.p.disconnectTime = this.game.engine.__now;
+        this.disconnected.push(ws.p);
+        try {
+            this.game.emit("log", `${ws.p.controller.name} disconnected`);
+        } catch (e) {}
+        delete ws.p.ws;
+    }
+
+    /** @param {string} file */
+    saveSnapshot(file) {
+        const engine = this.game.engine;
+        if (!file || !engine.wasm) return;
+        fs.mkdirSync(path.dirname(file), { recursive: true });
+        fs.writeFileSync(file, Buffer.from(engine.snapshot()));
+        console.log(`World snapshot saved to ${file}`);
+    }
+
+    /** @param {string} file */
+    loadSnapshot(file) {
+        if (!file || !fs.existsSync(file)) return;
+        const buffer = fs.readFileSync(file);
+        if (this.game.restore(buffer.buffer.slice(buffer.byteOffset, buffer.byteOffset + buffer.byteLength)))
+            console.log(`World restored from ${file} (${this.game.resumes.size} players to resume)`);
+        // Consumed, a crash later on must not bring back this state
+        fs.unlinkSync(file);
+    }
+
+    close() {
+        clearInterval(this.ipcInterval);
+        try { this.ipcClient.destroy(); } catch (e) {}
+        console.log(`Server closed`);
+    }
+}
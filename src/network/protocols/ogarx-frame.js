@@ -0,0 +1,96 @@
+/**
+ * @typedef {{
+ *  wasm: WebAssembly.Instance, memory: WebAssembly.Memory, view: DataView,
+ *  last_vlist_ptr: number, last_vlist_len: number,
+ *  curr_vlist_ptr: number, curr_vlist_len: number
+ * }} FrameState one ogarx instance and its visible lists
+ *
+ * @typedef {{
+ *  id: number, cells: number, lockDir: boolean|number, score: number,
+ *  mouseX: number, mouseY: number, viewportX: number, viewportY: number, packed?: boolean|number
+ * }} FrameHeader
+ */
+
+/**
+ * Steps 1 to 4 on one ogarx instance (a protocol, a spectator group or a job of an encode worker),
+ * returns the encoded packet as a view into the instance memory, only valid until its next encode
+ * @param {FrameState} s
+ * @param {Uint16Array|Uint32Array} vlist
+ * @param {FrameHeader} h
+ * @param {number} I cell id bytes
+ * @param {number} TABLE_SIZE
+ * @param {number} hw map half width
+ * @param {number} hh map half height
+ * @param {number} cells engine pointer of the cells to read, the frozen copy when encoding is pipelined
+ */
+module.exports = (s, vlist, h, I, TABLE_SIZE, hw, hh, cells = 0) => {
+    // Shared memory grown by another thread
+    if (s.view.byteLength != s.memory.buffer.byteLength) s.view = new DataView(s.memory.buffer);
+
+    // Step 1
+    s.wasm.exports.move_hashtable();
+    // Step 2
+    s.wasm.exports.copy(s.last_vlist_ptr, s.curr_vlist_ptr, s.curr_vlist_len * I);
+    // Update ptr and len
+    s.last_vlist_len = s.curr_vlist_len;
+    s.curr_vlist_ptr = s.last_vlist_ptr + s.last_vlist_len * I; // I bytes per index
+    s.curr_vlist_len = vlist.length;
+    new (I === 4 ? Uint32Array : Uint16Array)(s.memory.buffer, s.curr_vlist_ptr, s.curr_vlist_len).set(vlist);
+
+    const AUED_table_ptr = s.curr_vlist_ptr + s.curr_vlist_len * I;
+
+    // Step 3
+    const AUED_end_ptr = s.wasm.exports.write_AUED(
+        cells, 0, TABLE_SIZE,
+        s.last_vlist_ptr, s.last_vlist_len,
+        s.curr_vlist_ptr, s.curr_vlist_len,
+        AUED_table_ptr, AUED_table_ptr + 16 // 4 * 4 bytes after the table
+    );
+
+    const A_count = s.view.getUint32(AUED_table_ptr + 0,  true);
+    const U_count = s.view.getUint32(AUED_table_ptr + 4,  true);
+    const E_count = s.view.getUint32(AUED_table_ptr + 8,  true);
+    const D_count = s.view.getUint32(AUED_table_ptr + 12, true);
+
+    // 1 byte OP + 1 byte pid + 2 bytes cell count + 1 byte linelocked +
+    // 4 bytes score + 8 bytes mouse + 8 bytes viewport + 4 * I bytes 0 padding = 25 + 4 * I bytes
+    // We don't have to calculate this because serialize returns the write end
+    // But this is a good way to verify it wrote as expect
+    const buffer_length = 25 + 4 * I + (I + 8) * A_count + (I + 6) * U_count + 2 * I * E_count + I * D_count;
+
+    const mem_check = AUED_end_ptr + buffer_length - s.memory.buffer.byteLength;
+    if (mem_check > 0) {
+        const extra_page = Math.ceil(mem_check / 65536);
+        s.memory.grow(extra_page);
+        s.view = new DataView(s.memory.buffer);
+        console.log(`Growing ${extra_page} page of memory in ogar69 protocol ` +
+            `memory for controller(${h.id})`);
+    }
+
+    // Step 4 serialize
+    const buffer_end = s.wasm.exports.serialize(
+        cells, h.id, h.cells, h.lockDir, h.score,
+        h.mouseX, h.mouseY,
+        h.viewportX, h.viewportY,
+        AUED_table_ptr, AUED_table_ptr + 16, AUED_end_ptr,
+        -hw, hw, hh, -hh);
+
+    const diff = buffer_end - AUED_end_ptr;
+    console.assert(diff == buffer_length, "Buffer length must match");
+
+    if (!h.packed) return new Uint8Array(s.memory.buffer, AUED_end_ptr, diff);
+
+    // Step 5 pack (OP 13): 2kb of tables, work area of 16 bytes per packet byte, then the packed packet
+    const tables_ptr = (buffer_end + 7) & ~7;
+    const work_ptr = tables_ptr + 2048;
+    const packed_ptr = work_ptr + 16 * diff + 64;
+
+    const pack_check = packed_ptr + 2 * diff + 64 - s.memory.buffer.byteLength;
+    if (pack_check > 0) {
+        s.memory.grow(Math.ceil(pack_check / 65536));
+        s.view = new DataView(s.memory.buffer);
+    }
+
+    const packed_end = s.wasm.exports.pack(AUED_end_ptr, tables_ptr, work_ptr, packed_ptr);
+    return new Uint8Array(s.memory.buffer, packed_ptr, packed_end - packed_ptr);
+}
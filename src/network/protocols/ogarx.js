@@ -3,29 +3,40 @@ const Protocol = require("../protocol");
 const Reader = require("../reader");
 const Writer = require("../writer");
 const DualHandle = require("../../game/dual");
+const encodeFrame = require("./ogarx-frame");
+
+const PROTOCOL_EXPORTS = ["clean", "copy", "move_hashtable", "pack", "serialize", "write_AUED"];
 
 class WebAssemblyPool {
 
-    /** @param {number} size */
-    static init(size) {
-        this.blocks = Array.from({ length: size }, (_, index) => {
-            const mem = new WebAssembly.Memory({ initial: 16, maximum: 32 });
-            mem.used = false;
-            return mem;
-        }); // 1mb, 2mb
+    /** 
+     * @param {number} size
+     * @param {number} initial
+     * @param {number} maximum
+     * @param {boolean} shared for the shared memory build, encoded by worker threads too
+     */
+    static init(size, initial = 16, maximum = 32, shared = false) {
+        this.initial = initial;
+        this.maximum = maximum;
+        this.shared = shared;
+        this.blocks = [];
+        for (let i = 0; i < size; i++) this.create(); // 1mb, 2mb
+    }
+
+    static create() {
+        const mem = new WebAssembly.Memory({ initial: this.initial, maximum: this.maximum, shared: this.shared });
+        mem.used = false;
+        mem.busy = false;
+        // Stable index, encode workers keep their instances by it
+        mem.slot = this.blocks.length;
+        this.blocks.push(mem);
+        return mem;
     }
 
     static get() {
-        let mem = this.blocks.find(b => !b.used);
-        
-        if (mem) {
-            mem.used = true;
-            return mem;
-        }
-        
-        mem = new WebAssembly.Memory({ initial: 16, maximum: 32 });
+        // Busy while an encode worker still writes to it
+        const mem = this.blocks.find(b => !b.used && !b.busy) || this.create();
         mem.used = true;
-        this.blocks.push(mem);
         return mem;
     }
 
@@ -35,7 +46,187 @@ class WebAssemblyPool {
     }
 }
 
-module.exports = class OgarXProtocol extends Protocol {
+/**
+ * Encode the next frame of one ogarx instance (a protocol or a spectator group), returns the packet
+ * as a view into the instance memory, only valid until its next encode (send copies it out)
+ * @param {OgarXProtocol|SpectatorGroup} s
+ * @param {Uint16Array|Uint32Array} vlist
+ * @param {import("../../game/controller")} controller
+ */
+const encodeVisibleList = (s, vlist, controller) => {
+    const o = s.game.options;
+    return encodeFrame(s, vlist, {
+        id: controller.id,
+        cells: s.game.engine.counts[controller.id],
+        lockDir: controller.lockDir,
+        score: controller.handle.score,
+        mouseX: controller.mouseX, mouseY: controller.mouseY,
+        viewportX: controller.viewportX, viewportY: controller.viewportY,
+        packed: s.packed
+    }, OgarXProtocol.ID_BYTES, OgarXProtocol.TABLE_SIZE, o.MAP_HW, o.MAP_HH);
+}
+
+/**
+ * Broadcast packet with the same bytes for every client, encoded once per event payload.
+ * Handed out as a view, transports copy views and only transfer (detach) buffers they own
+ * @template T
+ */
+class SharedPacket {
+
+    /** @param {(payload: T) => ArrayBuffer} encode */
+    constructor(encode) {
+        this.encode = encode;
+        /** @type {T} */
+        this.payload = undefined;
+        /** @type {Uint8Array} */
+        this.buffer = null;
+    }
+
+    /** @param {T} payload */
+    get(payload) {
+        if (this.payload !== payload || !this.buffer) {
+            this.payload = payload;
+            this.buffer = new Uint8Array(this.encode(payload));
+        }
+        return this.buffer;
+    }
+}
+
+const LB_COUNT = 10;
+
+const Broadcast = {
+    /** Leaderboard body, the rank is sent separately per client (OP 8) */
+    leaderboard: new SharedPacket(/** @param {import("../../game/handle")[]} handles */ handles => {
+        const count = Math.min(LB_COUNT, handles.length);
+        const writer = new Writer();
+        writer.writeUInt8(5);
+        writer.writeUInt8(count);
+        for (let i = 0; i < count; i++)
+            writer.writeUInt8(handles[i].controller.id);
+        return writer.finalize();
+    }),
+    minimap: new SharedPacket(/** @param {import("../../game/handle")[]} handles */ handles => {
+        const writer = new Writer();
+        writer.writeUInt8(6);
+        writer.writeUInt8(handles.length);
+        for (const h of handles) {
+            writer.writeUInt8(h.controller.id);
+            writer.writeFloat32(h.controller.viewportX);
+            writer.writeFloat32(h.controller.viewportY);
+            writer.writeFloat32(h.score);
+        }
+        return writer.finalize();
+    }),
+    chat: new SharedPacket(/** @param {string} message */ message => {
+        const writer = new Writer();
+        writer.writeUInt8(10);
+        writer.writeUTF16String(message);
+        return writer.finalize();
+    }),
+    log: new SharedPacket(/** @param {string} message */ message => {
+        const writer = new Writer();
+        writer.writeUInt8(11);
+        writer.writeUTF16String(message);
+        return writer.finalize();
+    }),
+    /** @type {WeakMap<import("../../game/controller"), { name: string, skin: string, buffer: Uint8Array }>} */
+    info: new WeakMap(),
+
+    /** @param {import("../../game/controller")} controller */
+    playerInfo(controller) {
+        const cached = this.info.get(controller);
+        if (cached && cached.name === controller.name && cached.skin === controller.skin) return cached.buffer;
+        const writer = new Writer();
+        writer.writeUInt8(3);
+        writer.writeUInt16(controller.id);
+        writer.writeUTF16String(controller.name);
+        writer.writeUTF16String(controller.skin);
+        const buffer = new Uint8Array(writer.finalize());
+        this.info.set(controller, { name: controller.name, skin: controller.skin, buffer });
+        return buffer;
+    }
+};
+
+/**
+ * Spectators of one controller share a visibility state, so each tick is encoded once 
+ * and the same packet goes to every member (packed and plain members are kept in separate groups)
+ */
+class SpectatorGroup {
+
+    /**
+     * @param {import("../../game")} game
+     * @param {import("../../game/controller")} target
+     * @param {boolean} packed
+     */
+    constructor(game, target, packed) {
+        this.game = game;
+        this.target = target;
+        this.packed = packed;
+        /** @type {Set<OgarXProtocol>} */
+        this.members = new Set();
+
+        const { get_cell_updated, get_cell_x, get_cell_y, get_cell_r, 
+            get_cell_type, get_cell_eatenby } = game.engine.wasm;
+
+        this.memory = WebAssemblyPool.get();
+        this.wasm = new WebAssembly.Instance(OgarXProtocol.Module, {
+            env: { 
+                memory: this.memory,
+                get_cell_updated, get_cell_x, get_cell_y, get_cell_r, 
+                get_cell_type, get_cell_eatenby 
+            }
+        });
+        this.wasm.exports.clean(0, this.memory.buffer.byteLength);
+        this.view = new DataView(this.memory.buffer);
+
+        this.last_vlist_ptr = 2 * OgarXProtocol.TABLE_SIZE;
+        this.last_vlist_len = 0;
+        this.curr_vlist_ptr = 2 * OgarXProtocol.TABLE_SIZE;
+        this.curr_vlist_len = 0;
+
+        this.lastTick = -1;
+        /** @type {ArrayBuffer} */
+        this.packet = null;
+    }
+
+    /** 
+     * @param {import("../../game")} game
+     * @param {import("../../game/controller")} target
+     * @param {boolean} packed
+     */
+    static get(game, target, packed) {
+        const groups = packed ? SpectatorGroup.packedGroups : SpectatorGroup.groups;
+        let group = groups.get(target);
+        if (!group) groups.set(target, group = new SpectatorGroup(game, target, packed));
+        return group;
+    }
+
+    /** Packet for this tick, encoded by the first member that asks */
+    update() {
+        const now = this.game.engine.__now;
+        if (this.lastTick === now) return this.packet;
+        this.lastTick = now;
+
+        const vlist = this.game.engine.query(this.target);
+        this.packet = vlist.length ? encodeVisibleList(this, vlist, this.target) : null;
+        return this.packet;
+    }
+
+    /** @param {OgarXProtocol} p */
+    remove(p) {
+        this.members.delete(p);
+        if (this.members.size) return;
+        (this.packed ? SpectatorGroup.packedGroups : SpectatorGroup.groups).delete(this.target);
+        WebAssemblyPool.free(this.memory);
+    }
+}
+
+/** @type {Map<import("../../game/controller"), SpectatorGroup>} */
+SpectatorGroup.groups = new Map();
+/** @type {Map<import("../../game/controller"), SpectatorGroup>} */
+SpectatorGroup.packedGroups = new Map();
+
+class OgarXProtocol extends Protocol {
 
     /** @param {DataView} view */
     static handshake(view) {
@@ -45,10 +236,21 @@ module.exports = class OgarXProtocol extends Protocol {
             reader.readInt16() == 420;
     }
 
-    /** @param {BufferSource} buffer */
-    static async init(buffer, pool_size = 10) {
-        this.Module = await WebAssembly.compile(buffer);
-        WebAssemblyPool.init(pool_size);
+    /** 
+     * @param {BufferSource|WebAssembly.Module} buffer
+     * @param {boolean} wide module is built with 32 bit cell ids (must match the engine)
+     */
+    static async init(buffer, pool_size = 10, wide = false, shared = false) {
+        this.Module = buffer instanceof WebAssembly.Module ? buffer : await WebAssembly.compile(buffer);
+        const names = WebAssembly.Module.exports(this.Module).map(e => e.name);
+        const missing = PROTOCOL_EXPORTS.filter(name => !names.includes(name));
+        if (missing.length) throw new Error(`ogarx.wasm is out of date (missing ${missing.join(", ")}), ` +
+            `rebuild it with "npm run build:wasm"`);
+        this.ID_BYTES = wide ? 4 : 2;
+        this.TABLE_SIZE = wide ? 1 << 18 : 1 << 16;
+        this.IDArray = wide ? Uint32Array : Uint16Array;
+        // 2 hash tables, 2 visible lists and the AUED buffer scale with the id range
+        wide ? WebAssemblyPool.init(pool_size, 48, 256, shared) : WebAssemblyPool.init(pool_size, 16, 32, shared);
     }
 
     /**
@@ -59,12 +261,14 @@ module.exports = class OgarXProtocol extends Protocol {
     constructor(game, ws, initMessage) {
         super(game);
         this.ws = ws;
-        this.uid = randomBytes(20).toString("base64");
+        // Client coming back to a controller restored from a snapshot keeps its uid
+        this.uid = ws.uid && game.resumes.has(ws.uid) ? ws.uid : randomBytes(20).toString("base64");
+        this.tick = this.tick.bind(this);
         this.init(initMessage);
 
-        this.last_vlist_ptr = 131072; // 2 * 64k or 2 ^ 17
+        this.last_vlist_ptr = 2 * OgarXProtocol.TABLE_SIZE; // right after the 2 hash tables
         this.last_vlist_len = 0;
-        this.curr_vlist_ptr = 131072; // 2 * 64k or 2 ^ 17
+        this.curr_vlist_ptr = 2 * OgarXProtocol.TABLE_SIZE;
         this.curr_vlist_len = 0;
     }
 
@@ -92,6 +296,15 @@ module.exports = class OgarXProtocol extends Protocol {
 
         this.controller.name = reader.readUTF16String(this.game.options.FORCE_UTF8);
         this.controller.skin = reader.readUTF16String(this.game.options.FORCE_UTF8);
+        const skin2 = reader.readUTF16String(this.game.options.FORCE_UTF8);
+        // Flags after the strings, bit 0 = 32 bit cell ids, bit 1 = packed cells (OP 13)
+        // instead of deflate (older clients don't send it)
+        const flags = reader.EOF ? 0 : reader.readUInt8();
+        this.packed = Boolean(flags & 2);
+
+        if (Boolean(flags & 1) != (OgarXProtocol.ID_BYTES == 4))
+            return this.onError(OgarXProtocol.ID_BYTES == 4 ? 
+                "Server uses 32 bit cell ids, reload with ?wide" : "Server uses 16 bit cell ids, reload without ?wide");
 
         if (this.game.options.DUAL_ENABLED) {
             if (!this.dual) {
@@ -105,11 +318,12 @@ module.exports = class OgarXProtocol extends Protocol {
 
         if (this.dual) {
             this.dual.controller.name = this.controller.name;
-            this.dual.controller.skin = reader.readUTF16String(this.game.options.FORCE_UTF8);
+            this.dual.controller.skin = skin2;
             this.pids.add(this.dual.controller.id);
         }
 
         this.sendInitPacket();
+        this.lastRank = null; // fresh client state, next leaderboard resends the rank
         
         for (const { message, isServer } of this.game.history)
             isServer ? this.onLog(message) : this.onChat(message);
@@ -129,6 +343,8 @@ module.exports = class OgarXProtocol extends Protocol {
 
     off() {
         delete this.ws;
+        if (this.group) this.group.remove(this);
+        this.group = null;
         super.off();
         if (this.dual) this.dual.off();
         WebAssemblyPool.free(this.memory);
@@ -143,15 +359,26 @@ module.exports = class OgarXProtocol extends Protocol {
         writer.writeUInt16(this.game.options.MAP_HH);
         writer.writeUTF16String(this.game.name);
         writer.writeUTF8String(this.uid);
+        // Movement constants for client side prediction (older clients stop reading before them)
+        const o = this.game.options;
+        writer.writeFloat32(1000 / o.PHYSICS_TPS);
+        writer.writeFloat32(o.PLAYER_SPEED);
+        writer.writeFloat32(o.TIME_SCALE);
         this.send(writer.finalize());
     }
 
     clear() {
+        // Pipelined frame of the last tick goes out first, and stops touching our memory
+        const { encoder } = this.game.engine;
+        encoder && encoder.collect();
+
         const CLEAR_SCREEN = new ArrayBuffer(1);
         new Uint8Array(CLEAR_SCREEN)[0] = 2;
         this.send(CLEAR_SCREEN);
         if (!this.last_vlist_len && !this.curr_vlist_len) return;
         this.wasm.exports.clean(0, this.memory.buffer.byteLength);
+        this.last_vlist_ptr = this.curr_vlist_ptr = 2 * OgarXProtocol.TABLE_SIZE;
+        this.last_vlist_len = this.curr_vlist_len = 0;
     }
 
     onDrain() {}
@@ -160,7 +387,6 @@ module.exports = class OgarXProtocol extends Protocol {
     onMessage(view) {
         const reader = new Reader(view);
         const OP = reader.readUInt8();
-        const a = this.active;
 
         switch (OP) {
             case 1:
@@ -178,50 +404,10 @@ module.exports = class OgarXProtocol extends Protocol {
                 this.active.lastSpawnTick = this.game.engine.__now;
                 break;
             case 3:
-                a.mouseX = ~~reader.readFloat32();
-                a.mouseY = ~~reader.readFloat32();
-                const spectate = reader.readUInt8();
-                if (this.alive) {
-                    const splits = reader.readUInt8();
-                    const ejects = reader.readUInt8();
-                    const macro  = reader.readUInt8();
-                    const lock   = reader.readUInt8();
-                    const s_tab  = reader.readUInt8();
-                    a.splitAttempts += splits;
-                    a.ejectAttempts += ejects;
-                    a.ejectMarco = Boolean(macro);
-                    if (lock) a.toggleLock();
-                    if (s_tab) {
-                        if (!this.dual) return;
-                        if (!this.controller.alive && !this.dual.controller.alive) {
-                            this.controller.requestSpawn();
-                        } else {
-                            if (!this.controller.alive) {
-                                this.controller.requestSpawn();
-                            } else if (!this.dual.controller.alive) {
-                                this.dual.controller.requestSpawn();
-                            } else {
-                                this.dualActive = !this.dualActive; // toggle            
-                            }
-                        }
-                    }
-                } else { // We are DEAD
-                    if (spectate && spectate <= 250) {
-                        const c = this.game.controls[spectate];
-                        if (!c.handle) break; // ??
-                        if (!c.handle.alive) break; // Can't spectate dead handle??
-                        this.spectate = c.handle.owner || c.handle;
-                    } else if (spectate === 255) {
-                        let score = 0;
-                        for (const c of this.game.controls) {
-                            if (!(c.handle instanceof OgarXProtocol)) continue;
-                            if (c.handle.score > score) {
-                                score = c.score;
-                                this.spectate = c.handle;
-                            }
-                        }
-                    }
-                }
+                this.onInput(
+                    ~~reader.readFloat32(), ~~reader.readFloat32(),
+                    reader.readUInt8(), reader.readUInt8(), reader.readUInt8(),
+                    reader.readUInt8(), reader.readUInt8(), reader.readUInt8());
                 break;
             case 7:
                 this.controller.autoRespawn = true;
@@ -241,6 +427,59 @@ module.exports = class OgarXProtocol extends Protocol {
         }
     }
 
+    /**
+     * Mouse packet (OP 3), parsed here or by the host thread into the connection's input slot
+     * @param {number} mouseX
+     * @param {number} mouseY
+     * @param {number} spectate
+     * @param {number} splits
+     * @param {number} ejects
+     * @param {number} macro
+     * @param {number} lock
+     * @param {number} s_tab
+     */
+    onInput(mouseX, mouseY, spectate, splits, ejects, macro, lock, s_tab) {
+        const a = this.active;
+        a.mouseX = mouseX;
+        a.mouseY = mouseY;
+        if (this.alive) {
+            a.splitAttempts += splits;
+            a.ejectAttempts += ejects;
+            a.ejectMarco = Boolean(macro);
+            if (lock) a.toggleLock();
+            if (s_tab) {
+                if (!this.dual) return;
+                if (!this.controller.alive && !this.dual.controller.alive) {
+                    this.controller.requestSpawn();
+                } else {
+                    if (!this.controller.alive) {
+                        this.controller.requestSpawn();
+                    } else if (!this.dual.controller.alive) {
+                        this.dual.controller.requestSpawn();
+                    } else {
+                        this.dualActive = !this.dualActive; // toggle            
+                    }
+                }
+            }
+        } else { // We are DEAD
+            if (spectate && spectate <= 250) {
+                const c = this.game.controls[spectate];
+                if (!c.handle) return; // ??
+                if (!c.handle.alive) return; // Can't spectate dead handle??
+                this.spectate = c.handle.owner || c.handle;
+            } else if (spectate === 255) {
+                let score = 0;
+                for (const c of this.game.controls) {
+                    if (!(c.handle instanceof OgarXProtocol)) continue;
+                    if (c.handle.score > score) {
+                        score = c.score;
+                        this.spectate = c.handle;
+                    }
+                }
+            }
+        }
+    }
+
     onError(message) {
         if (this.ws) this.ws.end(1000, message);
     }
@@ -288,32 +527,28 @@ module.exports = class OgarXProtocol extends Protocol {
 
     /** @param {import("../../game/handle")[]} handles */
     onLeaderboard(handles) {
-        const LB_COUNT = 10;
-        const count = Math.min(LB_COUNT, handles.length);
-        const writer = new Writer();
-        writer.writeUInt8(5);
-        writer.writeInt16(handles.indexOf(this));
-        writer.writeUInt8(count);
-        for (let i = 0; i < count; i++)
-            writer.writeUInt8(handles[i].controller.id);
-        this.send(writer.finalize());
+        const rank = handles.indexOf(this);
+        if (rank !== this.lastRank) {
+            this.lastRank = rank;
+            const writer = new Writer();
+            writer.writeUInt8(8);
+            writer.writeInt16(rank);
+            this.send(writer.finalize());
+        }
+        this.send(Broadcast.leaderboard.get(handles));
     }
 
     /** @param {import("../../game/handle")[]} handles */
     onMinimap(handles) {
-        const writer = new Writer();
-        writer.writeUInt8(6);
-        writer.writeUInt8(handles.length);
-        for (const h of handles) {
-            writer.writeUInt8(h.controller.id);
-            writer.writeFloat32(h.controller.viewportX);
-            writer.writeFloat32(h.controller.viewportY);
-            writer.writeFloat32(h.score);
-        }
-        this.send(writer.finalize());
+        this.send(Broadcast.minimap.get(handles));
     }
 
     onTick() {
+        // Batch every write of this tick into one syscall
+        this.ws ? this.ws.cork(this.tick) : this.tick();
+    }
+
+    tick() {
         if (!this.controller) return; // ??????
         if (!this.wasAlive && this.alive) this.actualSpawnTick = this.game.engine.__now;
 
@@ -337,92 +572,78 @@ module.exports = class OgarXProtocol extends Protocol {
         }
         this.wasAlive = this.alive;
 
-        let target = this.active;
+        // A packet didn't make it out (host ring full), the client's cells no longer match the next diff
+        if (this.ws && this.ws.desync) {
+            if (this.ws.getBufferedAmount() > this.game.options.SOCKET_WATERMARK) return;
+            this.ws.desync = false;
+            this.group ? this.leaveGroup() : this.clear();
+        }
+
         if (this.alive) this.spectate = null;
+        // Over budget, clients not playing get every other tick (the next diff covers both, groups skip together)
+        if (!this.alive && engine.shed >= 2 && engine.ticks & 1) return;
         if (this.spectate) {
-            // Some other handler will take care of this
-            if (this.spectate instanceof OgarXProtocol) return;
-            else target = this.spectate.controller;
+            const s = this.spectate;
+            return this.spectateTick(s instanceof OgarXProtocol ? s.active : s.controller);
         }
 
-        const vlist = engine.query(target);
-        // Query visible cells from the controller
-        this.processVisibleList(vlist, target);
-        
-        for (const c of this.game.controls) {
-            if (!c.handle) continue;
-            if (c.handle.alive) {
-                c.handle.spectate = null;
-                continue;
-            }
-            if (c.handle.spectate === this) 
-                c.handle.processVisibleList(vlist, target);
+        // Client holds the group's view, resync before going back to our own stream
+        this.leaveGroup();
+
+        const target = this.active;
+        // Encoded on the worker pool and sent once every client of this tick is done
+        if (engine.encoder) {
+            if (this.ws && this.ws.getBufferedAmount() <= this.game.options.SOCKET_WATERMARK)
+                engine.encoder.push(this, target);
+            return;
         }
+        // Query visible cells from the controller
+        this.processVisibleList(engine.query(target), target);
+    }
+
+    /** @param {import("../../game/controller")} target */
+    spectateTick(target) {
+        // A member that misses a shared packet is out of sync, rejoin once the socket drains
+        if (!this.ws || this.ws.getBufferedAmount() > this.game.options.SOCKET_WATERMARK)
+            return this.leaveGroup();
+
+        const group = SpectatorGroup.get(this.game, target, this.packed);
+        const packet = group.update();
+
+        if (this.group === group) return packet && this.send(packet);
+
+        // Late joiner, one off packet from our own state to the group's current view
+        this.leaveGroup();
+        this.processVisibleList(this.game.engine.query(target), target);
+        group.members.add(this);
+        this.group = group;
+    }
+
+    leaveGroup() {
+        if (!this.group) return;
+        this.group.remove(this);
+        this.group = null;
+        this.clear();
     }
 
-    /** @param {Uint16Array} vlist */
+    /** @param {Uint16Array|Uint32Array} vlist */
     processVisibleList(vlist, controller = this.controller) {
         if (!vlist.length) return;
         // Backpressure higher than watermark
         if (!this.ws || this.ws.getBufferedAmount() > this.game.options.SOCKET_WATERMARK) return;
 
-        // Step 1
-        this.wasm.exports.move_hashtable();
-        // Step 2
-        this.wasm.exports.copy(this.last_vlist_ptr, this.curr_vlist_ptr, this.curr_vlist_len * 2);
-        // Update ptr and len
-        this.last_vlist_len = this.curr_vlist_len;
-        this.curr_vlist_ptr = this.last_vlist_ptr + this.last_vlist_len * 2; // 2 bytes per index
-        this.curr_vlist_len = vlist.length;
-        new Uint16Array(this.memory.buffer, this.curr_vlist_ptr, this.curr_vlist_len).set(vlist);
-        
-        const AUED_table_ptr = this.curr_vlist_ptr + this.curr_vlist_len * 2;
-        
-        // Step 3
-        const AUED_end_ptr = this.wasm.exports.write_AUED(
-            0, 65536,
-            this.last_vlist_ptr, this.last_vlist_len,
-            this.curr_vlist_ptr, this.curr_vlist_len,
-            AUED_table_ptr, AUED_table_ptr + 16 // 4 * 4 bytes after the table
-        );
-
-        const A_count = this.view.getUint32(AUED_table_ptr + 0,  true);
-        const U_count = this.view.getUint32(AUED_table_ptr + 4,  true);
-        const E_count = this.view.getUint32(AUED_table_ptr + 8,  true);
-        const D_count = this.view.getUint32(AUED_table_ptr + 12, true);
-
-        // 1 byte OP + 1 byte pid + 2 bytes cell count + 1 byte linelocked + 
-        // 4 bytes score + 8 bytes mouse + 8 bytes viewport + 4 * 2 bytes 0 padding = 33 bytes
-        // We don't have to calculate this because serialize returns the write end
-        // But this is a good way to verify it wrote as expect
-        const buffer_length = 33 + 10 * A_count + 8 * U_count + 4 * E_count + 2 * D_count;
-        
-        const mem_check = AUED_end_ptr + buffer_length - this.memory.buffer.byteLength;
-        if (mem_check > 0) {
-            const extra_page = Math.ceil(mem_check / 65536);
-            this.memory.grow(extra_page);
-            this.view = new DataView(this.memory.buffer);
-            console.log(`Growing ${extra_page} page of memory in ogar69 protocol ` +
-                `memory for controller(${this.controller.name})`);
-        }
-
-        const o = this.game.options;
-
-        // Step 4 serialize
-        const buffer_end = this.wasm.exports.serialize(
-            controller.id,
-            this.game.engine.counters[controller.id].size,
-            controller.lockDir,
-            controller.handle.score,
-            controller.mouseX, controller.mouseY,
-            controller.viewportX, controller.viewportY,
-            AUED_table_ptr, AUED_table_ptr + 16, AUED_end_ptr,
-            -o.MAP_HW, o.MAP_HW, o.MAP_HH, -o.MAP_HH);
-        
-        const diff = buffer_end - AUED_end_ptr;
-        console.assert(diff == buffer_length, "Buffer length must match");
+        this.send(encodeVisibleList(this, vlist, controller));
+    }
 
-        this.send(this.memory.buffer.slice(AUED_end_ptr, buffer_end));
+    /** 
+     * Tell the client to reconnect (with its uid) to another region of the map
+     * @param {string} endpoint port/path
+     */
+    sendRedirect(endpoint) {
+        const writer = new Writer();
+        writer.writeUInt8(12);
+        writer.writeUTF8String(endpoint);
+        this.send(writer.finalize());
     }
 
     sendStats() {
@@ -455,32 +676,26 @@ module.exports = class OgarXProtocol extends Protocol {
     /** @param {import("../../game/controller")} controller */
     sendPlayerInfo(controller) {
         if (!controller.name && !controller.skin) return;
-        const writer = new Writer();
-        writer.writeUInt8(3);
-        writer.writeUInt16(controller.id);
-        writer.writeUTF16String(controller.name);
-        writer.writeUTF16String(controller.skin);
-        this.send(writer.finalize());
+        this.send(Broadcast.playerInfo(controller));
     }
 
     /** @param {string} message */
     onLog(message, bypass = false) {
         if (!bypass && this.game.engine.options.IGNORE_LOG) return;
-        const writer = new Writer();
-        writer.writeUInt8(11);
-        writer.writeUTF16String(message);
-        this.send(writer.finalize());
+        this.send(Broadcast.log.get(message));
     }
 
     /** @param {string} message */
     onChat(message) {
-        const writer = new Writer();
-        writer.writeUInt8(10);
-        writer.writeUTF16String(message);
-        this.send(writer.finalize());
+        this.send(Broadcast.chat.get(message));
     }
 
     send(buffer) {
-        if (this.ws) this.ws.send(buffer, true, true);
+        if (!this.ws) return;
+        this.game.bytesSent += buffer.byteLength;
+        // Packed clients skip deflate, the rest of their packets are small
+        this.ws.send(buffer, true, !this.packed);
     }
-}
\ No newline at end of file
+}
+
+module.exports = OgarXProtocol;
\ No newline at end of file
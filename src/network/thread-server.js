@@ -0,0 +1,85 @@
+const { parentPort } = require("worker_threads");
+
+const FakeSocket = require("./fake-socket");
+const GameServer = require("./game-server");
+const WorldIO = require("./world-io");
+
+/**
+ * World running in a worker thread of a host (src/host.js). The host owns the uWS listener
+ * and hands every connection to its world over as a MessagePort
+ */
+module.exports = class ThreadServer extends GameServer {
+
+    /**
+     * @param {string} name
+     * @param {ReturnType<typeof WorldIO.create>} io buffers shared with the host, mouse input
+     * and outgoing packets skip the ports
+     */
+    constructor(name, io = null) {
+        super(name);
+        this.io = io ? new WorldIO(io) : null;
+        /** @type {Set<FakeSocket>} connections with an input slot */
+        this.sockets = new Set();
+
+        // Before any handle ticks, so the input is there when the engine handles it
+        this.takeInputs = this.takeInputs.bind(this);
+        if (this.io) this.game.prependListener("tick", this.takeInputs);
+
+        /** Last full state sent to the host, it answers upgrades with 503 while full */
+        this.full = false;
+        this.reportFull = this.reportFull.bind(this);
+        this.game.on("tick", this.reportFull);
+    }
+
+    /** @param {string} endpoint reported to the gateway */
+    open(endpoint = "") {
+        if (this.listening) return false;
+        this.listening = true;
+
+        this.ipcConnect();
+        this.ipcInterval = setInterval(() => this.report(endpoint), 1000);
+
+        this.onConnect = data => data.event === "connect" && 
+            this.accept(data.port, data.ip, data.uid, data.slot, data.id);
+        parentPort.on("message", this.onConnect);
+        return true;
+    }
+
+    /**
+     * @param {MessagePort} port
+     * @param {string} ip
+     * @param {string} uid
+     * @param {number} slot input slot, -1 without one
+     * @param {number} id tag of the connection in the output ring
+     */
+    accept(port, ip, uid, slot = -1, id = 0) {
+        const ws = new FakeSocket(port, ip, this.io, slot, id);
+        ws.uid = uid;
+        ws.p = this.reconnect(uid);
+        ws.onmessage = message => this.onSocketMessage(ws, message);
+        ws.onclose = () => {
+            this.onSocketClose(ws);
+            // Host hands the slot out again once we stopped reading it. Sent on the connection's port,
+            // after the close, so the host can't reuse the slot while the old socket is still open there
+            if (this.sockets.delete(ws)) port.postMessage({ event: "free", slot: ws.slot });
+        };
+        if (ws.io) this.sockets.add(ws);
+    }
+
+    reportFull() {
+        const full = !this.game.canAccept();
+        if (full === this.full) return;
+        this.full = full;
+        parentPort.postMessage({ event: "full", full });
+    }
+
+    takeInputs() {
+        for (const ws of this.sockets) if (ws.p && ws.p.ws === ws) this.io.take(ws, ws.p);
+    }
+
+    close() {
+        this.listening = false;
+        this.onConnect && parentPort.off("message", this.onConnect);
+        super.close();
+    }
+}
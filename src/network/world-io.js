@@ -0,0 +1,199 @@
+// Ring control words (Int32Array over a SharedArrayBuffer), positions only grow and wrap at 2^32
+const HEAD = 0; // read position, only the consumer stores it
+const TAIL = 1; // write position, only the producer stores it
+const DROPPED = 2;
+// Record tag that sends the reader back to the start of the ring
+const WRAP = -1;
+
+/**
+ * Single producer single consumer ring of tagged records (tag, length, bytes padded to 4),
+ * a record is written in one piece, the tail of the buffer is skipped when it doesn't fit
+ */
+class Ring {
+
+    /**
+     * @param {SharedArrayBuffer} control
+     * @param {SharedArrayBuffer} buffer power of 2 bytes
+     */
+    constructor(control, buffer) {
+        this.ctrl = new Int32Array(control);
+        this.bytes = new Uint8Array(buffer);
+        this.view = new DataView(buffer);
+        this.size = buffer.byteLength;
+        this.mask = this.size - 1;
+    }
+
+    /** Bytes written and not read yet */
+    get used() {
+        return (Atomics.load(this.ctrl, TAIL) - Atomics.load(this.ctrl, HEAD)) >>> 0;
+    }
+
+    get dropped() { return Atomics.load(this.ctrl, DROPPED); }
+
+    /**
+     * Producer side, false (and the record is dropped) when the consumer is too far behind
+     * @param {number} tag
+     * @param {Uint8Array} data
+     */
+    write(tag, data) {
+        const len = data.byteLength;
+        const need = 8 + ((len + 3) & ~3);
+        let tail = this.ctrl[TAIL];
+        const free = this.size - ((tail - Atomics.load(this.ctrl, HEAD)) >>> 0);
+
+        let offset = tail & this.mask;
+        const rest = this.size - offset;
+        if (need > rest) {
+            if (free < rest + need) return Atomics.add(this.ctrl, DROPPED, 1), false;
+            this.view.setInt32(offset, WRAP, true);
+            tail = (tail + rest) | 0;
+            offset = 0;
+        } else if (free < need) return Atomics.add(this.ctrl, DROPPED, 1), false;
+
+        this.view.setInt32(offset, tag, true);
+        this.view.setUint32(offset + 4, len, true);
+        this.bytes.set(data, offset + 8);
+
+        Atomics.store(this.ctrl, TAIL, (tail + need) | 0);
+        Atomics.notify(this.ctrl, TAIL);
+        return true;
+    }
+
+    /**
+     * Consumer side, the record view is only valid inside the callback
+     * @param {(tag: number, data: Uint8Array) => void} cb
+     * @returns {number} tail the ring was read up to
+     */
+    read(cb) {
+        const tail = Atomics.load(this.ctrl, TAIL);
+        let head = this.ctrl[HEAD];
+
+        while (head !== tail) {
+            const offset = head & this.mask;
+            const tag = this.view.getInt32(offset, true);
+            if (tag === WRAP) {
+                head = (head + this.size - offset) | 0;
+                continue;
+            }
+            const len = this.view.getUint32(offset + 4, true);
+            cb(tag, this.bytes.subarray(offset + 8, offset + 8 + len));
+            head = (head + 8 + ((len + 3) & ~3)) | 0;
+        }
+
+        Atomics.store(this.ctrl, HEAD, head);
+        return tail;
+    }
+
+    /**
+     * Read whenever the producer writes, until stop is called
+     * @param {(tag: number, data: Uint8Array) => void} cb
+     */
+    pump(cb) {
+        let stopped = false;
+        const loop = () => {
+            if (stopped) return;
+            const tail = this.read(cb);
+            const wait = Atomics.waitAsync(this.ctrl, TAIL, tail);
+            wait.async ? wait.value.then(loop) : setImmediate(loop);
+        };
+        loop();
+        return () => stopped = true;
+    }
+}
+
+// Input slot words, written by the host as the packets come in and taken by the world once per tick
+const I_SEQ = 0;
+const I_MOUSE_X = 1;
+const I_MOUSE_Y = 2;
+const I_SPECTATE = 3;
+const I_MACRO = 4;
+const I_SPLITS = 5;  // counters from here on, reset when taken
+const I_EJECTS = 6;
+const I_LOCKS = 7;
+const I_SWITCHES = 8;
+const INPUT_STRIDE = 9;
+
+/**
+ * Shared state between the host thread (uWS and input parsing) and one world thread: an input slot per
+ * connection with the latest mouse and the split/eject counters, the uWS backpressure per connection,
+ * and a ring carrying every outgoing packet of the world to the host. Neither thread waits on the other
+ */
+class WorldIO {
+
+    /**
+     * @param {number} slots connections with an input slot, the rest go through their port only
+     * @param {number} ringBytes output ring size, power of 2
+     */
+    static create(slots, ringBytes) {
+        return {
+            slots,
+            input: new SharedArrayBuffer(slots * INPUT_STRIDE * 4),
+            buffered: new SharedArrayBuffer(slots * 4),
+            control: new SharedArrayBuffer(4 * 4),
+            ring: new SharedArrayBuffer(ringBytes)
+        };
+    }
+
+    /** @param {ReturnType<typeof WorldIO.create>} buffers */
+    constructor(buffers) {
+        this.buffers = buffers;
+        this.slots = buffers.slots;
+        this.input = new Int32Array(buffers.input);
+        this.buffered = new Int32Array(buffers.buffered);
+        this.output = new Ring(buffers.control, buffers.ring);
+    }
+
+    /**
+     * Host side, keep a mouse packet (OP 3) of the connection in its slot
+     * @param {number} slot
+     * @param {DataView} view
+     */
+    put(slot, view) {
+        const i = slot * INPUT_STRIDE;
+        const input = this.input;
+        Atomics.store(input, i + I_MOUSE_X, ~~view.getFloat32(1, true));
+        Atomics.store(input, i + I_MOUSE_Y, ~~view.getFloat32(5, true));
+        Atomics.store(input, i + I_SPECTATE, view.getUint8(9));
+        Atomics.add(input, i + I_SPLITS, view.getUint8(10));
+        Atomics.add(input, i + I_EJECTS, view.getUint8(11));
+        Atomics.store(input, i + I_MACRO, view.getUint8(12));
+        Atomics.add(input, i + I_LOCKS, view.getUint8(13) ? 1 : 0);
+        Atomics.add(input, i + I_SWITCHES, view.getUint8(14) ? 1 : 0);
+        Atomics.add(input, i + I_SEQ, 1);
+    }
+
+    /**
+     * Host side, a fresh connection takes over the slot
+     * @param {number} slot
+     */
+    reset(slot) {
+        this.input.fill(0, slot * INPUT_STRIDE, (slot + 1) * INPUT_STRIDE);
+        Atomics.store(this.buffered, slot, 0);
+    }
+
+    /**
+     * World side, hand the input that came in since the last call to the protocol
+     * @param {import("./fake-socket")} ws
+     * @param {import("./protocols/ogarx")} p
+     */
+    take(ws, p) {
+        const i = ws.slot * INPUT_STRIDE;
+        const input = this.input;
+        const seq = Atomics.load(input, i + I_SEQ);
+        if (seq === ws.seq) return;
+        ws.seq = seq;
+
+        p.onInput(
+            Atomics.load(input, i + I_MOUSE_X),
+            Atomics.load(input, i + I_MOUSE_Y),
+            Atomics.load(input, i + I_SPECTATE),
+            Atomics.exchange(input, i + I_SPLITS, 0),
+            Atomics.exchange(input, i + I_EJECTS, 0),
+            Atomics.load(input, i + I_MACRO),
+            Atomics.exchange(input, i + I_LOCKS, 0) & 1,
+            Atomics.exchange(input, i + I_SWITCHES, 0) & 1);
+    }
+}
+
+module.exports = WorldIO;
+module.exports.Ring = Ring;
@@ -1,45 +1,12 @@
-const net = require("net");
-const path = require("path");
 const uWS = require("uWebSockets.js");
-const crypto = require("crypto");
 
-const pipename = str => process.platform == "win32" ? `\\\\.\\pipe\\${str.replace(/^\//, "").replace(/\//g, "-")}` : str;
-const SOCKET_FILE = path.resolve(__dirname, "..", "unix.sock");
-
-const Protocols = require("./protocols");
-const Game = require("../game");
+const GameServer = require("./game-server");
 
 const CONN_THROTTLE = 5;
+// Subprotocol of clients taking packed cells (OP 13), asked for at upgrade since deflate is negotiated there
+const PACKED_PROTOCOL = "ogarx-packed";
 
-module.exports = class SocketServer {
-
-    constructor(name) {
-        this.uid = crypto.randomBytes(12).toString("hex");
-        this.modes = require("../modes");
-        this.game = new Game(name);
-    }
-
-    setGameMode(mode = "") {
-        if (this.modes.has(mode)) {
-            this.game.engine.setOptions(this.modes.get(mode));
-            console.log(`Gamemode is set to "${mode}"`);
-        } else {
-            console.error(`Gamemode "${mode}" doesn't exist`);
-        }
-    }
-
-    ipcConnect() {
-        if (this.ipcClient) return;
-        this.ipcClient = net.connect(pipename(SOCKET_FILE))
-            .on("error", this.ipcReconnect.bind(this))
-            .on("close", this.ipcReconnect.bind(this));
-    }
-
-    ipcReconnect() {
-        delete this.ipcClient;
-        console.log("Reconnecting to Gateway");
-        setTimeout(() => this.ipcConnect(), 5000);
-    }
+module.exports = class SocketServer extends GameServer {
 
     /**
      * @param {Object} arg0
@@ -55,31 +22,7 @@ module.exports = class SocketServer {
 
         this.ipcConnect();
 
-        /** @type {import("./protocol")[]} */
-        let disconnectedPool = [];
-
-        const g = this.game;
-        this.ipcInterval = setInterval(() => {
-            try {
-                this.ipcClient.write(JSON.stringify({
-                    pid: process.pid,
-                    uid: this.uid,
-                    name: g.name,
-                    endpoint: `${port}/${endpoint}`,
-                    bot: g.engine.bots.length,
-                    real: g.playerCount,
-                    players: g.handles,
-                    total: 250 // Number in theory
-                }));
-
-                disconnectedPool = disconnectedPool.filter(p => {
-                    if (g.engine.__now > p.disconnectTime + g.options.SOCKET_RECONNECT) {
-                        p.off();
-                        return false;
-                    } else return true;
-                });
-            } catch (_) {}
-        }, 1000);
+        this.ipcInterval = setInterval(() => this.report(`${port}/${endpoint}`), 1000);
 
         let conn = 0;
         /** @type {[uWS.HttpResponse, Object, string, string, string, uWS.us_socket_context_t][]} */
@@ -101,17 +44,17 @@ module.exports = class SocketServer {
                 maxPayloadLength: 512,
                 compression: uWS.DEDICATED_COMPRESSOR_4KB,
                 upgrade: (res, req, context) => {
-                    if (this.game.isFull) return res.writeStatus("503").end();
+                    if (!this.game.canAccept()) return res.writeStatus("503").end();
 
                     const url = req.getUrl();
                     const key = req.getHeader("sec-websocket-key");
                     const pro = req.getHeader("sec-websocket-protocol");
-                    const ext = req.getHeader("sec-websocket-extensions");
+                    // Packed cells clients (OP 13) get no deflate and so no per socket compressor
+                    const ext = pro === PACKED_PROTOCOL ? "" : req.getHeader("sec-websocket-extensions");
                     const uid = req.getQuery();
 
-                    const index = uid && disconnectedPool.findIndex(p => p.uid == uid);
-                    const p = index >= 0 ? disconnectedPool.splice(index, 1)[0] : null;
-                    const userData = { url, p, ip: new Uint8Array(res.getRemoteAddress()).join(".") };
+                    const p = this.reconnect(uid);
+                    const userData = { url, p, uid, ip: new Uint8Array(res.getRemoteAddress()).join(".") };
 
                     if (conn < CONN_THROTTLE) {
                         res.upgrade(userData, key, pro, ext, context);
@@ -126,39 +69,18 @@ module.exports = class SocketServer {
                 },
                 message: (ws, message, isBinary) => {
                     if (!isBinary) ws.end(1003);
-                    if (!ws.p) {
-                        const Protocol = Protocols.find(p => p.handshake(new DataView(message)));
-                        if (!Protocol) ws.end(1003, "Ambiguous protocol");
-                        else ws.p = new Protocol(this.game, ws, message);
-                    } else {
-                        try {
-                            if (!ws.p.ws) {
-                                ws.p.ws = ws;
-                                ws.p.init && ws.p.init(message, true);
-                            } else {
-                                ws.p.onMessage(new DataView(message));
-                            }
-                        } catch (e) {}
-                    }
+                    this.onSocketMessage(ws, message);
                 },
                 drain: ws => ws.p && ws.p.onDrain(),
-                close: (ws, code, message) => {
-                    if (!ws.p) return;
-                    // console.log(`Disconnect code: ${code}, message: ${message}`);
-                    ws.p.disconnectTime = g.engine.__now;
-                    disconnectedPool.push(ws.p);
-                    try {
-                        this.game.emit("log", `${ws.p.controller.name} disconnected`);
-                    } catch (e) {}
-                    delete ws.p.ws;
-                }
+                close: ws => this.onSocketClose(ws)
             })
             .get("/restart/:token", (res, req) => {
                 const authorization = req.getParameter(0);
                 if (token) {
                     if (token == authorization) {
                         res.end("Restarting");
-                        setTimeout(() => process.exit(0), 1000);
+                        // Through the SIGINT handler so the world is snapshotted
+                        setTimeout(() => process.kill(process.pid, "SIGINT"), 1000);
                     } else {
                         res.writeStatus("401 Unauthorized");
                         res.end();
@@ -189,9 +111,7 @@ module.exports = class SocketServer {
     close() {
         this.sock && uWS.us_listen_socket_close(this.sock);
         this.sock = null;
-        clearInterval(this.ipcInterval);
         clearInterval(this.upgradeInterval);
-        try { this.ipcClient.destroy(); } catch (e) {}
-        console.log(`Server closed`);
+        super.close();
     }
 }
\ No newline at end of file
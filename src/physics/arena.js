@@ -0,0 +1,89 @@
+const PAGE = 65536;
+
+/** @param {number} ptr @param {number} align power of 2 */
+const alignUp = (ptr, align) => (ptr + align - 1) & ~(align - 1);
+
+/**
+ * Layout of a wasm memory. Regions reserved for good (cells, lists, worker stacks) stack up from 0,
+ * per tick regions (serialized tree, traversal stack, scratch) are laid out again after them every
+ * time the tree is serialized. The memory grows before a region would overrun it, views handed out
+ * here are only rebuilt when it did
+ */
+class Arena {
+
+    /**
+     * @param {WebAssembly.Memory} memory
+     * @param {number} maxPages the memory can't grow past it
+     */
+    constructor(memory, maxPages) {
+        this.memory = memory;
+        this.maxPages = maxPages;
+        /** End of the reserved regions, per tick regions start here */
+        this.base = 0;
+        /** End of the last region */
+        this.top = 0;
+        /** Highest top so far */
+        this.peak = 0;
+        /** @type {(() => void)[]} */
+        this.growListeners = [];
+        this.__view = new DataView(memory.buffer);
+    }
+
+    get capacity() { return this.memory.buffer.byteLength; }
+
+    /** Whole memory, rebuilt when it grew (also when another thread grew a shared memory) */
+    get view() {
+        if (this.__view.byteLength !== this.memory.buffer.byteLength) this.__view = new DataView(this.memory.buffer);
+        return this.__view;
+    }
+
+    /** @param {() => void} cb called after the memory grew, views into it have to be rebuilt */
+    onGrow(cb) {
+        this.growListeners.push(cb);
+    }
+
+    /**
+     * Region kept for the lifetime of the memory, after every region in use
+     * @param {number} bytes
+     * @param {number} align
+     */
+    reserve(bytes, align = 8) {
+        const ptr = alignUp(Math.max(this.base, this.top), align);
+        this.fit(ptr + bytes);
+        this.base = this.top = ptr + bytes;
+        return ptr;
+    }
+
+    /** Drop the per tick regions */
+    reset() {
+        this.top = this.base;
+    }
+
+    /**
+     * Per tick region after the last one, valid until the next reset
+     * @param {number} bytes
+     * @param {number} align
+     */
+    take(bytes, align = 8) {
+        const ptr = alignUp(this.top, align);
+        this.fit(ptr + bytes);
+        this.top = ptr + bytes;
+        return ptr;
+    }
+
+    /** @param {number} end */
+    fit(end) {
+        if (end > this.peak) this.peak = end;
+        if (end <= this.memory.buffer.byteLength) return;
+
+        const pages = Math.ceil(end / PAGE);
+        if (pages > this.maxPages)
+            throw new RangeError(`Memory arena overflow: ${end} bytes needed, ${this.maxPages * PAGE} at most`);
+
+        this.memory.grow(pages - this.memory.buffer.byteLength / PAGE);
+        this.__view = new DataView(this.memory.buffer);
+        for (const cb of this.growListeners) cb();
+    }
+}
+
+module.exports = Arena;
@@ -7,99 +7,108 @@ const CELL_REMOVE = 0x20;
 const CELL_MERGE  = 0x40;
 const CELL_POP    = 0x80;
 
+// Fields of the Cell struct (see core.c), floats are indexed in 4 byte words, type and flags in bytes
+const X = 0;
+const Y = 1;
+const R = 2;
+const AGE = 4;
+const BOOST_X = 5;
+const BOOST_Y = 6;
+const BOOST = 7;
+const TYPE = 12;
+const FLAGS = 13;
+
 const TYPES_TO_STRING = { 252: "Mother Cell", 253: "Virus", 254: "Pellet", 255: "Ejected" };
 
-module.exports = class Cell {
+/**
+ * Every cell of the engine memory as flat typed arrays indexed by cell id, f32[id * F + X] is the x of
+ * a cell and u8[id * B + TYPE] its type. Nothing is allocated per cell, rebinding after the memory
+ * grew is a few array views
+ */
+class Cells {
+
     /**
-     * @param {DataView} view 
-     * @param {number} id
+     * @param {number} limit
+     * @param {number} bytesPerCell 32, 36 with 32 bit ids
+     * @param {number} eatenByOffset 14, 32 with 32 bit ids
+     * @param {number} idBytes
      */
-    constructor(view, id) {
-        /** @type {import("./quadtree").Node} */
-        this.__root = null;
-        this.view = view;
-        this.id = id;
-    }
-
-    get x() {
-        return this.view.getFloat32(0, true);
-    }
-
-    set x(value) {
-        this.view.setFloat32(0, value, true);
-    }
-
-    get y() {
-        return this.view.getFloat32(4, true);
-    }
-
-    set y(value) {
-        this.view.setFloat32(4, value, true);
-    }
-
-    get r() {
-        return this.view.getFloat32(8, true);
-    }
-
-    set r(value) {
-        this.view.setFloat32(8, value, true);
-    }
-
-    get type() {
-        return this.view.getUint8(12);
-    }
-
-    set type(value) {
-        this.view.setUint8(12, value);
-    }
-
-    get flags() {
-        return this.view.getUint8(13);
-    }
-
-    remove() {
-        this.view.setUint8(13, CELL_EXISTS | CELL_REMOVE);
-    }
-
-    get exists() {
-        return this.view.getUint8(13) & CELL_EXISTS;
-    }
-
-    get existsStrict() {
-        const flags = this.flags;
+    constructor(limit, bytesPerCell, eatenByOffset, idBytes) {
+        this.limit = limit;
+        /** Bytes per cell */
+        this.B = bytesPerCell;
+        /** Floats per cell */
+        this.F = bytesPerCell >> 2;
+        this.idBytes = idBytes;
+        this.eatenByOffset = eatenByOffset;
+        /** @type {Float32Array} */
+        this.f32 = null;
+        /** @type {Uint8Array} */
+        this.u8 = null;
+        /** @type {Uint16Array|Uint32Array} */
+        this.ids = null;
+    }
+
+    /** @param {ArrayBuffer|SharedArrayBuffer} buffer cells start at 0 */
+    bind(buffer) {
+        const bytes = this.limit * this.B;
+        this.f32 = new Float32Array(buffer, 0, bytes >> 2);
+        this.u8 = new Uint8Array(buffer, 0, bytes);
+        this.ids = this.idBytes === 4 ? new Uint32Array(buffer, 0, bytes >> 2) : new Uint16Array(buffer, 0, bytes >> 1);
+    }
+
+    /** @param {number} id */
+    x(id) { return this.f32[id * this.F + X]; }
+    /** @param {number} id */
+    y(id) { return this.f32[id * this.F + Y]; }
+    /** @param {number} id */
+    r(id) { return this.f32[id * this.F + R]; }
+    /** @param {number} id */
+    type(id) { return this.u8[id * this.B + TYPE]; }
+    /** @param {number} id */
+    flags(id) { return this.u8[id * this.B + FLAGS]; }
+    /** @param {number} id */
+    eatenBy(id) { return this.ids[(id * this.B + this.eatenByOffset) / this.idBytes]; }
+
+    /** @param {number} id */
+    exists(id) { return this.u8[id * this.B + FLAGS] & CELL_EXISTS; }
+
+    /** @param {number} id */
+    existsStrict(id) {
+        const flags = this.u8[id * this.B + FLAGS];
         return (flags & CELL_EXISTS) && !(flags & CELL_REMOVE);
     }
 
-    get isUpdated() {
-        return this.view.getUint8(13) & CELL_UPDATE;
-    }
+    /** @param {number} id */
+    isUpdated(id) { return this.u8[id * this.B + FLAGS] & CELL_UPDATE; }
 
-    set updated(value) {
-        value && this.view.setUint8(13, this.view.getUint8(13) | CELL_UPDATE);
-    }
+    /** @param {number} id */
+    shouldAuto(id) { return this.u8[id * this.B + FLAGS] & CELL_AUTO; }
 
-    get shouldAuto() {
-        return this.view.getUint8(13) & CELL_AUTO;
-    }
+    /** @param {number} id */
+    markUpdated(id) { this.u8[id * this.B + FLAGS] |= CELL_UPDATE; }
 
-    get eatenBy() {
-        return this.view.getUint16(14, true);
-    }
+    /** @param {number} id */
+    remove(id) { this.u8[id * this.B + FLAGS] = CELL_EXISTS | CELL_REMOVE; }
 
-    get age() {
-        return this.view.getFloat32(16, true);
-    }
+    // Read only copy of a cell owned by another region: in the tree (visible, blocks spawns)
+    // but in no type list, and the inside bit makes resolve skip it
+    /** @param {number} id */
+    ghost(id) { this.u8[id * this.B + FLAGS] = CELL_EXISTS | CELL_UPDATE | CELL_INSIDE; }
 
-    /** DEBUG STUFF */
-    get positionString() { return `Cell#${this.id}[x: ${this.x}, y: ${this.y}]` }
-    get flagsString() { 
-        const s = TYPES_TO_STRING[this.type];
-        return `Cell#${this.id}[type=${s ? `${s}(${this.type})` : `Player#${this.type}`},flags=${this.flags.toString(2).padStart(8, "0")}]`;
-    }
+    /** @param {number} id */
+    clear(id) { this.u8.fill(0, id * this.B, (id + 1) * this.B); }
 
-    toString() {
-        // if (!this.exists) return `Cell[None]`;
-        const s = TYPES_TO_STRING[this.type];
-        return `Cell#${this.id}[type=${s ? `${s}(${this.type})` : `Player#${this.type}`},x=${this.x.toFixed(2)},y=${this.y.toFixed(2)},r=${this.r.toFixed(2)},mass=${(this.r * this.r / 100000).toFixed(1)}k,flags=${this.flags.toString(2).padStart(8, "0")}]`;
-    }
-}
\ No newline at end of file
+    /** DEBUG STUFF */
+    /** @param {number} id */
+    toString(id) {
+        const type = this.type(id);
+        const s = TYPES_TO_STRING[type];
+        const r = this.r(id);
+        return `Cell#${id}[type=${s ? `${s}(${type})` : `Player#${type}`},x=${this.x(id).toFixed(2)},y=${this.y(id).toFixed(2)},` +
+            `r=${r.toFixed(2)},mass=${(r * r / 100000).toFixed(1)}k,flags=${this.flags(id).toString(2).padStart(8, "0")}]`;
+    }
+}
+
+module.exports = Cells;
+module.exports.Fields = { X, Y, R, AGE, BOOST_X, BOOST_Y, BOOST, TYPE, FLAGS };
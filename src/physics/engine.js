@@ -19,12 +19,21 @@ const clamp = (v, min, max) => v <= min ? min : v >= max ? max : v;
  */
 const range = (min, max) => Math.random() * (max - min) + min;
 
-const Cell = require("./cell");
+const Cells = require("./cell");
+const { X, Y, R, AGE, TYPE } = Cells.Fields;
 const QuadTree = require("./quadtree");
+const Arena = require("./arena");
 const Controller = require("../game/controller");
 const Bot = require("../bot");
+const Writer = require("../network/writer");
+const Reader = require("../network/reader");
 
-const CELL_LIMIT = 1 << 16; // 65536
+// Everything the engine, the tree and the protocols call into server.wasm
+const CORE_EXPORTS = ["alloc_id", "bot_think", "build_spawn_grid", "bytes_per_cell", "cell_id_bytes", "cell_limit",
+    "cell_lists_size", "clear_type", "contact_cache_size", "drop_cell", "eaten_by_offset", "flatten_indices", "freeze",
+    "get_cell_eatenby", "get_cell_r", "get_cell_type", "get_cell_updated", "get_cell_x", "get_cell_y", "hold_id",
+    "kill_cell", "new_cell", "resolve", "sample_safe_point", "select", "set_id_grid", "spawn_batch", "spawn_grid_size",
+    "update", "update_player_cells"];
 
 const DefaultSettings = {
     TIME_SCALE: 1,
@@ -32,11 +41,18 @@ const DefaultSettings = {
     MINIMAP_TPS: 5,
     LEADERBOARD_TPS: 2,
     MAX_CELL_PER_TICK: 50,
+    TICK_MAX_DT: 2, // in ticks
+    LOAD_SHED_HIGH: 0.8, // usage that raises the shedding level
+    LOAD_SHED_LOW: 0.5, // usage that lowers it
+    LOAD_SHED_SLOWDOWN: 4, // leaderboard and minimap delay multiplier
+    LOAD_SHED_SPAWN: 10, // cells spawned per tick at the last level
     QUADTREE_MAX_ITEMS: 24,
     QUADTREE_MAX_LEVEL: 16,
+    CONTACT_CACHE_SKIN: 50, // 0 to resolve same player collisions with the quadtree
     MAP_HW: 20000, // MAX signed short = 32767
     MAP_HH: 20000,
     SAFE_SPAWN_TRIES: 128,
+    SPAWN_GRID_TILES: 256, // per axis, max 256
     PLAYER_SAFE_SPAWN_RADIUS: 1.5,
     VIRUS_SAFE_SPAWN_RADIUS: 3,
     PELLET_COUNT: 1000,
@@ -79,6 +95,9 @@ const DefaultSettings = {
     DECAY_MIN: 1000,
     BOTS: 1,
     BOT_SPAWN_SIZE: 1000,
+    BOT_VIEW_SCALE: 0.5, // bots only look at this much of their viewport
+    BOT_SPLIT_REACH: 500, // distance a bot expects a split cell to cover
+    BOT_SPLIT_COOLDOWN: 1000,
     EJECT_DISPERSION: 0.3,
     EJECT_SIZE: 38,
     EJECT_LOSS: 43,
@@ -100,12 +119,24 @@ const DefaultSettings = {
     IGNORE_LOG: false
 }
 
+// Recent tick times kept for percentiles (about 13s at 20 TPS)
+const TICK_WINDOW = 256;
+
 const DEAD_CELL_TYPE = 251;
 // const MOTHER_CELL_TYPE = 252;
 const VIRUS_TYPE = 253;
 const PELLET_TYPE = 254;
 const EJECTED_TYPE = 255;
 
+// Maximum of the shared memory builds (-s MAXIMUM_MEMORY=1gb), a shared memory can't grow past it
+const SHARED_MEMORY_PAGES = 16384;
+// 4gb, the most a 32 bit memory can address
+const MEMORY_PAGES = 65536;
+
+const SNAPSHOT_MAGIC = 0x5358474f; // "OGXS"
+const SNAPSHOT_VERSION = 2;
+const SNAPSHOT_HEADER = 64;
+
 /**
  * x (float) 4 bytes
  * y (float) 4 bytes
@@ -115,6 +146,7 @@ const EJECTED_TYPE = 255;
  * eatenBy 2 bytes
  * age 4 bytes
  * boost { 3 float } = 12 bytes
+ * With 32 bit ids (WIDE_IDS build) eatenBy moves to the end (4 bytes) and leaves 2 bytes of padding
  */
 
 module.exports = class Engine {
@@ -128,6 +160,27 @@ module.exports = class Engine {
 
         /** @type {Bot[]} */
         this.bots = [];
+
+        /** Smoothed tick cost over the tick budget */
+        this.usage = 0;
+        /** Load shedding level (0 to 3), see updateShed */
+        this.shed = 0;
+        this.ticks = 0;
+        /** Wall time of the last TICK_WINDOW ticks (ms), see tickPercentile */
+        this.tickTimes = new Float32Array(TICK_WINDOW);
+        this.loop = this.loop.bind(this);
+
+        /** 
+         * Set when this engine owns one region of a partitioned map
+         * @type {import("./region")} 
+         */
+        this.region = null;
+
+        /** 
+         * Set when clients are encoded on worker threads
+         * @type {import("../network/encode-pool")} 
+         */
+        this.encoder = null;
     }
     
     /** @param {typeof DefaultSettings} options */
@@ -135,19 +188,29 @@ module.exports = class Engine {
         Object.assign(this.options, options);
     }
 
-    /** @param {ArrayBuffer|Buffer} wasm_buffer */
-    async init(wasm_buffer) {
+    /** 
+     * @param {ArrayBuffer|Buffer|WebAssembly.Module} wasm_buffer compiled module when shared between worlds 
+     * @param {boolean} shared shared memory build, read by encode workers
+     */
+    async init(wasm_buffer, shared = false) {
         if (this.wasm) return;
 
         this.__start = performance.now();
         this.__ltick = performance.now();
 
-        // 12.8mb ram (more than enough)
-        this.memory = new WebAssembly.Memory({ initial: 200 });
+        // Grown by the arena once the layout is known
+        this.memory = shared ? 
+            new WebAssembly.Memory({ initial: 1, maximum: SHARED_MEMORY_PAGES, shared }) :
+            new WebAssembly.Memory({ initial: 1 });
 
         // Load wasm module
-        const module = await WebAssembly.instantiate(
-            wasm_buffer, { env: { 
+        const module = this.module = wasm_buffer instanceof WebAssembly.Module ? wasm_buffer : await WebAssembly.compile(wasm_buffer);
+        const names = WebAssembly.Module.exports(module).map(e => e.name);
+        const missing = CORE_EXPORTS.filter(name => !names.includes(name));
+        if (missing.length) throw new Error(`server.wasm is out of date (missing ${missing.join(", ")}), ` +
+            `rebuild it with "npm run build:wasm"`);
+        const instance = await WebAssembly.instantiate(
+            module, { env: { 
                 memory: this.memory,
                 powf: Math.pow,
                 unlock_line: id => this.game.controls[id].unlock(),
@@ -158,101 +221,323 @@ module.exports = class Engine {
                 remove_cell: (id, type, eatenBy, eatenByType) => this.removeCell(id, type, eatenBy, eatenByType),
                 split_virus: (x, y, bx, by) => this.splitVirus(x, y, bx, by),
                 pop_player: (id, type, mass) => this.popPlayer(id, type, mass),
-                tree_update: id => this.tree.update(this.cells[id]),
+                tree_update: id => this.tree.update(id),
                 console_log: console.log
             }
         });
 
-        this.wasm = module.instance.exports;
+        this.wasm = instance.exports;
         /** @type {number} */
         this.BYTES_PER_CELL = this.wasm.bytes_per_cell();
+        /** @type {number} */
+        this.ID_BYTES = this.wasm.cell_id_bytes();
+        /** @type {number} */
+        this.CELL_LIMIT = this.wasm.cell_limit();
+        /** @type {number} */
+        this.EATEN_BY_OFFSET = this.wasm.eaten_by_offset();
+        /** @type {number} */
+        this.CONTACT_CACHE_SIZE = this.wasm.contact_cache_size();
+        /** @type {number} */
+        this.SPAWN_GRID_SIZE = this.wasm.spawn_grid_size();
+        /** @type {number} */
+        this.CELL_LISTS_SIZE = this.wasm.cell_lists_size();
+
+        /** @type {typeof Uint16Array|typeof Uint32Array} */
+        this.IDArray = this.ID_BYTES === 4 ? Uint32Array : Uint16Array;
+
+        // Cells at 0 (wasm calls pass 0 for them), contact cache, spawn grid, cell lists and the indices,
+        // the tree, traversal stack and scratch are laid out after them when the tree is serialized
+        const arena = this.arena = new Arena(this.memory, shared ? SHARED_MEMORY_PAGES : MEMORY_PAGES);
+        arena.reserve(this.BYTES_PER_CELL * this.CELL_LIMIT);
+        // Same player contact cache, dirty table is the first 256 bytes
+        this.contactPtr = arena.reserve(this.CONTACT_CACHE_SIZE);
+        // Spawn occupancy grid, sampled point is written to the first 8 bytes
+        this.gridPtr = arena.reserve(this.SPAWN_GRID_SIZE);
+        // Per type cell lists owned by wasm: count[256], offset[256], removed count, then heads, tails and links
+        this.listsPtr = arena.reserve(this.CELL_LISTS_SIZE);
+        // Removed and alive cells of the tick, everything before it is world state (saved in snapshots)
+        this.indicesPtr = arena.reserve((this.CELL_LIMIT + 1) * this.ID_BYTES);
+        /** Select output, spawned ids or bot brains (20 bytes per controller) */
+        this.SCRATCH_SIZE = Math.max(this.CELL_LIMIT * this.ID_BYTES, 256 * 20);
+
+        arena.onGrow(() => this.bindViews());
         this.bindBuffers();
     }
 
-    bindBuffers() {
-        
-        /** @type {Set<number>[]} */
-        this.counters = Array.from({ length: 256 }, _ => new Set());
-        this.__next_cell_id = 1;
-
-        // Fill 0 in case we are reusing the buffer
-        new Uint32Array(this.memory.buffer).fill(0);
+    /** Typed arrays over the engine memory, again when it grows (a grown memory gets a new buffer) */
+    bindViews() {
+        const buffer = this.memory.buffer;
 
         // Default CELL_LIMIT uses 2mb ram
-        this.cells = Array.from({ length: CELL_LIMIT }, (_, i) =>
-            new Cell(new DataView(this.memory.buffer, i * this.BYTES_PER_CELL, this.BYTES_PER_CELL), i));
+        if (!this.cells) this.cells = new Cells(this.CELL_LIMIT, this.BYTES_PER_CELL, this.EATEN_BY_OFFSET, this.ID_BYTES);
+        this.cells.bind(buffer);
+
+        this.contactDirty = new Uint8Array(buffer, this.contactPtr, 256);
+        this.spawnPoint = new Float32Array(buffer, this.gridPtr, 2);
+
+        /** Number of cells per type (player id or cell type) */
+        this.counts = new Uint32Array(buffer, this.listsPtr, 256);
+        this.typeOffsets = new Uint32Array(buffer, this.listsPtr + 1024, 256);
+        this.removedCount = new Uint32Array(buffer, this.listsPtr + 2048, 1);
+        this.listHead = new this.IDArray(buffer, this.listsPtr + 2052, 256);
+        this.listNext = new this.IDArray(buffer, this.listsPtr + 2052 + 512 * this.ID_BYTES, this.CELL_LIMIT);
+
+        this.resolveIndices = new this.IDArray(buffer, this.indicesPtr, this.CELL_LIMIT + 1);
+    }
+
+    bindBuffers() {
+
+        // Fill 0 in case we are reusing the buffer, regions reserved after the engine's (encode workers) are left alone
+        new Uint8Array(this.memory.buffer, 0, this.indicesPtr).fill(0);
+        this.bindViews();
         this.cellCount = 0;
         
         this.tree = new QuadTree(this.cells, 0, 0, 
             this.options.MAP_HW, this.options.MAP_HH, 
             this.options.QUADTREE_MAX_LEVEL,
-            this.options.QUADTREE_MAX_ITEMS);
+            this.options.QUADTREE_MAX_ITEMS, this.ID_BYTES);
+
+        new Uint32Array(this.memory.buffer, this.gridPtr + 8, 1)[0] = (Math.random() * 0xffffffff) | 1;
+        this.spawnGridDirty = true;
+        this.bindIdGrid();
 
         this.indices = 0;
-        this.indicesPtr = this.BYTES_PER_CELL * CELL_LIMIT;
-        this.resolveIndices = new DataView(this.memory.buffer, this.indicesPtr);
 
-        // Not defined here since it's dynamically changed (after indices)
+        // Nothing serialized yet, the stack and scratch are still usable
+        this.layout(0);
         this.treePtr = 0;
-        this.treeBuffer = null;
+        this.treeEnd = 0;
 
-        /** @type {number[]} */
-        this.removedCells = [];
         /** @type {[number, boolean][]} */
         this.killArray = [];
         /** @type {Set<number>} */
         this.spawnSet = new Set();
     }
 
-    get running() { return !!this.updateInterval; }
+    get running() { return !!this.updateTimer; }
 
     start() {
         if (this.running) return;
-        this.__ltick = performance.now();
+        const o = this.options;
+        const now = performance.now();
+
+        this.tickDelay = 1000 / o.PHYSICS_TPS;
+        this.lbDelay = 1000 / o.LEADERBOARD_TPS;
+        this.minimapDelay = 1000 / o.MINIMAP_TPS;
+
+        this.__ltick = now;
+        this.__nextTick = now + this.tickDelay;
+        this.__nextLeaderboard = now + this.lbDelay;
+        this.__nextMinimap = now + this.minimapDelay;
+        this.__nextShedCheck = now + 1000;
 
-        this.tickDelay = 1000 / this.options.PHYSICS_TPS;
-        this.updateInterval = setInterval(() => {
-            this.__now = performance.now();
-            this.tick((this.__now - this.__ltick) * this.options.TIME_SCALE);
-            this.__ltick = this.__now;
-            this.usage = (performance.now() - this.__now) / this.tickDelay;
-        }, this.tickDelay);
+        this.ticks = 0;
+        this.tickCost = 0;
+        this.usage = 0;
+        this.shed = 0;
+        this.tickTimes.fill(0);
+
+        this.schedule();
+    }
 
-        this.lbDelay = 1000 / this.options.LEADERBOARD_TPS;
-        this.leaderboardInterval = setInterval(() => {
+    /** Ticks run on absolute deadlines, a late tick doesn't push the following ones back */
+    schedule() {
+        this.updateTimer = setTimeout(this.loop, Math.max(0, this.__nextTick - performance.now()));
+    }
+
+    loop() {
+        const o = this.options;
+        const now = this.__now = performance.now();
+
+        // Capped so an overrun slows the world down instead of teleporting cells
+        const dt = Math.min(now - this.__ltick, this.tickDelay * o.TICK_MAX_DT);
+        this.__ltick = now;
+        this.tick(dt * o.TIME_SCALE);
+
+        // Cosmetics slow down first when over budget
+        const slow = this.shed >= 1 ? o.LOAD_SHED_SLOWDOWN : 1;
+        if (now >= this.__nextLeaderboard) {
+            this.__nextLeaderboard = now + this.lbDelay * slow;
             const lb = this.game.controls
                 .map(c => c.handle)
                 .filter(h => h && h.alive && h.showonLeaderboard)
                 .sort((a, b) => b.score - a.score);
             this.game.emit("leaderboard", lb);
-        }, this.lbDelay);
-
-        this.minimapDelay = 1000 / this.options.MINIMAP_TPS;
-        this.minimapInterval = setInterval(() => {
+        }
+        if (now >= this.__nextMinimap) {
+            this.__nextMinimap = now + this.minimapDelay * slow;
             const minimap = this.game.controls
                 .map(c => c.handle)
                 .filter(h => h && h.alive && h.showonMinimap);
             this.game.emit("minimap", minimap);
-        }, this.minimapDelay);
+        }
+
+        const end = performance.now();
+        this.tickTimes[this.ticks % TICK_WINDOW] = end - now;
+        this.ticks++;
+        this.tickCost += (end - now - this.tickCost) * 0.1;
+        this.usage = this.tickCost / this.tickDelay;
+        if (end >= this.__nextShedCheck) this.updateShed(end);
+
+        // Missed deadlines are dropped rather than run back to back, dt covers them
+        this.__nextTick += this.tickDelay;
+        while (this.__nextTick <= end) this.__nextTick += this.tickDelay;
+
+        // Stopped during the tick
+        if (this.updateTimer) this.schedule();
+    }
+
+    /**
+     * Tick time (ms) p of the recent ticks stayed under
+     * @param {number} p 0 to 1
+     */
+    tickPercentile(p) {
+        const n = Math.min(this.ticks, TICK_WINDOW);
+        if (!n) return 0;
+        const sorted = this.tickTimes.slice(0, n).sort();
+        return sorted[Math.min(n - 1, Math.floor(p * n))];
+    }
+
+    /**
+     * Load shedding level from the smoothed tick cost, checked once a second:
+     * 1 slows leaderboard and minimap, 2 halves updates of clients not playing, 3 throttles spawn refill
+     */
+    updateShed(now) {
+        const o = this.options;
+        this.__nextShedCheck = now + 1000;
+
+        const prev = this.shed;
+        if (this.usage > o.LOAD_SHED_HIGH && this.shed < 3) this.shed++;
+        else if (this.usage < o.LOAD_SHED_LOW && this.shed > 0) this.shed--;
+
+        if (prev != this.shed)
+            console.log(`Tick usage ${(this.usage * 100).toFixed(1)}%, load shedding level ${prev} -> ${this.shed}`);
     }
 
     stop() {
-        if (this.running) {
-            clearInterval(this.updateInterval);
-            clearInterval(this.leaderboardInterval);
-            clearInterval(this.minimapInterval);
-        }
-        this.updateInterval = null;
-        this.leaderboardInterval = null;
-        this.minimapInterval = null;
+        clearTimeout(this.updateTimer);
+        this.updateTimer = null;
     }
 
     restart() {
         this.shouldRestart = false;
         this.game.emit("restart");
         this.bindBuffers();
+        // Ghost ids were wiped with the cells, the neighbours send them again next exchange
+        this.region && this.region.reset();
     }
     
+    /**
+     * Binary world snapshot, taken between ticks. Little endian layout:
+     * 64 byte header (magic, version, id bytes, cell limit, bytes per cell, region length,
+     * controllers offset and length, 4 unused bytes, cell count, map size),
+     * then the wasm memory before the indices as is (cells, contact cache, spawn grid, cell lists),
+     * then the controller records 8 byte aligned
+     */
+    snapshot() {
+        const now = performance.now();
+        const writer = new Writer();
+        const records = this.game.controls.filter(c => c.id && (c.handle || this.counts[c.id]));
+
+        writer.writeUInt8(records.length);
+        for (const c of records) {
+            const h = c.handle;
+            // Dual controllers resume with their owner
+            const owner = h && h.owner;
+            writer.writeUInt8(c.id);
+            writer.writeUInt8(owner ? owner.controller.id : 0);
+            writer.writeUTF8String((owner ? owner.uid : h && h.uid) || "");
+            c.serialize(writer, now);
+        }
+        const controllers = new Uint8Array(writer.finalize());
+
+        const region = this.indicesPtr;
+        const offset = SNAPSHOT_HEADER + Math.ceil(region / 8) * 8;
+        const buffer = new ArrayBuffer(offset + controllers.byteLength);
+        const view = new DataView(buffer);
+
+        const memory = new Uint8Array(buffer, SNAPSHOT_HEADER, region);
+        memory.set(new Uint8Array(this.memory.buffer, 0, region));
+        // Ghosts belong to the neighbours and are sent again after a restore, they are left out of the copy
+        // (they are in no type list) and stay in the running world
+        let ghosts = 0;
+        if (this.region) {
+            const { isGhost } = this.region;
+            const B = this.BYTES_PER_CELL;
+            for (let id = 0; id < isGhost.length; id++) {
+                if (!isGhost[id]) continue;
+                memory.fill(0, id * B, (id + 1) * B);
+                ghosts++;
+            }
+        }
+
+        view.setUint32(0, SNAPSHOT_MAGIC, true);
+        view.setUint16(4, SNAPSHOT_VERSION, true);
+        view.setUint8(6, this.ID_BYTES);
+        view.setUint32(8, this.CELL_LIMIT, true);
+        view.setUint32(12, this.BYTES_PER_CELL, true);
+        view.setUint32(16, region, true);
+        view.setUint32(20, offset, true);
+        view.setUint32(24, controllers.byteLength, true);
+        view.setUint32(32, this.cellCount - ghosts, true);
+        view.setFloat32(36, this.options.MAP_HW, true);
+        view.setFloat32(40, this.options.MAP_HH, true);
+
+        new Uint8Array(buffer, offset).set(controllers);
+        return buffer;
+    }
+
+    /**
+     * Load a snapshot into an initialized engine
+     * @param {ArrayBuffer} buffer
+     * @returns {Map<string, { main: number, dual: number }>} controllers waiting for their client by uid, null if incompatible
+     */
+    restore(buffer) {
+        const view = new DataView(buffer);
+        const fail = reason => (console.warn(`Snapshot not restored: ${reason}`), null);
+
+        if (buffer.byteLength < SNAPSHOT_HEADER || view.getUint32(0, true) != SNAPSHOT_MAGIC) return fail("not a snapshot");
+        if (view.getUint16(4, true) != SNAPSHOT_VERSION) return fail(`version ${view.getUint16(4, true)}`);
+        if (view.getUint8(6) != this.ID_BYTES || view.getUint32(8, true) != this.CELL_LIMIT ||
+            view.getUint32(12, true) != this.BYTES_PER_CELL) return fail("cell layout mismatch");
+        if (view.getUint32(16, true) != this.indicesPtr) return fail("memory layout mismatch");
+        if (view.getFloat32(36, true) != Math.fround(this.options.MAP_HW) ||
+            view.getFloat32(40, true) != Math.fround(this.options.MAP_HH)) return fail("map size mismatch");
+
+        this.bindBuffers();
+        this.region && this.region.reset();
+        const region = this.indicesPtr;
+        new Uint8Array(this.memory.buffer, 0, region).set(new Uint8Array(buffer, SNAPSHOT_HEADER, region));
+        this.cellCount = view.getUint32(32, true);
+
+        // Broad phase is rebuilt from the restored cell lists (removed cells are already out of it)
+        const count = this.wasm.flatten_indices(0, this.listsPtr, this.indicesPtr, 0, 0) - 1;
+        this.tree.insertBatch(this.resolveIndices.subarray(0, count));
+
+        const now = performance.now();
+        const reader = new Reader(new DataView(buffer, view.getUint32(20, true), view.getUint32(24, true)));
+        /** @type {Map<string, { main: number, dual: number }>} */
+        const resumes = new Map();
+
+        for (let records = reader.readUInt8(); records > 0; records--) {
+            const c = this.game.controls[reader.readUInt8()];
+            const owner = reader.readUInt8();
+            const uid = reader.readUTF8String();
+            c.deserialize(reader, now);
+
+            if (!uid) {
+                // Bots and anything else without a client to come back
+                this.delayKill(c.id, true);
+                c.reset();
+                continue;
+            }
+            const resume = resumes.get(uid) || { main: 0, dual: 0 };
+            owner ? resume.dual = c.id : resume.main = c.id;
+            resumes.set(uid, resume);
+        }
+        return resumes;
+    }
+
     /** @param {Controller} controller */
     delaySpawn(controller) {
         controller.spawn = false;
@@ -267,25 +552,28 @@ module.exports = class Engine {
     /** @param {number} dt */
     tick(dt) {
 
+        // Frames of the last tick when encoding is pipelined, before anything touches the frozen copy
+        this.encoder && this.encoder.collect();
+
         if (this.shouldRestart) this.restart();
 
         if (this.bots.length < this.options.BOTS) {
             this.bots.push(new Bot(this.game));
         }
 
-        // Has 0 player and all dead cells are gone
-        if (this.game.handles <= this.bots.length && !this.counters[DEAD_CELL_TYPE].size) return;
+        // Has 0 player and all dead cells are gone (regions keep exchanging with their neighbours)
+        if (this.game.handles <= this.bots.length && !this.counts[DEAD_CELL_TYPE] && !this.region) return;
 
         this.alivePlayers = this.game.controls.filter(c => c.alive && !(c.handle instanceof Bot));
 
-        // No need to reserve space for indices now since we are only going to query it
-        this.treePtr = this.BYTES_PER_CELL * CELL_LIMIT;
-        this.treeBuffer = new DataView(this.memory.buffer, this.treePtr);
         // Serialize again so client can query viewport
         this.serialize();
+        this.spawnGridDirty = true;
 
+        this.thinkBots();
         // Emit tick
         this.game.emit("tick");
+        this.encoder && this.encoder.flush();
 
         this.spawnCells();
         this.handleInputs(dt);
@@ -301,23 +589,20 @@ module.exports = class Engine {
         this.serialize();
 
         this.resolve();
+
+        this.region && this.region.exchange();
     }
 
     spawnCells() {
-        // Spawn new cells
-        for (let i = 0; i < this.options.MAX_CELL_PER_TICK; i++) {
-            if (this.counters[PELLET_TYPE].size < this.options.PELLET_COUNT) {
-                const [x, y] = this.randomPoint(this.options.PELLET_SIZE);
-                this.newCell(x, y, this.options.PELLET_SIZE, PELLET_TYPE);
-            } else break;
-        }
+        const o = this.options;
 
-        for (let i = 0; i < this.options.MAX_CELL_PER_TICK; i++) {
-            if (this.counters[VIRUS_TYPE].size < this.options.VIRUS_COUNT) {
-                const [x, y, success] = this.getSafeSpawnPoint(this.options.VIRUS_SIZE * this.options.VIRUS_SAFE_SPAWN_RADIUS);
-                success && this.newCell(x, y, this.options.VIRUS_SIZE, VIRUS_TYPE);
-            } else break;
-        }
+        // Spawn new cells, refill is throttled last when over budget
+        const max = this.shed >= 3 ? Math.min(o.LOAD_SHED_SPAWN, o.MAX_CELL_PER_TICK) : o.MAX_CELL_PER_TICK;
+        const pellets = Math.min(max, o.PELLET_COUNT - this.counts[PELLET_TYPE]);
+        if (pellets > 0) this.spawnBatch(PELLET_TYPE, pellets, o.PELLET_SIZE);
+
+        const viruses = Math.min(max, o.VIRUS_COUNT - this.counts[VIRUS_TYPE]);
+        if (viruses > 0) this.spawnBatch(VIRUS_TYPE, viruses, o.VIRUS_SIZE, o.VIRUS_SIZE * o.VIRUS_SAFE_SPAWN_RADIUS);
 
         for (const id of [...this.spawnSet]) {
             const c = this.game.controls[id];
@@ -374,18 +659,19 @@ module.exports = class Engine {
             // Split
             let attempts = this.options.PLAYER_SPLIT_CAP;
             while (controller.splitAttempts > 0 && attempts-- > 0) {
-                for (const cell_id of [...this.counters[id]]) {
-                    const cell = this.cells[cell_id];
-                    if (this.counters[id].size >= this.options.PLAYER_MAX_CELLS) break;
-                    const r = cell.r;
+                const { f32, F } = this.cells;
+                for (const cell_id of this.cellsOf(id)) {
+                    const i = cell_id * F;
+                    if (this.counts[id] >= this.options.PLAYER_MAX_CELLS) break;
+                    const r = f32[i + R];
                     if (r < MIN_SPLIT_SIZE) continue;
-                    let dx = controller.mouseX - cell.x;
-                    let dy = controller.mouseY - cell.y;
+                    let dx = controller.mouseX - f32[i + X];
+                    let dy = controller.mouseY - f32[i + Y];
                     let d = Math.sqrt(dx * dx + dy * dy);
                     if (d < 1) dx = 1, dy = 0, d = 1;
                     else dx /= d, dy /= d;
                     const MULTI_2 = SPLIT_R_THRESH ? Math.max(r / SPLIT_R_THRESH, 1) : 1;
-                    this.splitFromCell(cell, cell.r * Math.SQRT1_2, dx, dy, MULTI_2 * boost);
+                    this.splitFromCell(cell_id, r * Math.SQRT1_2, dx, dy, MULTI_2 * boost);
                 }
                 controller.splitAttempts--;
             }
@@ -403,10 +689,11 @@ module.exports = class Engine {
 
                     const r_th = Math.sqrt(this.options.NORMALIZE_THRESH_MASS * 100);
 
-                    for (const cell_id of [...this.counters[id]]) {
-                        const cell = this.cells[cell_id];
+                    const { f32, F } = this.cells;
+                    for (const cell_id of this.cellsOf(id)) {
+                        const i = cell_id * F;
                         
-                        const r = cell.r;
+                        const r = f32[i + R];
                         const MULTI = r_th ? Math.max(r / r_th, 1) : 1;
                         const LOSS = MULTI * MULTI * this.options.EJECT_LOSS * this.options.EJECT_LOSS;
                         const EJECT_SIZE = this.options.EJECT_SIZE * MULTI;
@@ -414,9 +701,9 @@ module.exports = class Engine {
                         const EJECT_BOOST = this.options.EJECT_BOOST * MULTI;
                         
                         if (r < MIN_EJECT_SIZE) continue;
-                        if (cell.age < this.options.PLAYER_NO_EJECT_DELAY) continue;
+                        if (f32[i + AGE] < this.options.PLAYER_NO_EJECT_DELAY) continue;
                         
-                        const x = cell.x, y = cell.y;
+                        const x = f32[i + X], y = f32[i + Y];
                         let dx = controller.mouseX - x;
                         let dy = controller.mouseY - y;
                         let d = Math.sqrt(dx * dx + dy * dy);
@@ -429,8 +716,8 @@ module.exports = class Engine {
                         
                         this.newCell(sx, sy, EJECT_SIZE, EJECTED_TYPE, 
                             Math.sin(a), Math.cos(a), EJECT_BOOST);
-                        cell.r = Math.sqrt(r * r - LOSS);
-                        cell.updated = true;
+                        f32[i + R] = Math.sqrt(r * r - LOSS);
+                        this.cells.markUpdated(cell_id);
                     }
     
                     controller.lastEjectTick = this.__now + ejected * this.options.EJECT_DELAY;
@@ -442,22 +729,20 @@ module.exports = class Engine {
         }
     }
 
-    updateIndices() {
-        let offset = 0;
-        for (let type = 0; type < this.counters.length; type++) {
-            const iter = type ? this.counters[type] : this.removedCells;
-            for (const cell_id of iter) {
-                this.resolveIndices.setUint16(offset, cell_id, true);
-                offset += 2;
-            }
-        }
-        
-        this.resolveIndices.setUint16(offset, 0, true);
-        offset += 2;
+    /**
+     * Snapshot of the cell ids of one type
+     * @param {number} type
+     */
+    cellsOf(type) {
+        /** @type {number[]} */
+        const ids = [];
+        for (let id = this.listHead[type]; id; id = this.listNext[id]) ids.push(id);
+        return ids;
+    }
 
-        this.indices = offset >> 1;
-        this.treePtr = this.indicesPtr + offset;
-        this.treeBuffer = new DataView(this.memory.buffer, this.treePtr);
+    updateIndices() {
+        // Removed cells first (update clears them), then every type in order
+        this.indices = this.wasm.flatten_indices(0, this.listsPtr, this.indicesPtr, 1, 0);
     }
 
     updateCells(dt) {
@@ -474,11 +759,11 @@ module.exports = class Engine {
     updatePlayerCells(dt) {
         const initial = Math.round(1000 * this.options.PLAYER_MERGE_TIME);
         
-        let ptr = this.indicesPtr + (this.removedCells.length << 1);
         for (const id in this.game.controls) {
             const c = this.game.controls[~~id];
             if (!c.handle) continue;
-            const s = this.counters[~~id].size;
+            const s = this.counts[~~id];
+            const ptr = this.indicesPtr + this.typeOffsets[~~id] * this.ID_BYTES;
             const norm = this.options.NORMALIZE_THRESH_MASS ?
                 Math.min(Math.sqrt(this.options.NORMALIZE_THRESH_MASS / c.score), 1) : 1;
 
@@ -488,7 +773,6 @@ module.exports = class Engine {
                 dt,
                 initial, this.options.PLAYER_MERGE_INCREASE, this.options.PLAYER_SPEED, norm,
                 this.options.PLAYER_MERGE_TIME, this.options.PLAYER_NO_MERGE_DELAY, this.options.PLAYER_MERGE_NEW_VER);
-            ptr += s << 1;
         }
     }
 
@@ -497,37 +781,37 @@ module.exports = class Engine {
         const AUTO_DELAY = this.options.PLAYER_AUTOSPLIT_DELAY;
         const AUTO_DIV = 1 / AUTO_SIZE / AUTO_SIZE;
         const AUTO_BOOST = this.options.PLAYER_SPLIT_BOOST;
+        const cells = this.cells;
+        const { f32, u8, F, B } = cells;
         // Autosplit and update quadtree
         if (AUTO_SIZE) {
             // starting after removed cells
-            for (let i = this.removedCells.length; i < this.indices - 1; i++) {
-                const index = this.resolveIndices.getUint16(i * 2, true);
-                const cell = this.cells[index];
+            for (let i = this.removedCount[0]; i < this.indices - 1; i++) {
+                const index = this.resolveIndices[i];
 
-                if (cell.shouldAuto && cell.age > AUTO_DELAY) {
-                    const r = cell.r;
+                if (cells.shouldAuto(index) && f32[index * F + AGE] > AUTO_DELAY) {
+                    const r = f32[index * F + R];
                     const splitTimes = Math.ceil(r * r * AUTO_DIV);
                     const splitSizes = Math.min(Math.sqrt(r * r / splitTimes), AUTO_SIZE);
                     for (let i = 1; i < splitTimes; i++) {
                         const angle = Math.random() * 2 * Math.PI;
-                        this.splitFromCell(cell, splitSizes, Math.sin(angle), Math.cos(angle), AUTO_BOOST);
+                        this.splitFromCell(index, splitSizes, Math.sin(angle), Math.cos(angle), AUTO_BOOST);
                     }
-                    cell.r = splitSizes;
-                    cell.updated = true;
+                    f32[index * F + R] = splitSizes;
+                    cells.markUpdated(index);
                 }
 
                 // Update quadtree
-                if (cell.type > 250 && !cell.isUpdated) continue;
-                this.tree.update(cell);
+                if (u8[index * B + TYPE] > 250 && !cells.isUpdated(index)) continue;
+                this.tree.update(index);
             }
         } else {
             // Only update quadtree (starting after removed cells)
-            for (let i = this.removedCells.length; i < this.indices - 1; i++) {
-                const index = this.resolveIndices.getUint16(i * 2, true);
-                const cell = this.cells[index];
+            for (let i = this.removedCount[0]; i < this.indices - 1; i++) {
+                const index = this.resolveIndices[i];
                 // Update quadtree
-                if (cell.type > 250 && !cell.isUpdated) continue;
-                this.tree.update(cell);
+                if (u8[index * B + TYPE] > 250 && !cells.isUpdated(index)) continue;
+                this.tree.update(index);
             }
         }
     }
@@ -545,21 +829,20 @@ module.exports = class Engine {
      * @param {boolean} replace
      */
     kill(id, replace) {
-        const dead_set = this.counters[DEAD_CELL_TYPE];
+        this.contactDirty[id] = 1;
         if (replace) {
-            for (const cell_id of this.counters[id]) {
-                const dead_cell_id = this.__next_cell_id = this.wasm.kill_cell(0, cell_id, this.__next_cell_id);
-                dead_set.add(dead_cell_id);
-                this.tree.swap(this.cells[cell_id], this.cells[dead_cell_id]); // Swap it with current cell, no need to update the tree
+            // kill_cell moves each cell to the dead list
+            for (const cell_id of this.cellsOf(id)) {
+                const dead_cell_id = this.wasm.kill_cell(0, this.listsPtr, cell_id);
+                this.tree.swap(cell_id, dead_cell_id); // Swap it with current cell, no need to update the tree
             }
         } else {
-            for (const cell_id of this.counters[id]) this.cells[cell_id].remove();
+            for (const cell_id of this.cellsOf(id)) this.cells.remove(cell_id);
+            this.wasm.clear_type(this.listsPtr, id);
         }
-        this.counters[id].clear();
     }
 
     resolve() {
-        this.removedCells = [];
         const VIRUS_MAX_SIZE = Math.sqrt(this.options.VIRUS_SIZE * this.options.VIRUS_SIZE +
             this.options.EJECT_SIZE * this.options.EJECT_SIZE * this.options.VIRUS_FEED_TIMES);
 
@@ -567,14 +850,61 @@ module.exports = class Engine {
 
         // Magic goes here
         this.collisions = this.wasm.resolve(0,
-            this.indicesPtr, this.counters[PELLET_TYPE].size,
+            this.indicesPtr, this.listsPtr,
             this.treePtr, this.stackPtr,
+            this.contactPtr, o.CONTACT_CACHE_SKIN,
             o.PLAYER_NO_MERGE_DELAY, o.PLAYER_NO_COLLI_DELAY,
             o.EAT_OVERLAP, o.EAT_MULT, 
             o.VIRUS_PUSH ? o.VIRUS_PUSH_BOOST : 0, o.VIRUS_MAX_BOOST,
             o.VIRUS_SIZE, VIRUS_MAX_SIZE, o.PLAYER_DEAD_DELAY);
     }
 
+    /**
+     * Remove a cell right away without a dead cell in its place
+     * @param {number} id
+     */
+    dropCell(id) {
+        const type = this.cells.type(id);
+        this.wasm.drop_cell(0, this.listsPtr, id);
+        this.removeCell(id, type, 0, 0);
+    }
+
+    /** 
+     * Read only copy of a cell from another region, see Cells.ghost
+     * @returns {number} cell id, 0 when the world is full
+     */
+    newGhost(x, y, r, type) {
+        if (this.cellCount >= this.CELL_LIMIT - 1) return 0;
+        const id = this.wasm.alloc_id(0, this.listsPtr, x, y);
+        const { f32, u8, F, B } = this.cells;
+        f32[id * F + X] = x;
+        f32[id * F + Y] = y;
+        f32[id * F + R] = r;
+        f32[id * F + AGE] = 1000; // old enough to be selected for clients
+        u8[id * B + TYPE] = type;
+        this.cells.ghost(id);
+        this.tree.insert(id);
+        this.cellCount++;
+        return id;
+    }
+
+    updateGhost(id, x, y, r, type) {
+        const { f32, u8, F, B } = this.cells;
+        f32[id * F + X] = x;
+        f32[id * F + Y] = y;
+        f32[id * F + R] = r;
+        u8[id * B + TYPE] = type;
+        this.cells.ghost(id);
+        this.tree.update(id);
+    }
+
+    removeGhost(id) {
+        this.tree.remove(id);
+        this.cells.clear(id);
+        this.wasm.hold_id(this.listsPtr, id);
+        this.cellCount--;
+    }
+
     /**
      * 
      * @param {number} id 
@@ -583,11 +913,11 @@ module.exports = class Engine {
      * @param {number} eatenByType 
      */
     removeCell(id, type, eatenBy, eatenByType) {
-        this.tree.remove(this.cells[id]);
-        this.counters[type].delete(id);
-        this.removedCells.push(id);
+        // Already unlinked from its type list in wasm
+        this.tree.remove(id);
         this.cellCount--;
-        if (type <= 250 && !this.counters[type].size) {
+        if (type <= 250) this.contactDirty[type] = 1;
+        if (type <= 250 && !this.counts[type]) {
             eatenBy && this.game.controls[eatenByType].kills++;
             this.game.controls[type].score = 0;
         }
@@ -616,24 +946,27 @@ module.exports = class Engine {
         splits.length && (this.game.controls[type].lockDir = false);
         for (const mass of splits) {
             const angle = Math.random() * 2 * Math.PI;
-            this.splitFromCell(this.cells[id], Math.sqrt(mass * 100),
+            this.splitFromCell(id, Math.sqrt(mass * 100),
                 Math.sin(angle), Math.cos(angle), this.options.PLAYER_SPLIT_BOOST);
         }
     }
 
     /**
-     * @param {Cell} cell
+     * @param {number} id
      * @param {number} size
      * @param {number} boostX
      * @param {number} boostY
      * @param {number} boost
      */
-    splitFromCell(cell, size, boostX, boostY, boost) {
-        cell.r = Math.sqrt(cell.r * cell.r - size * size);
-        cell.updated = true;
-        const x = cell.x + this.options.PLAYER_SPLIT_DIST * boostX;
-        const y = cell.y + this.options.PLAYER_SPLIT_DIST * boostY;
-        this.newCell(x, y, size, cell.type, boostX, boostY, boost);
+    splitFromCell(id, size, boostX, boostY, boost) {
+        const { f32, F } = this.cells;
+        const i = id * F;
+        const r = f32[i + R];
+        f32[i + R] = Math.sqrt(r * r - size * size);
+        this.cells.markUpdated(id);
+        const x = f32[i + X] + this.options.PLAYER_SPLIT_DIST * boostX;
+        const y = f32[i + Y] + this.options.PLAYER_SPLIT_DIST * boostY;
+        this.newCell(x, y, size, this.cells.type(id), boostX, boostY, boost);
     }
 
     /**
@@ -642,7 +975,7 @@ module.exports = class Engine {
      * @returns {number[]}
      */
     distributeCellMass(type, mass) {
-        let cellsLeft = this.options.PLAYER_MAX_CELLS - this.counters[type].size;
+        let cellsLeft = this.options.PLAYER_MAX_CELLS - this.counts[type];
         if (cellsLeft <= 0) return [];
         let splitMin = this.options.PLAYER_MIN_SPLIT_SIZE;
         splitMin = splitMin * splitMin / 100;
@@ -673,27 +1006,55 @@ module.exports = class Engine {
         return splits.concat(new Array(cellsLeft).fill(nextMass));
     }
 
+    /**
+     * Spawn cells of one type at random points in wasm, then add them to the tree in bulk
+     * @param {number} type
+     * @param {number} count
+     * @param {number} size
+     * @param {number} safeRadius 0 to skip the safe spawn check
+     */
+    spawnBatch(type, count, size, safeRadius = 0) {
+        count = Math.min(count, this.CELL_LIMIT - 1 - this.cellCount);
+        if (count <= 0) {
+            this.shouldRestart = true;
+            return;
+        }
+
+        if (safeRadius) {
+            if (!this.treePtr) return;
+            this.updateSpawnGrid();
+        }
+
+        const outPtr = this.scratchPtr;
+        const spawned = this.wasm.spawn_batch(0, this.listsPtr, this.treePtr, this.stackPtr, this.gridPtr,
+            outPtr, count,
+            type, size, safeRadius, this.options.IGNORE_TYPE, this.options.SAFE_SPAWN_TRIES,
+            ...this.spawnBounds);
+        if (!spawned) return;
+
+        this.tree.insertBatch(new this.IDArray(this.memory.buffer, outPtr, spawned));
+        this.cellCount += spawned;
+    }
+
     /**
      * @param {number} x 
      * @param {number} y 
      * @param {number} size
      * @param {number} type
-     * @return {Cell}
+     * @return {number} cell id, 0 when the world is full
      */
     newCell(x, y, size, type, boostX = 0, boostY = 0, boost = 0) {
         
-        if (this.cellCount >= CELL_LIMIT - 1) {
+        if (this.cellCount >= this.CELL_LIMIT - 1) {
             this.shouldRestart = true;
-            return;
+            return 0;
         }
 
-        const id = this.__next_cell_id = this.wasm.new_cell(0, this.__next_cell_id, 
-            x, y, size, type, boostX, boostY, boost);
-        
-        const cell = this.cells[id];
-        
-        this.tree.insert(cell);
-        this.counters[cell.type].add(id);
+        const id = this.wasm.new_cell(0, this.listsPtr, x, y, size, type, boostX, boostY, boost);
+        this.tree.insert(id);
+        this.cellCount++;
+        if (type <= 250) this.contactDirty[type] = 1;
+        return id;
     }
 
     /** @param {number} size */
@@ -719,28 +1080,36 @@ module.exports = class Engine {
             const { viewportX: vx, viewportY: vy } = target;
             const [bx_min, bx_max, by_min, by_max] = target.box;
             
-            const tries = this.options.SAFE_SPAWN_TRIES;
             const f1 = Math.max(this.options.PLAYER_VIEW_MIN, 2 * (vx - bx_min));
             const f2 = Math.max(this.options.PLAYER_VIEW_MIN, 2 * (bx_max - vx));
             const f3 = Math.max(this.options.PLAYER_VIEW_MIN, 2 * (vy - by_min));
             const f4 = Math.max(this.options.PLAYER_VIEW_MIN, 2 * (by_max - vy));
-            let i = 0;
-            while (++i < tries) {
-                const f = 0.5 + 0.5 * i / tries;
-                const xmin = vx - f * f1;
-                const xmax = vx + f * f2;
-                const ymin = vy - f * f3;
-                const ymax = vy + f * f4;
-                const [x, y] = this.randomPoint(s, xmin, xmax, ymin, ymax);
-                if (this.wasm.is_safe(0, x, y, safeRadius, this.treePtr, this.stackPtr, this.options.IGNORE_TYPE) > 0)
-                    return [x, y, true, i];
+
+            // Try close to the target first, then the whole area around it
+            let attempts = 0;
+            for (const f of [0.5, 1]) {
+                const res = this.sampleSpawnPoint(s, safeRadius,
+                    vx - f * f1, vx + f * f2, vy - f * f3, vy + f * f4);
+                attempts += res[3];
+                if (res[2]) return [res[0], res[1], true, attempts];
             }
-            return [0, 0, false, i];
+            return [0, 0, false, attempts];
         }
 
         return this.getSafeSpawnPoint(safeRadius);
     }
 
+    /** Spread new cell ids over the spawn bounds (alloc_id in core.c), again when a region takes the engine */
+    bindIdGrid() {
+        this.wasm.set_id_grid(this.listsPtr, ...this.spawnBounds);
+    }
+
+    /** Area new cells spawn in, [l, r, b, t], the region rect when the map is partitioned */
+    get spawnBounds() {
+        if (this.region) return this.region.rect;
+        return [-this.options.MAP_HW, this.options.MAP_HW, -this.options.MAP_HH, this.options.MAP_HH];
+    }
+
     /** 
      * @param {number} size 
      * @returns {[number, number, boolean]}
@@ -748,60 +1117,108 @@ module.exports = class Engine {
     getSafeSpawnPoint(size) {
         if (!this.treePtr) return [null, null, false];
 
-        let tries = this.options.SAFE_SPAWN_TRIES;
-        while (--tries) {
-            const [x, y] = this.randomPoint(size);
-            const res = this.wasm.is_safe(0, x, y, size, this.treePtr, this.stackPtr, this.options.IGNORE_TYPE);
-            if (res >= 0) return [x, y, true];
-        }
-        return [null, null, false];
+        const [x, y, success] = this.sampleSpawnPoint(size, size);
+        return success ? [x, y, true] : [null, null, false];
+    }
+
+    updateSpawnGrid() {
+        if (!this.spawnGridDirty) return;
+        this.wasm.build_spawn_grid(0, this.treePtr, this.stackPtr, this.gridPtr,
+            this.options.SPAWN_GRID_TILES,
+            -this.options.MAP_HW, this.options.MAP_HW,
+            -this.options.MAP_HH, this.options.MAP_HH, this.options.IGNORE_TYPE);
+        this.spawnGridDirty = false;
+    }
+
+    /**
+     * Sample a point from the free tiles of the spawn grid, confirmed by one exact check
+     * @param {number} size cell size, used to keep the point inside the map
+     * @param {number} radius safe radius
+     * @returns {[number, number, boolean, number]}
+     */
+    sampleSpawnPoint(size, radius,
+        xmin = this.spawnBounds[0], xmax = this.spawnBounds[1],
+        ymin = this.spawnBounds[2], ymax = this.spawnBounds[3]) {
+
+        this.updateSpawnGrid();
+
+        xmin = clamp(xmin, -this.options.MAP_HW + size, this.options.MAP_HW - size);
+        xmax = clamp(xmax, -this.options.MAP_HW + size, this.options.MAP_HW - size);
+
+        ymin = clamp(ymin, -this.options.MAP_HH + size, this.options.MAP_HH - size);
+        ymax = clamp(ymax, -this.options.MAP_HH + size, this.options.MAP_HH - size);
+
+        const attempts = this.wasm.sample_safe_point(0, this.treePtr, this.stackPtr, this.gridPtr,
+            xmin, xmax, ymin, ymax, radius, this.options.IGNORE_TYPE, this.options.SAFE_SPAWN_TRIES);
+
+        if (attempts > 0) return [this.spawnPoint[0], this.spawnPoint[1], true, attempts];
+        return [0, 0, false, this.options.SAFE_SPAWN_TRIES];
     }
 
     // Sort all the cell indices according to their size (to make solotrick work)
     sortIndices() {
+        this.indices = this.wasm.flatten_indices(0, this.listsPtr, this.indicesPtr, 0, 1);
+    }
 
-        let offset = 0;
-        for (let type = 0; type < this.counters.length; type++) {
-            const iter = this.counters[type];
-            for (const cell_id of iter) {
-                this.resolveIndices.setUint16(offset, cell_id, true);
-                offset += 2;
-            }
-        }
-        
-        this.resolveIndices.setUint16(offset, 0, true);
-        offset += 2;
+    /**
+     * Per tick regions: the serialized tree, the traversal stack and the scratch after it
+     * @param {number} treeBytes
+     * @returns {number} tree pointer
+     */
+    layout(treeBytes) {
+        const arena = this.arena;
+        arena.reset();
+        const tree = arena.take(treeBytes, 4);
+        // 4 = pointer size, second 4 is because 4 nodes per level so we need to reserve enough space for the stack
+        this.stackPtr = arena.take(4 * 4 * this.options.QUADTREE_MAX_LEVEL, 4);
+        // Free memory after the traversal stack, used for select output, spawn_batch ids and bot brains
+        this.scratchPtr = arena.take(this.SCRATCH_SIZE, 8);
+        return tree;
+    }
+
+    serialize() {
+        this.treePtr = this.layout(this.tree.byteLength);
+        this.treeEnd = this.tree.serialize(this.arena.view, this.treePtr);
+    }
 
-        this.indices = offset >> 1;
+    /** Every alive bot decides in a single wasm pass, the commands are handed to the bots */
+    thinkBots() {
+        const bots = this.bots.filter(b => b.controller.alive);
+        if (!bots.length) return;
 
-        let ptr = this.indicesPtr;
-        for (let type = 0; type <= 250; type++) {
-            const s = this.counters[type].size;
-            s && this.wasm.sort_indices(0, ptr, s);
-            ptr += s << 1;
+        const o = this.options;
+        // BotBrain is 20 bytes: x, y, hw, hh (float) then id, split, action, pad
+        const ptr = this.scratchPtr;
+        const floats = new Float32Array(this.memory.buffer, ptr, bots.length * 5);
+        const bytes = new Uint8Array(this.memory.buffer, ptr, bots.length * 20);
+
+        for (let i = 0; i < bots.length; i++) {
+            const c = bots[i].controller;
+            floats[i * 5] = c.viewportX;
+            floats[i * 5 + 1] = c.viewportY;
+            floats[i * 5 + 2] = c.viewportHW * o.BOT_VIEW_SCALE;
+            floats[i * 5 + 3] = c.viewportHH * o.BOT_VIEW_SCALE;
+            bytes[i * 20 + 16] = c.id;
         }
 
-        this.treePtr = this.indicesPtr + offset;
-        this.treeBuffer = new DataView(this.memory.buffer, this.treePtr);
-    }
+        this.wasm.bot_think(0, this.listsPtr, this.treePtr, this.stackPtr, ptr, bots.length,
+            o.EAT_MULT, o.BOT_SPLIT_REACH, o.VIRUS_SIZE, o.PLAYER_MAX_CELLS, o.MAP_HW, o.MAP_HH);
 
-    serialize() {
-        this.stackPtr = this.tree.serialize(this.treeBuffer) + this.treePtr;
+        for (let i = 0; i < bots.length; i++)
+            bots[i].command(floats[i * 5], floats[i * 5 + 1], bytes[i * 20 + 17], bytes[i * 20 + 18]);
     }
 
     /** @param {Controller} controller */
     query(controller) {
         if (!controller) return [];
-        // 4 = pointer size, second 4 is because 4 nodes per level so we need to reserve enough space for the stack
-        let listPtr = this.stackPtr + 4 * 4 * this.options.QUADTREE_MAX_LEVEL;
-        listPtr % 2 && listPtr++; // Multiple of 2
+        const listPtr = this.scratchPtr;
 
         const length = this.wasm.select(0, this.treePtr, 
             this.stackPtr, listPtr,
             controller.viewportX - controller.viewportHW, controller.viewportX + controller.viewportHW,
             controller.viewportY - controller.viewportHH, controller.viewportY + controller.viewportHH);
         
-        return new Uint16Array(this.memory.buffer, listPtr, length);
+        return new this.IDArray(this.memory.buffer, listPtr, length);
     }
 }
 
@@ -1,27 +1,33 @@
+const { Fields: { X, Y, R } } = require("./cell");
+
 /**
- * @param {import("./cell")} cell
+ * @param {Float32Array} f32 cell floats
+ * @param {number} i float index of the cell (id * F)
  * @param {QuadNode} node
  */
-const getQuadrant = (cell, node) => {
-    if (cell.y - cell.r > node.y) {
-        if (cell.x + cell.r < node.x) return 0;
-        else if (cell.x - cell.r > node.x) return 1;
-    } else if (cell.y + cell.r < node.y) {
-        if (cell.x + cell.r < node.x) return 2;
-        else if (cell.x - cell.r > node.x) return 3;
+const getQuadrant = (f32, i, node) => {
+    const x = f32[i + X], y = f32[i + Y], r = f32[i + R];
+    if (y - r > node.y) {
+        if (x + r < node.x) return 0;
+        else if (x - r > node.x) return 1;
+    } else if (y + r < node.y) {
+        if (x + r < node.x) return 2;
+        else if (x - r > node.x) return 3;
     }
     return -1;
 }
 
 /**
- * @param {import("./cell")} cell
+ * @param {Float32Array} f32 cell floats
+ * @param {number} i float index of the cell (id * F)
  * @param {QuadNode} node
  */
-const insideQuad = (cell, node) => {
-    return cell.x - cell.r > node.l &&
-           cell.x + cell.r < node.r &&
-           cell.y + cell.r < node.t &&
-           cell.y - cell.r > node.b;
+const insideQuad = (f32, i, node) => {
+    const x = f32[i + X], y = f32[i + Y], r = f32[i + R];
+    return x - r > node.l &&
+           x + r < node.r &&
+           y + r < node.t &&
+           y - r > node.b;
 }
 
 /**
@@ -30,6 +36,7 @@ const insideQuad = (cell, node) => {
  * 4 childpointers (4 * 4 = 16 bytes)
  * count (2 bytes)
  * Total = 34 + 2 * items
+ * With 4 byte ids count is padded to 4 bytes, Total = 36 + 4 * items
  */
 
 class QuadNode {
@@ -73,16 +80,26 @@ class QuadNode {
             new QuadNode(this.tree, this.x - qw, this.y - qh, qw, qh, this),
             new QuadNode(this.tree, this.x + qw, this.y - qh, qw, qh, this),
         ];
+        this.tree.nodes += 4;
+        const { f32, F } = this.tree.cells;
+        const nodeOf = this.tree.nodeOf;
         for (const cell_id of this.items) {
-            const cell = this.tree.cells[cell_id];
-            const quadrant = getQuadrant(cell, this);
+            const quadrant = getQuadrant(f32, cell_id * F, this);
             if (quadrant < 0) continue;
             this.branches[quadrant].items.add(cell_id);
-            cell.__root = this.branches[quadrant];
+            nodeOf[cell_id] = this.branches[quadrant];
             this.items.delete(cell_id);
         }
     }
 
+    // Split until every new leaf is under the item limit
+    splitDeep() {
+        this.split();
+        if (!this.branches) return;
+        for (const branch of this.branches)
+            if (!branch.branches && branch.items.size >= this.tree.maxItems) branch.splitDeep();
+    }
+
     merge() {
         let node = this;
         while (node != null) {
@@ -92,12 +109,14 @@ class QuadNode {
                 node.branches[2].branches || node.branches[2].items.size ||
                 node.branches[3].branches || node.branches[3].items.size) return;
             node.branches = null;
+            this.tree.nodes -= 4;
         }
     }
 
     __serialize() {
         let ptr = this.__ptr = this.tree.__offset;
-        this.tree.__offset += 34 + 2 * this.items.size;
+        const idBytes = this.tree.idBytes;
+        this.tree.__offset += 32 + idBytes * (this.items.size + 1);
         
         const v = this.tree.__view;
         v.setFloat32(ptr, this.x, true);
@@ -115,13 +134,13 @@ class QuadNode {
             this.branches[2].__serialize();
             this.branches[3].__serialize();
 
-            v.setUint32(ptr, v.byteOffset + this.branches[0].__ptr, true);
+            v.setUint32(ptr, this.branches[0].__ptr, true);
             ptr += 4;
-            v.setUint32(ptr, v.byteOffset + this.branches[1].__ptr, true);
+            v.setUint32(ptr, this.branches[1].__ptr, true);
             ptr += 4;
-            v.setUint32(ptr, v.byteOffset + this.branches[2].__ptr, true);
+            v.setUint32(ptr, this.branches[2].__ptr, true);
             ptr += 4;
-            v.setUint32(ptr, v.byteOffset + this.branches[3].__ptr, true);
+            v.setUint32(ptr, this.branches[3].__ptr, true);
             ptr += 4;
         } else {
             v.setUint32(ptr, 0, true);
@@ -129,11 +148,18 @@ class QuadNode {
         }
 
         v.setUint16(ptr, this.items.size, true);
-        ptr += 2;
+        ptr += idBytes;
 
-        for (const cell_id of this.items) {
-            v.setUint16(ptr, cell_id, true);
-            ptr += 2;
+        if (idBytes === 4) {
+            for (const cell_id of this.items) {
+                v.setUint32(ptr, cell_id, true);
+                ptr += 4;
+            }
+        } else {
+            for (const cell_id of this.items) {
+                v.setUint16(ptr, cell_id, true);
+                ptr += 2;
+            }
         }
     }
 
@@ -157,91 +183,146 @@ class QuadNode {
     }
 }
 
+/**
+ * Broad phase over the flat cell store: positions are read from Cells' typed arrays by id, but the nodes are
+ * still objects holding a Set of ids each and nodeOf maps an id to its node object. Only the serialized copy
+ * (see serialize) is flat, that's what wasm queries
+ */
 class QuadTree {
 
     /**
-     * @param {import("./cell")[]} cells
+     * @param {import("./cell")} cells
      * @param {number} x
      * @param {number} y
      * @param {number} hw
      * @param {number} hh
      * @param {number} maxLevel 
      * @param {number} maxItems
+     * @param {number} idBytes serialized cell id size (2 or 4)
      */
-    constructor(cells, x, y, hw, hh, maxLevel, maxItems) {
+    constructor(cells, x, y, hw, hh, maxLevel, maxItems, idBytes = 2) {
         this.__offset = 0;
         this.cells = cells;
+        /** @type {QuadNode[]} node holding each cell id, null when the cell is not in the tree */
+        this.nodeOf = new Array(cells.limit).fill(null);
         this.root = new QuadNode(this, x, y, hw, hh, null);
         this.maxLevel = maxLevel;
         this.maxItems = maxItems;
+        this.idBytes = idBytes;
+        this.nodes = 1;
+        this.items = 0;
+    }
+
+    /** Size of the serialized tree */
+    get byteLength() {
+        return this.nodes * (32 + this.idBytes) + this.items * this.idBytes;
     }
 
-    /** @param {import("./cell")} cell */
-    insert(cell) {
-        if (cell.__root) console.log("INSERTING CELL ALREADY IN QUADTREE");
+    /** @param {number} id */
+    insert(id) {
+        if (this.nodeOf[id]) console.log("INSERTING CELL ALREADY IN QUADTREE");
+        const { f32, F } = this.cells;
+        const i = id * F;
         let node = this.root;
         while (true) {
             if (!node.branches) break;
-            const quadrant = getQuadrant(cell, node);
+            const quadrant = getQuadrant(f32, i, node);
             if (quadrant < 0) break;
             node = node.branches[quadrant];
         }
-        cell.__root = node;
-        node.items.add(cell.id);
+        this.nodeOf[id] = node;
+        node.items.add(id);
+        this.items++;
         node.split();
     }
 
-    /** @param {import("./cell")} cell */
-    remove(cell) {
-        if (!cell.__root) return console.log("REMOVING CELL NOT IN QUADTREE");
-        if (!cell.__root.items.delete(cell.id)) console.log("ITEM NOT IN QUAD??", cell.__root.items);
-        cell.__root.merge();
-        cell.__root = null;
+    /**
+     * Insert many cells at once, leaves are only split after all of them are placed
+     * @param {ArrayLike<number>} ids
+     */
+    insertBatch(ids) {
+        const { f32, F } = this.cells;
+        const nodeOf = this.nodeOf;
+        /** @type {Set<QuadNode>} */
+        const touched = new Set();
+        for (let j = 0; j < ids.length; j++) {
+            const id = ids[j];
+            const i = id * F;
+            let node = this.root;
+            while (true) {
+                if (!node.branches) break;
+                const quadrant = getQuadrant(f32, i, node);
+                if (quadrant < 0) break;
+                node = node.branches[quadrant];
+            }
+            nodeOf[id] = node;
+            node.items.add(id);
+            touched.add(node);
+        }
+        this.items += ids.length;
+        for (const node of touched) node.splitDeep();
+    }
+
+    /** @param {number} id */
+    remove(id) {
+        const node = this.nodeOf[id];
+        if (!node) return console.log("REMOVING CELL NOT IN QUADTREE");
+        if (!node.items.delete(id)) console.log("ITEM NOT IN QUAD??", node.items);
+        else this.items--;
+        node.merge();
+        this.nodeOf[id] = null;
     }
 
-    /** @param {import("./cell")} cell */
-    update(cell) {
-        if (!cell.__root) {
-            console.log(cell.toString());
+    /** @param {number} id */
+    update(id) {
+        const oldNode = this.nodeOf[id];
+        if (!oldNode) {
+            console.log(this.cells.toString(id));
             throw new Error("UPDATING CELL NOT IN QUADTREE");
         }
-        const oldNode = cell.__root;
-        let newNode = cell.__root;
+        const { f32, F } = this.cells;
+        const i = id * F;
+        let newNode = oldNode;
         while (true) {
             if (!newNode.root) break;
             newNode = newNode.root;
-            if (insideQuad(cell, newNode)) break;
+            if (insideQuad(f32, i, newNode)) break;
         }
         while (true) {
             if (!newNode.branches) break;
-            const quadrant = getQuadrant(cell, newNode);
+            const quadrant = getQuadrant(f32, i, newNode);
             if (quadrant < 0) break;
             newNode = newNode.branches[quadrant];
         }
         if (oldNode === newNode) return;
-        oldNode.items.delete(cell.id);
-        newNode.items.add(cell.id);
-        cell.__root = newNode;
+        oldNode.items.delete(id);
+        newNode.items.add(id);
+        this.nodeOf[id] = newNode;
         oldNode.merge();
         newNode.split();
     }
 
     /**
-     * Swap cell1 (in the tree) with new cell2
-     * @param {import("./cell")} cell1 
-     * @param {import("./cell")} cell2 
+     * Swap id1 (in the tree) with new id2
+     * @param {number} id1
+     * @param {number} id2
      */
-    swap(cell1, cell2) {
-        cell2.__root = cell1.__root;
-        cell2.__root.items.delete(cell1.id);
-        cell2.__root.items.add(cell2.id);
-        cell1.__root = null;
+    swap(id1, id2) {
+        const node = this.nodeOf[id2] = this.nodeOf[id1];
+        node.items.delete(id1);
+        node.items.add(id2);
+        this.nodeOf[id1] = null;
     }
 
-    /** @param {DataView} view */
-    serialize(view) {
+    /**
+     * Write the tree at ptr, child pointers are absolute (the view covers the whole memory)
+     * @param {DataView} view
+     * @param {number} ptr
+     * @returns {number} write end
+     */
+    serialize(view, ptr) {
         this.__view = view;
-        this.__offset = 0;
+        this.__offset = ptr;
         this.root.__serialize();
 
         const end = this.__offset;
@@ -0,0 +1,436 @@
+const os = require("os");
+const net = require("net");
+const path = require("path");
+
+const Handle = require("../game/handle");
+const Controller = require("../game/controller");
+const Writer = require("../network/writer");
+const Reader = require("../network/reader");
+const { Fields: { X, Y, R, AGE, BOOST_X, BOOST_Y, BOOST } } = require("./cell");
+
+const pipename = str => process.platform == "win32" ? `\\\\.\\pipe\\${str.replace(/^\//, "").replace(/\//g, "-")}` : str;
+
+// Frames are written through the 1mb writer pool: 30000 ghosts (17 bytes) and 8192 migrations (29 bytes)
+// leave ~290kb for the player infos, handoffs and acks. Migrations and handoffs over the cap wait for the next frame
+const MAX_FRAME_GHOSTS = 30000;
+const MAX_FRAME_MIGRATIONS = 8192;
+const MAX_FRAME_HANDOFFS = 16;
+// Cell record of a migration or handoff (see writeCell)
+const CELL_BYTES = 28;
+
+/**
+ * Player owned by a neighbour region, only here so its ghost cells
+ * have a local player id with the right name and skin
+ */
+class RemotePlayer extends Handle {
+
+    /** @param {import("../game")} game */
+    constructor(game, name = "", skin = "") {
+        super(game);
+        this.join();
+        if (!this.controller) return;
+        this.controller.name = name;
+        this.controller.skin = skin;
+        this.game.emit("join", this.controller);
+    }
+
+    setInfo(name, skin) {
+        const c = this.controller;
+        if (c.name == name && c.skin == skin) return;
+        c.name = name;
+        c.skin = skin;
+        this.game.emit("info", c);
+    }
+
+    calculateViewport() {};
+}
+
+/**
+ * One region of a map split into a cols x rows grid, each region simulated by its own process.
+ *
+ * The region owns the non player cells whose center is inside its rect and the players connected to it.
+ * Every tick it sends each neighbour, over a unix socket:
+ * - ghosts: its cells within the ghost margin of the neighbour, shown there read only
+ * - migrations: non player cells that moved into the neighbour's rect
+ * - handoffs: players whose viewport moved into the neighbour's rect, their client is redirected there
+ *   once the neighbour acks that it took the player (the ack comes back in its next frame, a full neighbour
+ *   refuses it). The player keeps its cells here until then, so its client never sees it die on the way
+ *
+ * Cells only interact with cells of the same region. Ghosts are skipped by resolve (see Cells.ghost), so a player
+ * can't eat, push or be eaten by a neighbour's cell until it is handed off. That band is bounded by the handoff
+ * distance past the border, a smaller one narrows it at the cost of players bouncing between regions
+ */
+module.exports = class Region {
+
+    /**
+     * @param {import("../game")} game
+     * @param {Object} config
+     * @param {number} config.index region index, row major
+     * @param {number} config.cols
+     * @param {number} config.rows
+     * @param {string[]} config.endpoints client endpoint (port/path) of every region, for handoffs
+     * @param {string} [config.key] shared by the regions of one map, names the sockets
+     * @param {number} [config.margin] ghost margin
+     * @param {number} [config.handoff] how far past the border a player's view center goes before it's handed off,
+     * a quarter margin by default
+     * @param {string} [config.dir] socket directory
+     */
+    constructor(game, { index, cols, rows, endpoints, key = "map", margin = 2000, handoff = margin / 4, dir = os.tmpdir() }) {
+        this.game = game;
+        this.engine = game.engine;
+        this.index = index;
+        this.cols = cols;
+        this.rows = rows;
+        this.endpoints = endpoints;
+        this.margin = margin;
+        this.handoff = handoff;
+        this.socketPath = i => pipename(path.resolve(dir, `ogarx-${key}-region-${i}.sock`));
+
+        /** @type {Map<number, net.Socket>} outbound link per neighbour */
+        this.links = new Map();
+        /** @type {ArrayBuffer[]} frames received since the last exchange */
+        this.inbox = [];
+        /** @type {Map<number, Map<number, number>>} neighbour -> (their cell id -> local ghost id) */
+        this.ghosts = new Map();
+        /** @type {Map<number, Map<number, RemotePlayer>>} neighbour -> (their player id -> local stand in) */
+        this.players = new Map();
+        /** Local ids holding ghosts */
+        this.isGhost = new Uint8Array(this.engine.CELL_LIMIT);
+        /** @type {Map<string, { p: import("../network/protocols/ogarx"), index: number, spawn: number }>} uid -> handed off, not acked yet */
+        this.handoffs = new Map();
+        /** @type {Map<number, { uid: string, taken: boolean }[]>} neighbour -> handoffs from it, answered in the next frame */
+        this.acks = new Map();
+        /** @type {Map<number, number>} controller reserved for a player taken from a neighbour -> that neighbour */
+        this.taken = new Map();
+
+        this.engine.region = this;
+        this.engine.bindIdGrid();
+    }
+
+    /** [l, r, b, t] of a region */
+    rectOf(index) {
+        const o = this.engine.options;
+        const w = 2 * o.MAP_HW / this.cols;
+        const h = 2 * o.MAP_HH / this.rows;
+        const l = -o.MAP_HW + (index % this.cols) * w;
+        const b = -o.MAP_HH + ~~(index / this.cols) * h;
+        return [l, l + w, b, b + h];
+    }
+
+    get rect() { return this.rectOf(this.index); }
+
+    /** Region owning a point, edges of the map belong to the outer regions */
+    regionAt(x, y) {
+        const o = this.engine.options;
+        const col = Math.min(Math.max(~~((x + o.MAP_HW) / (2 * o.MAP_HW) * this.cols), 0), this.cols - 1);
+        const row = Math.min(Math.max(~~((y + o.MAP_HH) / (2 * o.MAP_HH) * this.rows), 0), this.rows - 1);
+        return row * this.cols + col;
+    }
+
+    open() {
+        this.server = net.createServer(sock => {
+            /** @type {Buffer} */
+            let pending = Buffer.alloc(0);
+            sock.on("data", chunk => {
+                pending = pending.length ? Buffer.concat([pending, chunk]) : chunk;
+                while (pending.length >= 4) {
+                    const length = pending.readUInt32LE(0);
+                    if (pending.length < 4 + length) break;
+                    const frame = pending.subarray(4, 4 + length);
+                    this.inbox.push(frame.buffer.slice(frame.byteOffset, frame.byteOffset + frame.byteLength));
+                    pending = pending.subarray(4 + length);
+                }
+            }).on("error", () => {});
+        }).listen(this.socketPath(this.index));
+
+        for (let i = 0; i < this.cols * this.rows; i++) if (i != this.index) this.connect(i);
+    }
+
+    /** @param {number} index */
+    connect(index) {
+        const sock = net.connect(this.socketPath(index))
+            .on("connect", () => this.links.set(index, sock))
+            .on("error", () => {})
+            .on("close", () => {
+                this.links.delete(index);
+                this.forget(index);
+                this.acks.delete(index);
+                // Never acked, the players stay here with the cells they kept
+                for (const [uid, pending] of this.handoffs) if (pending.index == index) this.handoffs.delete(uid);
+                this.closed || setTimeout(() => this.connect(index), 1000);
+            });
+    }
+
+    close() {
+        this.closed = true;
+        for (const sock of this.links.values()) sock.destroy();
+        this.server && this.server.close();
+        this.clearGhosts();
+    }
+
+    exchange() {
+        for (const frame of this.inbox.splice(0)) this.receive(frame);
+        for (const [index, sock] of this.links) {
+            const frame = Buffer.from(this.frameFor(index));
+            const header = Buffer.alloc(4);
+            header.writeUInt32LE(frame.length, 0);
+            sock.write(header);
+            sock.write(frame);
+        }
+    }
+
+    /** @param {number} index neighbour */
+    frameFor(index) {
+        const e = this.engine;
+        const [l, r, b, t] = this.rectOf(index);
+        const m = this.margin;
+
+        // Players whose view center went past the border (by the handoff distance, so they don't bounce back)
+        const q = this.handoff;
+        const handoffs = this.game.controls.filter(c => {
+            const h = c.handle;
+            if (!c.alive || !h || !h.ws || !h.uid || h.dual || !h.sendRedirect || this.handoffs.has(h.uid)) return false;
+            return c.viewportX > l + q && c.viewportX < r - q && c.viewportY > b + q && c.viewportY < t - q;
+        }).slice(0, MAX_FRAME_HANDOFFS);
+
+        // Players the neighbour has its own copy of, not ghosted there: handed off to it and waiting for the ack,
+        // or taken from it and waiting for the client
+        const withheld = new Set(handoffs.map(c => c.id));
+        for (const { p, index: to } of this.handoffs.values()) if (to == index && p.controller) withheld.add(p.controller.id);
+        for (const [id, from] of this.taken) {
+            if (this.game.controls[id].handle || !this.game.isReserved(id)) this.taken.delete(id);
+            else if (from == index) withheld.add(id);
+        }
+
+        // Our cells near (or in) the neighbour
+        const count = e.wasm.select(0, e.treePtr, e.stackPtr, e.scratchPtr, l - m, r + m, b - m, t + m);
+        const selected = new e.IDArray(e.memory.buffer, e.scratchPtr, count);
+
+        /** @type {number[]} */
+        const ghosts = [];
+        /** @type {number[]} non player cells whose center crossed into the neighbour */
+        const migrations = [];
+        /** @type {Set<number>} */
+        const players = new Set();
+        const cells = e.cells;
+        for (let i = 0; i < selected.length; i++) {
+            const id = selected[i];
+            const type = cells.type(id);
+            if (this.isGhost[id] || !cells.existsStrict(id) || withheld.has(type)) continue;
+            if (type > 250 && this.regionAt(cells.x(id), cells.y(id)) == index) {
+                migrations.length < MAX_FRAME_MIGRATIONS && migrations.push(id);
+            } else if (ghosts.length < MAX_FRAME_GHOSTS) {
+                ghosts.push(id);
+                if (type <= 250) players.add(type);
+            }
+        }
+
+        const writer = new Writer();
+        writer.writeUInt8(this.index);
+
+        writer.writeUInt8(players.size);
+        for (const id of players) {
+            const c = this.game.controls[id];
+            writer.writeUInt8(id);
+            writer.writeUTF16String(c.__name);
+            writer.writeUTF16String(c.__skin);
+        }
+
+        writer.writeUInt32(ghosts.length);
+        for (const id of ghosts) {
+            writer.writeUInt32(id);
+            writer.writeFloat32(cells.x(id));
+            writer.writeFloat32(cells.y(id));
+            writer.writeFloat32(cells.r(id));
+            writer.writeUInt8(cells.type(id));
+        }
+
+        writer.writeUInt16(migrations.length);
+        for (const id of migrations) {
+            writer.writeUInt8(cells.type(id));
+            this.writeCell(writer, id);
+        }
+
+        const now = performance.now();
+        writer.writeUInt8(handoffs.length);
+        for (const c of handoffs) {
+            writer.writeUTF8String(c.handle.uid);
+            c.serialize(writer, now);
+            const ids = e.cellsOf(c.id);
+            writer.writeUInt16(ids.length);
+            for (const id of ids) this.writeCell(writer, id);
+        }
+
+        const acks = this.acks.has(index) ? this.acks.get(index).splice(0, 255) : [];
+        writer.writeUInt8(acks.length);
+        for (const { uid, taken } of acks) {
+            writer.writeUTF8String(uid);
+            writer.writeUInt8(taken ? 1 : 0);
+        }
+
+        // Side effects only after finalize, they write packets through the same writer pool
+        const frame = writer.finalize();
+
+        for (const id of migrations) e.dropCell(id);
+        // The cells stay until the neighbour acks, the client is redirected then
+        for (const c of handoffs) this.handoffs.set(c.handle.uid, { p: c.handle, index, spawn: c.lastSpawnTick });
+
+        return frame;
+    }
+
+    /**
+     * Neighbour holds the player's controller, send the client over
+     * @param {string} uid
+     */
+    redirect(uid) {
+        const pending = this.handoffs.get(uid);
+        if (!pending) return;
+        this.handoffs.delete(uid);
+        const { p, index, spawn } = pending;
+        const ws = p.ws;
+        const c = p.controller;
+        // Closed, died or respawned meanwhile, the neighbour drops the reserved controller when it times out
+        if (!ws || p.uid !== uid || !c || !c.alive || c.lastSpawnTick !== spawn) return;
+        // The neighbour's copy takes over
+        for (const id of this.engine.cellsOf(c.id)) this.engine.dropCell(id);
+        p.sendRedirect(this.endpoints[index]);
+        // Off without a socket close handling, the cells are on the neighbour
+        ws.p = null;
+        p.off();
+        ws.end(1000, "Region handoff");
+    }
+
+    /**
+     * @param {Writer} writer
+     * @param {number} id
+     */
+    writeCell(writer, id) {
+        const { f32, F } = this.engine.cells;
+        const i = id * F;
+        writer.writeFloat32(f32[i + X]);
+        writer.writeFloat32(f32[i + Y]);
+        writer.writeFloat32(f32[i + R]);
+        writer.writeFloat32(f32[i + BOOST_X]);
+        writer.writeFloat32(f32[i + BOOST_Y]);
+        writer.writeFloat32(f32[i + BOOST]);
+        writer.writeFloat32(f32[i + AGE]);
+    }
+
+    /**
+     * @param {Reader} reader
+     * @param {number} type
+     */
+    readCell(reader, type) {
+        const e = this.engine;
+        const x = reader.readFloat32(), y = reader.readFloat32(), r = reader.readFloat32();
+        const bx = reader.readFloat32(), by = reader.readFloat32(), boost = reader.readFloat32();
+        const age = reader.readFloat32();
+        const id = e.newCell(x, y, r, type, bx, by, boost);
+        if (id) e.cells.f32[id * e.cells.F + AGE] = age;
+    }
+
+    /** @param {ArrayBuffer} frame */
+    receive(frame) {
+        const e = this.engine;
+        const reader = new Reader(new DataView(frame));
+        const from = reader.readUInt8();
+
+        const players = this.players.get(from) || new Map();
+        this.players.set(from, players);
+        /** @type {Set<number>} */
+        const seen = new Set();
+        for (let n = reader.readUInt8(); n > 0; n--) {
+            const id = reader.readUInt8();
+            const name = reader.readUTF16String();
+            const skin = reader.readUTF16String();
+            seen.add(id);
+            const p = players.get(id);
+            if (p) p.setInfo(name, skin);
+            else if (this.game.canAccept()) {
+                const remote = new RemotePlayer(this.game, name, skin);
+                if (remote.controller) players.set(id, remote);
+                else remote.off();
+            }
+        }
+
+        const ghosts = this.ghosts.get(from) || new Map();
+        this.ghosts.set(from, ghosts);
+        /** @type {Map<number, number>} */
+        const next = new Map();
+        for (let n = reader.readUInt32(); n > 0; n--) {
+            const remote = reader.readUInt32();
+            const x = reader.readFloat32(), y = reader.readFloat32(), r = reader.readFloat32();
+            let type = reader.readUInt8();
+            if (type <= 250) {
+                const p = players.get(type);
+                if (!p) continue;
+                type = p.controller.id;
+            }
+            let id = ghosts.get(remote);
+            if (id) {
+                ghosts.delete(remote);
+                e.updateGhost(id, x, y, r, type);
+            } else if (id = e.newGhost(x, y, r, type)) this.isGhost[id] = 1;
+            id && next.set(remote, id);
+        }
+        for (const id of ghosts.values()) this.removeGhost(id);
+        this.ghosts.set(from, next);
+
+        for (const [id, p] of players) if (!seen.has(id)) {
+            p.off();
+            players.delete(id);
+        }
+
+        for (let n = reader.readUInt16(); n > 0; n--) this.readCell(reader, reader.readUInt8());
+
+        const acks = this.acks.get(from) || [];
+        this.acks.set(from, acks);
+        for (let n = reader.readUInt8(); n > 0; n--) {
+            const uid = reader.readUTF8String();
+            // Reserve a controller for the client, it reconnects here with its uid. Refused when full,
+            // the player stays on the neighbour and its record is read past
+            const id = this.game.canAccept() ? this.game.freeId() : 0;
+            const c = id ? this.game.controls[id] : new Controller(e);
+            c.deserialize(reader, performance.now());
+            for (let cells = reader.readUInt16(); cells > 0; cells--) id ? this.readCell(reader, id) : reader.skip(CELL_BYTES);
+            if (id) {
+                this.game.resumes.set(uid, { main: id, dual: 0, time: performance.now() });
+                this.taken.set(id, from);
+            }
+            acks.push({ uid, taken: !!id });
+        }
+
+        for (let n = reader.readUInt8(); n > 0; n--) {
+            const uid = reader.readUTF8String();
+            // Refused, the player carries on here and may be handed off again
+            reader.readUInt8() ? this.redirect(uid) : this.handoffs.delete(uid);
+        }
+    }
+
+    /** @param {number} id */
+    removeGhost(id) {
+        this.engine.removeGhost(id);
+        this.isGhost[id] = 0;
+    }
+
+    /** Drop everything received from a neighbour */
+    forget(index) {
+        const ghosts = this.ghosts.get(index);
+        if (ghosts) for (const id of ghosts.values()) this.removeGhost(id);
+        this.ghosts.delete(index);
+        const players = this.players.get(index);
+        if (players) for (const p of players.values()) p.off();
+        this.players.delete(index);
+    }
+
+    clearGhosts() {
+        for (const index of [...this.ghosts.keys()]) this.forget(index);
+    }
+
+    /** Engine memory was cleared, the ghost ids point to nothing (or to new cells) now */
+    reset() {
+        this.ghosts.clear();
+        this.isGhost.fill(0);
+        this.taken.clear();
+    }
+}
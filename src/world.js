@@ -0,0 +1,34 @@
+const { workerData, parentPort } = require("worker_threads");
+
+const Server = require("./network/thread-server");
+const OgarXProtocol = require("./network/protocols/ogarx");
+
+/** 
+ * @type {{ name: string, mode: string, endpoint: string, snapshot: string, pool: number,
+ *  core: WebAssembly.Module, protocol: WebAssembly.Module, wide: boolean,
+ *  io: ReturnType<typeof import("./network/world-io").create> }} 
+ */
+const { name, mode, endpoint, snapshot, pool, core, protocol, wide, io } = workerData;
+
+const server = new Server(name, io);
+const engine = server.game.engine;
+
+server.setGameMode(mode || "default");
+
+parentPort.on("message", data => {
+    if (data.event !== "shutdown") return;
+    engine.stop();
+    server.saveSnapshot(snapshot);
+    server.close();
+    process.exit(0); // only ends this thread
+});
+
+(async () => {
+    await engine.init(core);
+    await OgarXProtocol.init(protocol, pool, wide);
+
+    server.loadSnapshot(snapshot);
+    server.open(endpoint);
+    engine.start();
+    parentPort.postMessage({ event: "ready" });
+})();
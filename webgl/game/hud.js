@@ -50,7 +50,8 @@ module.exports = class HUD {
                 mouse: this.mouse.sharedBuffer, 
                 state: this.state.sharedBuffer,
                 viewport: this.viewport.sharedBuffer,
-                dual: this.options.borderColors
+                dual: this.options.borderColors,
+                wide: new URLSearchParams(location.search).has("wide")
             };
     
             this.worker.postMessage(initObject, [offscreen]);
@@ -307,7 +308,7 @@ module.exports = class HUD {
             }
             
             source.addEventListener("servers", event => {
-                /** @type {{ servers: { uid: number, name: string, endpoint: string, bot: number, players: number, total: number, load: number }[]}} */
+                /** @type {{ servers: { uid: number, name: string, endpoint: string, bot: number, players: number, total: number, load: number, rank?: number }[]}} */
                 const data = { servers: JSON.parse(event.data) };
 
                 let totalUsage = 0;
@@ -358,6 +359,11 @@ module.exports = class HUD {
 
                 text.textContent = ~~totalUsage + "%";
 
+                // Recommended server on top (gateways ranking by tick load)
+                data.servers.filter(s => typeof s.rank == "number" && servers.has(s.uid))
+                    .sort((a, b) => a.rank - b.rank)
+                    .forEach(s => list.appendChild(servers.get(s.uid)));
+
                 for (const [k, v] of [...servers.entries()]) {
                     if (!data.servers.some(s => s.uid == k)) {
                         servers.delete(k);
@@ -10,7 +10,8 @@ const DEFAULT = {
     text_quality: 1,
     circle_quality: 1,
     ignore_skin: 0,
-    mouse_sync: 0
+    mouse_sync: 0,
+    predict: 0
 };
 const OPTION_KEYS = Object.keys(DEFAULT);
 
@@ -24,6 +25,7 @@ const MultiChoice = {
     text_quality: ["High", "Medium", "Low", "Laptop"],
     circle_quality: ["High", "Medium", "Low", "Laptop"],
     ignore_skin: ["Disabled", "Enabled"],
+    predict: ["Disabled", "Enabled"],
     // mouse_sync: ["Disabled", "Enabled"]
 }
 
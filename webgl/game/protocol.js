@@ -12,12 +12,14 @@ const PREVIEW_WIDTH = 1920 >> 2;
 const PREVIEW_HEIGHT = 1080 >> 2;
 const REPLAY_PREVIEW_FPS = 5;
 const REPLAY_LENGTH = 20;
+// Subprotocol asking the server for no deflate, cells come packed (OP 13) over the network
+const PACKED_PROTOCOL = "ogarx-packed";
 
 class ReplaySnapshot {
-    constructor(length = 0) {
+    constructor() {
         this.score = 0;
-        this.state = new ArrayBuffer(length);
-        this.view = new Uint8Array(this.state);
+        /** @type {ArrayBuffer} dense list of active cells from snapshot_cells */
+        this.state = null;
 
         /** @type {number[]} */
         this.packetTimestamps = [];
@@ -50,7 +52,7 @@ class ReplaySystem {
         this.renderer = renderer;
 
         this.source = new Uint8Array(renderer.core.buffer, 0, renderer.INDICES_OFFSET);
-        this.snapshots = Array.from({ length: length * REPLAY_PREVIEW_FPS }, _ => new ReplaySnapshot(this.source.byteLength));
+        this.snapshots = Array.from({ length: length * REPLAY_PREVIEW_FPS }, _ => new ReplaySnapshot());
         
         const pool = this.sharedArrayBuffer = new SharedArrayBuffer(this.snapshots.length * PREVIEW_WIDTH * PREVIEW_HEIGHT * 4);
         console.log(`${(pool.byteLength / 1024 / 1024).toFixed(1)}MB preview buffer allocated for GIF generation`);
@@ -79,12 +81,27 @@ class ReplaySystem {
         return writer.finalize();
     }
 
+    /** Pack the active cells into a compact buffer */
+    snapshotState() {
+        const r = this.renderer;
+        const end = r.wasm.snapshot_cells(0, r.SNAPSHOT_OFFSET);
+        return r.core.buffer.slice(r.SNAPSHOT_OFFSET, end);
+    }
+
+    /** @param {ArrayBuffer} state */
+    restoreState(state) {
+        const r = this.renderer;
+        r.core.HEAPU8.set(new Uint8Array(state), r.SNAPSHOT_OFFSET);
+        r.wasm.restore_cells(0, r.SNAPSHOT_OFFSET);
+    }
+
     /** @param {ArrayBuffer} state */
     encodeState(state) {
-        const oldState = this.source.slice();
-        this.source.set(new Uint8Array(state));
+        const oldState = this.snapshotState();
+        // No snapshot recorded yet, start from an empty world (0 id terminator only)
+        this.restoreState(state || new ArrayBuffer(4));
         const buffer = this.renderer.serializeState();
-        this.source.set(oldState);
+        this.restoreState(oldState);
         return buffer;
     }
 
@@ -144,7 +161,7 @@ class ReplaySystem {
         const tail = this.snapshots.pop();
         this.free(tail);
         this.snapshots.unshift(tail);
-        tail.view.set(this.source);
+        tail.state = this.snapshotState();
         this.score = this.renderer.stats.score;
         this.requestPreview = true;
     }
@@ -167,7 +184,7 @@ class ReplaySystem {
     free(snapshot) {
         this.renderer.loader.postMessage(snapshot.packets, snapshot.packets);
         snapshot.score = 0;
-        snapshot.view.fill(0);
+        snapshot.state = null;
         snapshot.packets = [];
         snapshot.packetTimestamps = [];
     }
@@ -224,7 +241,7 @@ class ReplaySystem {
     }
 }
 
-const RecordOPs = [2, 4];
+const RecordOPs = [2, 4, 13];
 
 module.exports = class Protocol extends EventEmitter {
     
@@ -232,10 +249,13 @@ module.exports = class Protocol extends EventEmitter {
     constructor(renderer) {
         super();
         this.pid = 0;
+        this.lbRank = -1;
         this.bandwidth = 0;
         this.renderer = renderer;
         this.replay = new ReplaySystem(renderer, this, REPLAY_LENGTH);
         this.map = { hw: 10000, hh: 10000 };
+        /** Server movement constants, tick in ms of wall time (simulated dt is tick * scale), speed 0 turns own cell prediction off */
+        this.motion = { tick: 50, speed: 0, scale: 1 };
         this.setupIntervals();
         this.onMessage = this.onMessage.bind(this);
     }
@@ -253,7 +273,8 @@ module.exports = class Protocol extends EventEmitter {
     connect(urlOrPort, uid="", name = "", skin1 = "", skin2 = "") {
 
         this.disconnect();
-        const currWs = this.ws = (typeof urlOrPort == "string") ? new WebSocket(`${urlOrPort}?${uid}`) : new FakeSocket(urlOrPort);
+        this.profile = { name, skin1, skin2 };
+        const currWs = this.ws = (typeof urlOrPort == "string") ? new WebSocket(`${urlOrPort}?${uid}`, PACKED_PROTOCOL) : new FakeSocket(urlOrPort);
         this.ws.binaryType = "arraybuffer";
 
         this.ws.onopen = () => {
@@ -265,6 +286,8 @@ module.exports = class Protocol extends EventEmitter {
             writer.writeUTF16String(name);
             writer.writeUTF16String(skin1);
             writer.writeUTF16String(skin2);
+            // Flags, bit 0 = 32 bit cell ids, bit 1 = packed cells instead of deflate (over the network only)
+            writer.writeUInt8((this.renderer.ID_BYTES === 4 ? 1 : 0) | (currWs instanceof WebSocket ? 2 : 0));
             this.ws.send(writer.finalize());
             this.emit("open");
 
@@ -364,7 +387,12 @@ module.exports = class Protocol extends EventEmitter {
                 this.map.hh = reader.readUInt16();
                 console.log(`Map Dimension: ${this.map.hw << 1}x${this.map.hh << 1}`);
                 const server = reader.readUTF16String();
-                const uid = reader.readUTF8String();
+                const uid = this.uid = reader.readUTF8String();
+                this.motion = reader.EOF ? { tick: 50, speed: 0, scale: 1 } : {
+                    tick: reader.readFloat32(),
+                    speed: reader.readFloat32(),
+                    scale: reader.readFloat32()
+                };
                 this.emit("protocol");
                 if (!this.replaying) self.postMessage({ event: "connect", server, uid });
                 break;
@@ -380,6 +408,9 @@ module.exports = class Protocol extends EventEmitter {
             case 4:
                 this.parseCellData(e.data);
                 break;
+            case 13:
+                this.parseCellData(e.data, true);
+                break;
             // Leaderboard
             case 5:
                 this.parseLeaderboard(reader);
@@ -397,6 +428,10 @@ module.exports = class Protocol extends EventEmitter {
                     this.send(RESPAWN);
                 }
                 break;
+            // Leaderboard rank, only sent when it changes
+            case 8:
+                this.lbRank = reader.readInt16();
+                break;
             // Chat
             case 10:
                 self.postMessage({ event: "chat", message: reader.readUTF16String() });
@@ -405,6 +440,18 @@ module.exports = class Protocol extends EventEmitter {
             case 11:
                 self.postMessage({ event: "server-log", message: reader.readUTF16String() });
                 break;
+            // Region redirect, reconnect with the same uid to port/path on this host
+            case 12: {
+                if (!(this.ws instanceof WebSocket)) break;
+                const [port, path = ""] = reader.readUTF8String().split("/");
+                const url = new URL(this.ws.url);
+                url.port = port;
+                url.pathname = `/${path}`;
+                url.search = "";
+                const { name, skin1, skin2 } = this.profile;
+                this.connect(url.toString().replace(/\/$/, ""), this.uid, name, skin1, skin2);
+                return;
+            }
             // PONG
             case 69:
                 if (!this.ping) return;
@@ -437,8 +484,11 @@ module.exports = class Protocol extends EventEmitter {
         }
     }
 
-    /** @param {ArrayBuffer} buffer */
-    parseCellData(buffer) {
+    /** 
+     * @param {ArrayBuffer} buffer
+     * @param {boolean} packed OP 13, unpacked into the OP 4 body first
+     */
+    parseCellData(buffer, packed = false) {
         this.lastPacket = this.renderer.lastTimestamp;
 
         const r = this.renderer;
@@ -456,15 +506,24 @@ module.exports = class Protocol extends EventEmitter {
         r.target.position[0] = header.getFloat32(16, true);
         r.target.position[1] = header.getFloat32(20, true);
         
-        core.HEAPU8.set(new Uint8Array(buffer, 25), r.INDICES_OFFSET);                 
+        if (packed) {
+            core.HEAPU8.set(new Uint8Array(buffer), r.PACKED_OFFSET);
+            const work = (r.PACKED_OFFSET + buffer.byteLength + 3) & ~3;
+            core.instance.exports.unpack(r.PACKED_OFFSET, buffer.byteLength, work, r.INDICES_OFFSET);
+        } else core.HEAPU8.set(new Uint8Array(buffer, 25), r.INDICES_OFFSET);                 
         core.instance.exports.deserialize(0, r.INDICES_OFFSET);
+
+        const m = this.motion;
+        if (r.state.predict && m.speed && this.pid && !this.replaying && !r.stats.linelocked) {
+            core.instance.exports.predict_cells(0, this.pid,
+                r.cursor.position[0], r.cursor.position[1], m.speed, m.tick * m.scale);
+        }
     }
 
     /** @param {Reader} reader */
     parseLeaderboard(reader) {
-        const rank = reader.readInt16();
         const count = reader.readUInt8();
-        const lb = { rank, me: this.player, players: [] }
+        const lb = { rank: this.lbRank, me: this.player, players: [] }
         for (let i = 0; i < count; i++) lb.players.push(
             this.renderer.playerData[reader.readUInt8()]);
         self.postMessage({ event: "leaderboard", lb });
@@ -25,7 +25,6 @@ const MASS_SCALE = 0.25;
 const MASS_Y_OFFSET = -0.33;
 
 // Constants
-const CELL_LIMIT = 1 << 16; // 65536
 
 const MASS_CHARS       = "0123456789.k".split("");
 const MASS_CHARS_COUNT = MASS_CHARS.length;
@@ -148,7 +147,7 @@ class Renderer {
         gl.enable(gl.BLEND);
 
         // console.log("Loading WASM...");
-        await this.core.load();
+        await this.core.load(1024, this.wideIDs);
         this.wasm = this.core.instance.exports;
 
         // console.log("Loading font");
@@ -168,9 +167,21 @@ class Renderer {
         this.IGNORE_SKIN = this.state.ignore_skin;
         this.CIRCLE_RADIUS = this.state.circle_radius;
 
+        const CELL_LIMIT = this.CELL_LIMIT = this.wasm.cell_limit();
+        this.ID_BYTES = this.wasm.cell_id_bytes();
         this.BYTES_PER_CELL_DATA = this.wasm.bytes_per_cell_data();
-        this.INDICES_OFFSET = CELL_LIMIT * this.BYTES_PER_CELL_DATA;
-        this.PELLETS_OFFSET = this.INDICES_OFFSET + CELL_LIMIT * 3;
+        // Cell data is one array per field (see client.c), float index of the drawn x, y and size arrays
+        this.CURR_X = CELL_LIMIT * 4;
+        this.CURR_Y = CELL_LIMIT * 5;
+        this.CURR_SIZE = CELL_LIMIT * 6;
+        // The table ends with the live id range, then a word update_cells writes the pellet count to
+        this.PELLET_COUNT_OFFSET = this.wasm.cell_data_bytes();
+        this.INDICES_OFFSET = this.PELLET_COUNT_OFFSET + 4;
+        this.PELLETS_OFFSET = this.INDICES_OFFSET + CELL_LIMIT * (this.ID_BYTES + 1);
+        // After the pellet indices and vertices, dense clip snapshots are packed here
+        this.SNAPSHOT_OFFSET = this.PELLETS_OFFSET + CELL_LIMIT * (this.ID_BYTES + 72);
+        // Packed cells packets (OP 13) are copied after the largest snapshot, their work area follows them
+        this.PACKED_OFFSET = this.SNAPSHOT_OFFSET + CELL_LIMIT * (4 + this.BYTES_PER_CELL_DATA) + 4;
        
         // name text vertex cpu buffers
         this.nameWidths = new Float32Array(256);
@@ -294,7 +305,7 @@ class Renderer {
 
         // 4 bytes per float * 2 triangles * 3 vertices per triangle * 3 floats per vertex = 48
         gl.bindBuffer(gl.ARRAY_BUFFER, this.allocBuffer("pellet_buffer"));
-        gl.bufferData(gl.ARRAY_BUFFER, this.core.HEAPU8.subarray(0, 72 * CELL_LIMIT), gl.DYNAMIC_DRAW);
+        gl.bufferData(gl.ARRAY_BUFFER, this.core.HEAPU8.subarray(0, 72 * this.CELL_LIMIT), gl.DYNAMIC_DRAW);
         
         const size = 3;
         const type = gl.FLOAT;
@@ -312,7 +323,7 @@ class Renderer {
 
         // 4 bytes per float * 2 triangles * 3 vertices per triangle * 2 floats per vertex = 48
         gl.bindBuffer(gl.ARRAY_BUFFER, this.allocBuffer("cell_buffer"));
-        gl.bufferData(gl.ARRAY_BUFFER, this.core.HEAPU8.subarray(0, 48 * CELL_LIMIT), gl.DYNAMIC_DRAW);
+        gl.bufferData(gl.ARRAY_BUFFER, this.core.HEAPU8.subarray(0, 48 * this.CELL_LIMIT), gl.DYNAMIC_DRAW);
         
         const size = 2;
         const type = gl.FLOAT;
@@ -622,7 +633,7 @@ class Renderer {
     }
 
     /** 
-     * @param {Uint16Array} indices_buffer
+     * @param {Uint16Array|Uint32Array} indices_buffer
      * @param {Uint8Array} types_buffer
      */
     buildNameVertexBuffer(indices_buffer, types_buffer) {
@@ -632,6 +643,7 @@ class Renderer {
         const types = types_buffer;
         
         const f32 = this.core.HEAPF32;
+        const { CURR_X, CURR_Y, CURR_SIZE } = this;
 
         const flags  = this.nameFlags;
         const widths = this.nameWidths;
@@ -648,7 +660,7 @@ class Renderer {
         for (let i = 0; i < indices.length; i++) {
 
             const type = types[i];
-            const offset = (indices[i] * this.BYTES_PER_CELL_DATA) >> 2;
+            const id = indices[i];
 
             if (!widths[type]) {
                 flags[i] = 0;
@@ -657,9 +669,9 @@ class Renderer {
             
             flags[i] = 1;
 
-            const x = f32[offset + 4];
-            const y = f32[offset + 5];
-            const s = f32[offset + 6];
+            const x = f32[CURR_X + id];
+            const y = f32[CURR_Y + id];
+            const s = f32[CURR_SIZE + id];
 
             const x1 = NAME_SCALE * widths[type] * s;
             const x0 = -x1;
@@ -690,7 +702,7 @@ class Renderer {
     }
 
     /** 
-     * @param {Uint16Array} indices_buffer
+     * @param {Uint16Array|Uint32Array} indices_buffer
      * @param {Uint8Array} types_buffer
      */
     buildMassVertexBuffer(indices_buffer, types_buffer) {
@@ -700,6 +712,7 @@ class Renderer {
         const types = types_buffer;
         
         const f32 = this.core.HEAPF32;
+        const { CURR_X, CURR_Y, CURR_SIZE } = this;
 
         const counts = this.massCounts;
         const widths = this.massWidths;
@@ -710,7 +723,7 @@ class Renderer {
 
         for (let i = 0; i < indices.length; i++) {
 
-            const offset = (indices[i] * this.BYTES_PER_CELL_DATA) >> 2;
+            const id = indices[i];
 
             const type = types[i];
 
@@ -719,9 +732,9 @@ class Renderer {
                 continue;
             };
 
-            const x = f32[offset + 4];
-            const y = f32[offset + 5];
-            const s = f32[offset + 6];
+            const x = f32[CURR_X + id];
+            const y = f32[CURR_Y + id];
+            const s = f32[CURR_SIZE + id];
             const m = s * s * 0.01;
 
             const mass = long_mass ? Math.round(m).toString() : 
@@ -792,7 +805,10 @@ class Renderer {
 
         this.protocol.replay.update(delta);
 
-        const lerp = this.protocol.lastPacket ? (now - this.protocol.lastPacket) / this.state.draw : 0;
+        const since = this.protocol.lastPacket ? now - this.protocol.lastPacket : 0;
+        const lerp = since / this.state.draw;
+        // Server ticks the next packet is overdue by, cells are extrapolated past the interpolation
+        const late = (since - this.state.draw) / this.protocol.motion.tick;
 
         const { t, b, l, r } = this.viewbox;
 
@@ -802,10 +818,9 @@ class Renderer {
         let pellet_count = 0;
         
         try {
-            const number = this.wasm.update_cells(0, this.INDICES_OFFSET, this.PELLETS_OFFSET,
-                lerp, t, b, l, r, skip);
-            cell_count   = number >> 16;
-            pellet_count = number & 0xFFFF;
+            cell_count = this.wasm.update_cells(0, this.INDICES_OFFSET, this.PELLETS_OFFSET,
+                lerp, late, t, b, l, r, skip, this.PELLET_COUNT_OFFSET);
+            pellet_count = this.core.HEAPU32[this.PELLET_COUNT_OFFSET >> 2];
         } catch (e) {
             console.error(e);
         }
@@ -853,7 +868,7 @@ class Renderer {
 
         const gl = this.gl;
         
-        let vert_ptr = this.PELLETS_OFFSET + (pellet_count << 1);
+        let vert_ptr = this.PELLETS_OFFSET + pellet_count * this.ID_BYTES;
         while (vert_ptr & 3) vert_ptr++;
 
         const end = this.wasm.draw_pellets(0, this.PELLETS_OFFSET, pellet_count, vert_ptr);
@@ -880,8 +895,10 @@ class Renderer {
 
         const gl = this.gl;
         
-        const indices = new Uint16Array(this.core.buffer, this.INDICES_OFFSET, cell_count);
-        const types_ptr = this.INDICES_OFFSET + (cell_count << 1);
+        const indices = this.ID_BYTES === 4 ?
+            new Uint32Array(this.core.buffer, this.INDICES_OFFSET, cell_count) :
+            new Uint16Array(this.core.buffer, this.INDICES_OFFSET, cell_count);
+        const types_ptr = this.INDICES_OFFSET + cell_count * this.ID_BYTES;
         const types = this.core.HEAPU8.subarray(types_ptr, types_ptr + cell_count);
 
         let vert_ptr = types_ptr + cell_count;
@@ -1056,6 +1073,7 @@ class Renderer {
 self.addEventListener("message", async e => {
     const { data } = e;
     const renderer = self.r = new Renderer(data.offscreen);
+    renderer.wideIDs = !!data.wide;
     renderer.stats.setBuffer(data.stats);
     renderer.mouse.setBuffer(data.mouse);
     renderer.state.setBuffer(data.state);
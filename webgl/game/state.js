@@ -82,6 +82,9 @@ module.exports = class State {
 
     set s_tab(v) { Atomics.store(this.buffer, 21, v); }
 
+    get predict() { return Atomics.load(this.buffer, 22); }
+    set predict(v) { Atomics.store(this.buffer, 22, v); }
+
     exchange() {
         return {
             splits: Atomics.exchange(this.buffer, 1, 0),
@@ -1,15 +1,50 @@
+// i8x16.splat + i8x16.popcnt, only validates where wasm simd128 is supported
+const SIMD_PROBE = new Uint8Array([0,97,115,109,1,0,0,0,1,5,1,96,0,1,123,3,2,1,0,10,10,1,8,0,65,0,253,15,253,98,11]);
+
+// Everything the renderer and the protocol call into client.wasm
+const CLIENT_EXPORTS = ["bytes_per_cell_data", "cell_data_bytes", "cell_id_bytes", "cell_limit", "deserialize", "draw_cells",
+    "draw_pellets", "find_text_index", "get_clicked_type", "predict_cells", "restore_cells", "serialize_state",
+    "snapshot_cells", "unpack", "update_cells"];
+
 module.exports = class WasmCore {
     /** @param {import("./renderer")} renderer */
     constructor(renderer) {
         this.renderer = renderer;
     }
-    async load(page = 1024) {
+    /**
+     * Loads the simd build of client.wasm when the browser runs simd128 and the server has it,
+     * the scalar one otherwise
+     * @param {number} page
+     * @param {boolean} wide load the 32 bit cell id build
+     */
+    async load(page = 1024, wide = false) {
         if (this.loading || this.instance) return false;
         this.loading = true;
-        const res = await fetch("/static/wasm/client.wasm");
+        const base = `/static/wasm/client${wide ? "-wide" : ""}`;
+        let module = null;
+        if (WebAssembly.validate(SIMD_PROBE)) {
+            const res = await fetch(`${base}-simd.wasm`).catch(() => null);
+            if (res && res.ok) module = await WebAssembly.compile(await res.arrayBuffer()).catch(() => null);
+        }
+        this.simd = !!module;
+        if (!module) {
+            const res = await fetch(`${base}.wasm`);
+            if (!res.ok) {
+                this.loading = false;
+                throw new Error(`Failed to load ${base}.wasm (${res.status})`);
+            }
+            module = await WebAssembly.compile(await res.arrayBuffer());
+        }
+        const names = WebAssembly.Module.exports(module).map(exp => exp.name);
+        const missing = CLIENT_EXPORTS.filter(name => !names.includes(name));
+        if (missing.length) {
+            this.loading = false;
+            throw new Error(`client.wasm is out of date (missing ${missing.join(", ")}), ` +
+                `rebuild it with "npm run build:wasm"`);
+        }
         const m = new WebAssembly.Memory({ initial: page, maximum: page });
-        const e = { env: { memory: m } };
-        this.instance = await WebAssembly.instantiate(await WebAssembly.compile(await res.arrayBuffer()), e);
+        const e = { env: { memory: m, powf: Math.pow } };
+        this.instance = await WebAssembly.instantiate(module, e);
         this.buffer = m.buffer;
         this.HEAPU8  = new Uint8Array(m.buffer);
         this.HEAPU16 = new Uint16Array(m.buffer);
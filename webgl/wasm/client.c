@@ -1,7 +1,23 @@
 #include "memory.h"
+#include <math.h>
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
 
 #define EATEN_TYPE 251
 
+// Build with -DWIDE_IDS to match a server running 32 bit cell ids
+#ifdef WIDE_IDS
+typedef unsigned int cell_id;
+#define CELL_LIMIT 262144
+#define PACKED __attribute__((packed))
+#else
+typedef unsigned short cell_id;
+#define CELL_LIMIT 65536
+#define PACKED
+#endif
+
+// One cell, the unit of clip snapshots
 typedef struct {
     unsigned int type;
     float oldX;
@@ -13,103 +29,277 @@ typedef struct {
     float netX;
     float netY;
     float netSize;
+} CellState;
+
+// Cell table, one array per field so update_cells reads 4 neighbouring ids per vector.
+// The renderer reads curr x, y and size at float index 4, 5 and 6 * CELL_LIMIT
+typedef struct {
+    unsigned int type[CELL_LIMIT];
+    float oldX[CELL_LIMIT];
+    float oldY[CELL_LIMIT];
+    float oldSize[CELL_LIMIT];
+    float currX[CELL_LIMIT];
+    float currY[CELL_LIMIT];
+    float currSize[CELL_LIMIT];
+    float netX[CELL_LIMIT];
+    float netY[CELL_LIMIT];
+    float netSize[CELL_LIMIT];
+    // Moved between the last two updates (one server tick), carried on when the next packet is late
+    float velX[CELL_LIMIT];
+    float velY[CELL_LIMIT];
+    // Ids live_lo up to live_hi (exclusive) hold every cell, zero for both is no cells so clearing the
+    // table clears the range, the passes over the table stay off the unused ids
+    unsigned int live_lo;
+    unsigned int live_hi;
 } CellData;
 
 typedef struct {
-    unsigned short id;
+    cell_id id;
     unsigned short type;
     short x;
     short y;
     unsigned short size;
-} AddPacket;
+} PACKED AddPacket;
 
 typedef struct {
-    unsigned short id;
+    cell_id id;
     short x;
     short y;
     unsigned short size;
-} UpdatePacket;
+} PACKED UpdatePacket;
+
+typedef struct {
+    cell_id id;
+    cell_id by;
+} PACKED EatPacket;
 
 typedef struct {
-    unsigned short id;
-    unsigned short by;
-} EatPacket;
+    cell_id id;
+} PACKED DeletePacket;
 
+// Dense snapshot entry for the clip buffer, a snapshot is a 0 id terminated list of these
 typedef struct {
-    unsigned short id;
-} DeletePacket;
+    cell_id id;
+    CellState cell;
+} SnapshotEntry;
+
+unsigned int bytes_per_cell_data() { return sizeof(CellData) / CELL_LIMIT; }
+unsigned int cell_data_bytes() { return sizeof(CellData); }
+unsigned int cell_id_bytes() { return sizeof(cell_id); }
+unsigned int cell_limit() { return CELL_LIMIT; }
+
+static inline void live_add(CellData* data, unsigned int id) {
+    if (data->live_hi <= data->live_lo) {
+        data->live_lo = id;
+        data->live_hi = id + 1;
+    } else if (id < data->live_lo) data->live_lo = id;
+    else if (id >= data->live_hi) data->live_hi = id + 1;
+}
 
-unsigned int bytes_per_cell_data() { return sizeof(CellData); }
+static inline void clear_cell(CellData* data, unsigned int id) {
+    data->type[id] = 0;
+    data->oldX[id] = data->oldY[id] = data->oldSize[id] = 0.0f;
+    data->currX[id] = data->currY[id] = data->currSize[id] = 0.0f;
+    data->netX[id] = data->netY[id] = data->netSize[id] = 0.0f;
+    data->velX[id] = data->velY[id] = 0.0f;
+}
 
-void deserialize(CellData data[], unsigned short* packet) {
+void deserialize(CellData* data, cell_id* packet) {
+
+    // Every cell starts the next interpolation where it is drawn (late packets correct smoothly from
+    // the extrapolated position), cells the packet doesn't move stop there. Eaten cells keep their fade.
+    // The live range shrinks to the cells left after the last frame
+    unsigned int lo = data->live_hi, hi = 0;
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        if (!data->type[id]) continue;
+        if (id < lo) lo = id;
+        hi = id + 1;
+        if (!data->netSize[id]) continue;
+        data->oldX[id] = data->currX[id];
+        data->oldY[id] = data->currY[id];
+        data->oldSize[id] = data->currSize[id];
+        data->velX[id] = 0.0f;
+        data->velY[id] = 0.0f;
+    }
+    data->live_lo = hi ? lo : 0;
+    data->live_hi = hi;
 
     AddPacket* add_data = (AddPacket*) packet;
 
     while (add_data->id) {
-        unsigned short id = add_data->id;
-        CellData* cell = &data[id];
+        cell_id id = add_data->id;
 
-        cell->type = add_data->type;
-        cell->oldX = cell->currX = cell->netX = add_data->x;
-        cell->oldY = cell->currY = cell->netY = add_data->y;
-        cell->oldSize = cell->currSize = cell->netSize = add_data->size;
+        data->type[id] = add_data->type;
+        data->oldX[id] = data->currX[id] = data->netX[id] = add_data->x;
+        data->oldY[id] = data->currY[id] = data->netY[id] = add_data->y;
+        data->oldSize[id] = data->currSize[id] = data->netSize[id] = add_data->size;
+        live_add(data, id);
         
         add_data++;
     }
 
-    packet = (unsigned short*) add_data;
+    packet = (cell_id*) add_data;
     packet++;
 
     UpdatePacket* update_data = (UpdatePacket*) packet;
 
     while (update_data->id) {
-        unsigned short id = update_data->id;
-
-        if (data[id].type) {
-            data[id].oldX = data[id].currX;
-            data[id].oldY = data[id].currY;
-            data[id].oldSize = data[id].currSize;
-            data[id].netX = update_data->x;
-            data[id].netY = update_data->y;
-            data[id].netSize = update_data->size;
+        cell_id id = update_data->id;
+
+        if (data->type[id]) {
+            data->velX[id] = update_data->x - data->netX[id];
+            data->velY[id] = update_data->y - data->netY[id];
+            data->netX[id] = update_data->x;
+            data->netY[id] = update_data->y;
+            data->netSize[id] = update_data->size;
         }
 
         update_data++;
     }
 
-    packet = (unsigned short*) update_data;
+    packet = (cell_id*) update_data;
     packet++;
 
     EatPacket* eat_data = (EatPacket*) packet;
 
     while (eat_data->id) {
+        cell_id id = eat_data->id;
+        cell_id by = eat_data->by;
         
-        if (data[eat_data->by].type) {
-            data[eat_data->id].netX = data[eat_data->by].netX;
-            data[eat_data->id].netY = data[eat_data->by].netY;
+        if (data->type[by]) {
+            data->netX[id] = data->netX[by];
+            data->netY[id] = data->netY[by];
 
-            data[eat_data->id].oldX = 0.0f;
-            data[eat_data->id].oldY = 0.0f;
-            data[eat_data->id].netSize = 0.0f;
-        } else {
-            memset(&data[eat_data->id], 0, sizeof(CellData));
-        }
+            data->oldX[id] = 0.0f;
+            data->oldY[id] = 0.0f;
+            data->netSize[id] = 0.0f;
+            data->velX[id] = 0.0f;
+            data->velY[id] = 0.0f;
+        } else clear_cell(data, id);
 
         eat_data++;
     }
 
-    packet = (unsigned short*) eat_data;
+    packet = (cell_id*) eat_data;
     packet++;
 
     DeletePacket* delete_data = (DeletePacket*) packet;
 
     while (delete_data->id) {
-        memset(&data[delete_data->id], 0, sizeof(CellData));
+        clear_cell(data, delete_data->id);
         delete_data++;
     }
 }
 
-void sort_indices(CellData cells[], unsigned short indices[], unsigned int n) {
+// Packed cells packet (OP 13, written by pack in src/c/ogarx.c), rANS tables and the decoded column stream
+// live in work, side modules get no stack
+#define RANS_BITS 12
+#define RANS_SCALE (1 << RANS_BITS)
+#define RANS_L (1u << 23)
+
+typedef struct {
+    unsigned short freq[256];
+    unsigned short start[256];
+    unsigned char symbol[RANS_SCALE];
+} RansTable;
+
+static inline int unzigzag(unsigned int v) { return (int) (v >> 1) ^ -(int) (v & 1); }
+
+static inline unsigned int get_varint(unsigned char** p) {
+    unsigned int v = 0;
+    unsigned int shift = 0;
+    unsigned char b;
+    do {
+        b = *(*p)++;
+        v |= (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+// Rebuild the OP 4 body (what deserialize reads) from a packed packet, returns the write end
+cell_id* unpack(unsigned char* src, unsigned int len, RansTable* work, cell_id* packet) {
+    unsigned char* end = src + len;
+    int cx = (int) *((float*) (src + 17));
+    int cy = (int) *((float*) (src + 21));
+    unsigned char* p = src + 25;
+
+    if (*p++) {
+        unsigned int n = get_varint(&p);
+        unsigned char* present = p;
+        p += 32;
+
+        unsigned int cum = 0;
+        for (unsigned int s = 0; s < 256; s++) {
+            if (!(present[s >> 3] & (1 << (s & 7)))) continue;
+            unsigned int f = get_varint(&p);
+            work->freq[s] = f;
+            work->start[s] = cum;
+            memset(&work->symbol[cum], s, f);
+            cum += f;
+        }
+
+        unsigned char* stream = (unsigned char*) (work + 1);
+        unsigned int x = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+        p += 4;
+
+        for (unsigned int i = 0; i < n; i++) {
+            unsigned char s = work->symbol[x & (RANS_SCALE - 1)];
+            stream[i] = s;
+            x = work->freq[s] * (x >> RANS_BITS) + (x & (RANS_SCALE - 1)) - work->start[s];
+            while (x < RANS_L && p < end) x = (x << 8) | *p++;
+        }
+        p = stream;
+    }
+
+    unsigned int a_n = get_varint(&p);
+    unsigned int u_n = get_varint(&p);
+    unsigned int e_n = get_varint(&p);
+    unsigned int d_n = get_varint(&p);
+    unsigned int id;
+
+    AddPacket* add_data = (AddPacket*) packet;
+    id = 0;
+    for (unsigned int i = 0; i < a_n; i++) add_data[i].id = id += get_varint(&p);
+    for (unsigned int i = 0; i < a_n;) {
+        unsigned int type = get_varint(&p);
+        for (unsigned int run = get_varint(&p); run && i < a_n; run--) add_data[i++].type = type;
+    }
+    for (unsigned int i = 0; i < a_n;) {
+        unsigned int size = get_varint(&p);
+        for (unsigned int run = get_varint(&p); run && i < a_n; run--) add_data[i++].size = size;
+    }
+    for (unsigned int i = 0; i < a_n; i++) add_data[i].x = unzigzag(get_varint(&p)) + cx;
+    for (unsigned int i = 0; i < a_n; i++) add_data[i].y = unzigzag(get_varint(&p)) + cy;
+    packet = (cell_id*) (add_data + a_n);
+    *packet++ = 0;
+
+    UpdatePacket* update_data = (UpdatePacket*) packet;
+    id = 0;
+    for (unsigned int i = 0; i < u_n; i++) update_data[i].id = id += get_varint(&p);
+    for (unsigned int i = 0; i < u_n; i++) update_data[i].x = unzigzag(get_varint(&p)) + cx;
+    for (unsigned int i = 0; i < u_n; i++) update_data[i].y = unzigzag(get_varint(&p)) + cy;
+    for (unsigned int i = 0; i < u_n; i++) update_data[i].size = get_varint(&p);
+    packet = (cell_id*) (update_data + u_n);
+    *packet++ = 0;
+
+    EatPacket* eat_data = (EatPacket*) packet;
+    id = 0;
+    for (unsigned int i = 0; i < e_n; i++) eat_data[i].id = id += get_varint(&p);
+    for (unsigned int i = 0; i < e_n; i++) eat_data[i].by = get_varint(&p);
+    packet = (cell_id*) (eat_data + e_n);
+    *packet++ = 0;
+
+    DeletePacket* delete_data = (DeletePacket*) packet;
+    id = 0;
+    for (unsigned int i = 0; i < d_n; i++) delete_data[i].id = id += get_varint(&p);
+    packet = (cell_id*) (delete_data + d_n);
+    *packet++ = 0;
+
+    return packet;
+}
+
+void sort_indices(CellData* cells, cell_id indices[], unsigned int n) {
     if (!n) return;
     
     int t = 0;
@@ -117,10 +307,10 @@ void sort_indices(CellData cells[], unsigned short indices[], unsigned int n) {
     // Build Max Heap
     for (int i = 1; i < n; i++) { 
         // if child is bigger than parent 
-        if (cells[indices[i]].currSize > cells[indices[(i - 1) / 2]].currSize) {
+        if (cells->currSize[indices[i]] > cells->currSize[indices[(i - 1) / 2]]) {
             int j = i;
             // swap child and parent until parent is bigger 
-            while (cells[indices[j]].currSize > cells[indices[(j - 1) / 2]].currSize) { 
+            while (cells->currSize[indices[j]] > cells->currSize[indices[(j - 1) / 2]]) { 
                 t = indices[j];
                 indices[j] = indices[(j - 1) / 2];
                 indices[(j - 1) / 2] = t;
@@ -144,13 +334,13 @@ void sort_indices(CellData cells[], unsigned short indices[], unsigned int n) {
             // if left child is smaller than  
             // right child point index variable  
             // to right child 
-            if (cells[indices[index]].currSize < cells[indices[index + 1]].currSize && 
-                index < (i - 1)) index++; 
+            if (index < (i - 1) &&
+                cells->currSize[indices[index]] < cells->currSize[indices[index + 1]]) index++; 
           
             // if parent is smaller than child  
             // then swapping parent with child  
             // having higher value 
-            if (cells[indices[j]].currSize < cells[indices[index]].currSize && index < i) {
+            if (index < i && cells->currSize[indices[j]] < cells->currSize[indices[index]]) {
                 t = indices[j];
                 indices[j] = indices[index];
                 indices[index] = t;
@@ -160,66 +350,152 @@ void sort_indices(CellData cells[], unsigned short indices[], unsigned int n) {
     }
 }
 
+// Keep a visible cell for drawing, pellets are drawn in their own batch
+#define CULL_PUSH(id) \
+    if (data->type[id] == 254) pellet_indices[pellet_count++] = (id); \
+    else indices[count++] = (id);
+
+// Returns the cell count and writes the pellet count to pellets (caller memory, side modules have no
+// statics of their own), cell counts can exceed 16 bits with wide ids
 unsigned int update_cells(
-    CellData data[],
-    unsigned short indices[],
-    unsigned short pellet_indices[],
-    float lerp, float t, float b, float l, float r, unsigned char skip) {
+    CellData* data,
+    cell_id indices[],
+    cell_id pellet_indices[],
+    float lerp, float late, float t, float b, float l, float r, unsigned char skip,
+    unsigned int* pellets) {
 
     lerp = lerp > 1 ? 1 : lerp < 0 ? 0 : lerp;
+    // Ticks the packet is overdue past the interpolation, cells carry on with their velocity but slow
+    // down, a lost packet never drifts them more than a tick ahead
+    float ahead = late > 0 ? late / (1 + late) : 0;
+
+    unsigned int count = 0;
+    unsigned int pellet_count = 0;
+
+#ifdef __wasm_simd128__
+    const v128_t zero = wasm_i32x4_splat(0);
+    const v128_t zerof = wasm_f32x4_splat(0.0f);
+    const v128_t two = wasm_f32x4_splat(2.0f);
+    const v128_t fade = wasm_f32x4_splat(lerp * 0.5f);
+    const v128_t vlerp = wasm_f32x4_splat(lerp);
+    const v128_t vahead = wasm_f32x4_splat(ahead);
+    const v128_t vt = wasm_f32x4_splat(t);
+    const v128_t vb = wasm_f32x4_splat(b);
+    const v128_t vl = wasm_f32x4_splat(l);
+    const v128_t vr = wasm_f32x4_splat(r);
+
+    // Lanes outside the live range are empty and skipped like any other empty lane
+    unsigned int end = (data->live_hi + 3) & ~3u;
+    for (unsigned int i = data->live_lo & ~3u; i < end; i += 4) {
+        v128_t type = wasm_v128_load(&data->type[i]);
+        if (!wasm_v128_any_true(type)) continue;
+
+        v128_t alive = wasm_i32x4_ne(type, zero);
+        v128_t netSize = wasm_v128_load(&data->netSize[i]);
+        // Eaten cells (no net size) chase the eater from where they are drawn and fade out
+        v128_t eaten = wasm_v128_and(alive, wasm_f32x4_eq(netSize, zerof));
+
+        v128_t oldX = wasm_v128_load(&data->oldX[i]);
+        v128_t fromX = wasm_v128_bitselect(wasm_v128_load(&data->currX[i]), oldX, eaten);
+        v128_t fromY = wasm_v128_bitselect(wasm_v128_load(&data->currY[i]), wasm_v128_load(&data->oldY[i]), eaten);
+        v128_t fromSize = wasm_v128_bitselect(wasm_v128_load(&data->currSize[i]), wasm_v128_load(&data->oldSize[i]), eaten);
+
+        v128_t x = wasm_f32x4_add(fromX, wasm_f32x4_mul(vlerp, wasm_f32x4_sub(wasm_v128_load(&data->netX[i]), fromX)));
+        v128_t y = wasm_f32x4_add(fromY, wasm_f32x4_mul(vlerp, wasm_f32x4_sub(wasm_v128_load(&data->netY[i]), fromY)));
+        x = wasm_f32x4_add(x, wasm_f32x4_mul(vahead, wasm_v128_load(&data->velX[i])));
+        y = wasm_f32x4_add(y, wasm_f32x4_mul(vahead, wasm_v128_load(&data->velY[i])));
+        v128_t size = wasm_f32x4_add(fromSize, wasm_f32x4_mul(vlerp, wasm_f32x4_sub(netSize, fromSize)));
+        wasm_v128_store(&data->currX[i], x);
+        wasm_v128_store(&data->currY[i], y);
+        wasm_v128_store(&data->currSize[i], size);
+
+        oldX = wasm_v128_bitselect(wasm_f32x4_add(oldX, fade), oldX, eaten);
+        wasm_v128_store(&data->oldX[i], oldX);
+
+        v128_t expired = wasm_v128_and(eaten, wasm_f32x4_ge(oldX, two));
+        if (wasm_v128_any_true(expired)) {
+            unsigned int mask = wasm_i32x4_bitmask(expired);
+            for (unsigned int j = 0; j < 4; j++)
+                if (mask & (1 << j)) clear_cell(data, i + j);
+            alive = wasm_v128_andnot(alive, expired);
+        }
 
-    unsigned short count = 0;
-    unsigned short pellet_count = 0;
-
-    CellData* end = &data[65536];
-    CellData* node = data;
-
-    while (node < end) {
-        if (node->type) {
-            if (!node->netSize) {
-                node->currX = lerp * (node->netX - node->currX) + node->currX;
-                node->currY = lerp * (node->netY - node->currY) + node->currY;
-                node->currSize = lerp * (node->netSize - node->currSize) + node->currSize;
-                node->oldX += lerp * 0.5f;
-                if (node->oldX >= 2.0f) memset(node, 0, sizeof(CellData));
-            } else {
-                node->currX = lerp * (node->netX - node->oldX) + node->oldX;
-                node->currY = lerp * (node->netY - node->oldY) + node->oldY;
-                node->currSize = lerp * (node->netSize - node->oldSize) + node->oldSize;
-            }
+        v128_t visible = wasm_v128_and(
+            wasm_v128_and(alive, wasm_f32x4_lt(wasm_f32x4_sub(x, size), vr)),
+            wasm_v128_and(wasm_f32x4_gt(wasm_f32x4_add(x, size), vl),
+                wasm_v128_and(wasm_f32x4_lt(wasm_f32x4_sub(y, size), vt), wasm_f32x4_gt(wasm_f32x4_add(y, size), vb))));
 
-            if (node->type &&
-                node->currX - node->currSize < r &&
-                node->currX + node->currSize > l &&
-                node->currY - node->currSize < t &&
-                node->currY + node->currSize > b) {
-
-                if (node->type == 254) {
-                    pellet_indices[pellet_count++] = node - data;
-                } else {
-                    indices[count++] = node - data;
-                }
+        for (unsigned int mask = wasm_i32x4_bitmask(visible); mask; mask &= mask - 1) {
+            unsigned int id = i + __builtin_ctz(mask);
+            CULL_PUSH(id);
+        }
+    }
+#else
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        if (!data->type[id]) continue;
+
+        if (!data->netSize[id]) {
+            data->currX[id] = lerp * (data->netX[id] - data->currX[id]) + data->currX[id];
+            data->currY[id] = lerp * (data->netY[id] - data->currY[id]) + data->currY[id];
+            data->currSize[id] = lerp * (data->netSize[id] - data->currSize[id]) + data->currSize[id];
+            data->oldX[id] += lerp * 0.5f;
+            if (data->oldX[id] >= 2.0f) {
+                clear_cell(data, id);
+                continue;
             }
+        } else {
+            data->currX[id] = lerp * (data->netX[id] - data->oldX[id]) + data->oldX[id] + ahead * data->velX[id];
+            data->currY[id] = lerp * (data->netY[id] - data->oldY[id]) + data->oldY[id] + ahead * data->velY[id];
+            data->currSize[id] = lerp * (data->netSize[id] - data->oldSize[id]) + data->oldSize[id];
+        }
+
+        float x = data->currX[id];
+        float y = data->currY[id];
+        float size = data->currSize[id];
+
+        if (x - size < r && x + size > l && y - size < t && y + size > b) {
+            CULL_PUSH(id);
         }
-        node++;
     }
+#endif
 
     if (!skip) sort_indices(data, indices, count);
 
     unsigned char* types = (unsigned char*) (indices + count);
 
     for (unsigned int i = 0; i < count; i++)
-        *types++ = data[indices[i]].type;
+        *types++ = data->type[indices[i]];
 
-    return pellet_count | ((unsigned int) count << 16);
+    *pellets = pellet_count;
+    return count;
+}
+
+// Own cells head for the mouse at the speed update_player_cells (src/c/core.c) moves them, instead of
+// carrying on with the velocity of the last packet
+void predict_cells(CellData* data, unsigned int type, float mouse_x, float mouse_y, float speed, float dt) {
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        if (data->type[id] != type || !data->netSize[id]) continue;
+
+        float dx = mouse_x - data->netX[id];
+        float dy = mouse_y - data->netY[id];
+        float d = sqrtf(dx * dx + dy * dy);
+        if (d < 1) {
+            data->velX[id] = data->velY[id] = 0.0f;
+            continue;
+        }
+        float v = 1.76f * powf(data->netSize[id], -0.4396754f) * speed;
+        float m = (v < d ? v : d) * dt;
+        data->velX[id] = dx / d * m;
+        data->velY[id] = dy / d * m;
+    }
 }
 
-float* draw_cells(CellData data[], unsigned short indices[], unsigned int n, float* out) {
+float* draw_cells(CellData* data, cell_id indices[], unsigned int n, float* out) {
     for (unsigned int i = 0; i < n; i++) {
-        CellData* cell = &data[indices[i]];
-        float x = cell->currX;
-        float y = cell->currY;
-        float r = cell->currSize;
+        cell_id id = indices[i];
+        float x = data->currX[id];
+        float y = data->currY[id];
+        float r = data->currSize[id];
 
         float x0 = x - r;
         float x1 = x + r;
@@ -245,14 +521,13 @@ float* draw_cells(CellData data[], unsigned short indices[], unsigned int n, flo
     return out;
 }
 
-float* draw_pellets(CellData data[], unsigned short indices[], unsigned int n, float* out) {
+float* draw_pellets(CellData* data, cell_id indices[], unsigned int n, float* out) {
     for (unsigned int i = 0; i < n; i++) {
-        unsigned short id = indices[i];
-        CellData* cell = &data[id];
+        cell_id id = indices[i];
 
-        float x = cell->currX;
-        float y = cell->currY;
-        float r = cell->currSize;
+        float x = data->currX[id];
+        float y = data->currY[id];
+        float r = data->currSize[id];
 
         float x0 = x - r;
         float x1 = x + r;
@@ -284,53 +559,48 @@ float* draw_pellets(CellData data[], unsigned short indices[], unsigned int n, f
     return out;
 }
 
-unsigned char get_clicked_type(CellData data[], float x, float y) {
-    
-    CellData* end = &data[65536];
-    CellData* node = data;
+unsigned char get_clicked_type(CellData* data, float x, float y) {
 
     unsigned char click_type = 0;
     float max_size = 0;
 
-    while (node < end) {
-        if (node->type && node->type <= 250 && 
-            node->currSize > max_size &&
-            (node->currX - x) * (node->currX - x) + 
-                (node->currY - y) * (node->currY - y) < node->currSize * node->currSize) {
-            max_size = node->currSize;
-            click_type = node->type;
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        unsigned int type = data->type[id];
+        float size = data->currSize[id];
+        if (type && type <= 250 && size > max_size) {
+            float dx = data->currX[id] - x;
+            float dy = data->currY[id] - y;
+            if (dx * dx + dy * dy < size * size) {
+                max_size = size;
+                click_type = type;
+            }
         }
-        node++;
     }
 
     return click_type;
 }
 
-unsigned int find_text_index(CellData data[], unsigned short indices[], unsigned int n, float cutoff) {
+unsigned int find_text_index(CellData* data, cell_id indices[], unsigned int n, float cutoff) {
     for (unsigned int i = 0; i < n; i ++)
-        if (data[indices[i]].currSize > cutoff) return i;
+        if (data->currSize[indices[i]] > cutoff) return i;
     return n;
 }
 
-unsigned short* serialize_state(CellData data[], AddPacket* packet) {
+cell_id* serialize_state(CellData* data, AddPacket* packet) {
 
-    CellData* end = &data[65536];
-    CellData* node = data;
-
-    while (node < end) {
-        if (node->type && node->netSize) {
-            packet->id = node - data;
-            packet->type = node->type;
-            packet->x = node->currX;
-            packet->y = node->currY;
-            packet->size = node->currSize;
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        if (data->type[id] && data->netSize[id]) {
+            packet->id = id;
+            packet->type = data->type[id];
+            packet->x = data->currX[id];
+            packet->y = data->currY[id];
+            packet->size = data->currSize[id];
             packet++;
         }
-        node++;
     }
 
     // Add padding 0 bytes for a valid packet
-    unsigned short* ptr = (unsigned short*) packet;
+    cell_id* ptr = (cell_id*) packet;
     *ptr++ = 0;
     *ptr++ = 0;
     *ptr++ = 0;
@@ -338,3 +608,50 @@ unsigned short* serialize_state(CellData data[], AddPacket* packet) {
     
     return ptr;
 }
+
+// Write every active cell to out, returns the end pointer (after the 0 id terminator)
+cell_id* snapshot_cells(CellData* data, SnapshotEntry* out) {
+
+    for (unsigned int id = data->live_lo; id < data->live_hi; id++) {
+        if (data->type[id]) {
+            out->id = id;
+            out->cell.type = data->type[id];
+            out->cell.oldX = data->oldX[id];
+            out->cell.oldY = data->oldY[id];
+            out->cell.oldSize = data->oldSize[id];
+            out->cell.currX = data->currX[id];
+            out->cell.currY = data->currY[id];
+            out->cell.currSize = data->currSize[id];
+            out->cell.netX = data->netX[id];
+            out->cell.netY = data->netY[id];
+            out->cell.netSize = data->netSize[id];
+            out++;
+        }
+    }
+
+    cell_id* ptr = (cell_id*) out;
+    *ptr++ = 0;
+
+    return ptr;
+}
+
+// Clear the cell table and load a snapshot written by snapshot_cells
+void restore_cells(CellData* data, SnapshotEntry* in) {
+    memset(data, 0, sizeof(CellData));
+
+    while (in->id) {
+        cell_id id = in->id;
+        live_add(data, id);
+        data->type[id] = in->cell.type;
+        data->oldX[id] = in->cell.oldX;
+        data->oldY[id] = in->cell.oldY;
+        data->oldSize[id] = in->cell.oldSize;
+        data->currX[id] = in->cell.currX;
+        data->currY[id] = in->cell.currY;
+        data->currSize[id] = in->cell.currSize;
+        data->netX[id] = in->cell.netX;
+        data->netY[id] = in->cell.netY;
+        data->netSize[id] = in->cell.netSize;
+        in++;
+    }
+}
@@ -1 +1,4 @@
-emcc -O2 -s SIDE_MODULE=1 -mbulk-memory ./client.c -o ../../public/static/wasm/client.wasm
\ No newline at end of file
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory ./client.c -o ../../public/static/wasm/client.wasm
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -DWIDE_IDS ./client.c -o ../../public/static/wasm/client-wide.wasm
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -msimd128 ./client.c -o ../../public/static/wasm/client-simd.wasm
+emcc -O2 -s SIDE_MODULE=1 -mbulk-memory -msimd128 -DWIDE_IDS ./client.c -o ../../public/static/wasm/client-wide-simd.wasm
\ No newline at end of file